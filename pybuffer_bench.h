@@ -0,0 +1,383 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2020 Kuberan Naganathan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <time.h>
+
+
+// Small self contained benchmark harness modelled on Google Benchmark so no extra dependency has to be
+// cloned and built. A benchmark is a function taking pybuffer_bench::state& which runs its hot path once
+// per pass of `for (auto _: state)`. The runner grows the iteration count until a run lasts at least
+// min_time and reports per iteration wall and cpu time. Output is JSON in the layout Google Benchmark
+// writes so existing comparison tooling can read it.
+
+
+namespace pybuffer_bench
+{
+    // Prevents the compiler from discarding a value computed only for timing
+    template <typename T>
+    inline void do_not_optimize(const T& value)
+    {
+        asm volatile("" : : "r,m"(value) : "memory");
+    }
+
+
+    inline double thread_cpu_seconds()
+    {
+        timespec now;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+        return now.tv_sec + now.tv_nsec * 1e-9;
+    }
+
+
+    class state
+    {
+    public:
+        // Marked unused so `for (auto _: state)` does not warn
+        struct __attribute__((unused)) value {};
+
+        struct iterator
+        {
+            state * m_state;
+            size_t m_remaining;
+
+            bool operator != (const iterator&) const
+            {
+                if (m_remaining)
+                    return true;
+                m_state->stop();
+                return false;
+            }
+
+            void operator ++ ()
+            {
+                --m_remaining;
+            }
+
+            value operator * () const
+            {
+                return value();
+            }
+        };
+
+        state(size_t iterations, long arg, size_t thread_index, size_t thread_count):
+            m_iterations(iterations),
+            m_arg(arg),
+            m_thread_index(thread_index),
+            m_thread_count(thread_count),
+            m_items_processed(0),
+            m_paused_wall(0),
+            m_paused_cpu(0)
+        {
+        }
+
+        iterator begin()
+        {
+            start();
+            return iterator{this, m_iterations};
+        }
+
+        iterator end()
+        {
+            return iterator{this, 0};
+        }
+
+        // Excludes setup work inside the loop from the measurement
+        void pause_timing()
+        {
+            m_pause_wall = std::chrono::steady_clock::now();
+            m_pause_cpu = thread_cpu_seconds();
+        }
+
+        void resume_timing()
+        {
+            m_paused_wall += std::chrono::duration<double>(std::chrono::steady_clock::now() - m_pause_wall).count();
+            m_paused_cpu += thread_cpu_seconds() - m_pause_cpu;
+        }
+
+        size_t iterations() const { return m_iterations; }
+        long arg() const { return m_arg; }
+        size_t thread_index() const { return m_thread_index; }
+        size_t thread_count() const { return m_thread_count; }
+        void set_items_processed(size_t items) { m_items_processed = items; }
+        size_t items_processed() const { return m_items_processed; }
+        double wall_seconds() const { return m_wall; }
+        double cpu_seconds() const { return m_cpu; }
+
+    private:
+        void start()
+        {
+            m_start_cpu = thread_cpu_seconds();
+            m_start_wall = std::chrono::steady_clock::now();
+        }
+
+        void stop()
+        {
+            m_wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start_wall).count() - m_paused_wall;
+            m_cpu = thread_cpu_seconds() - m_start_cpu - m_paused_cpu;
+        }
+
+        size_t m_iterations;
+        long m_arg;
+        size_t m_thread_index;
+        size_t m_thread_count;
+        size_t m_items_processed;
+        std::chrono::steady_clock::time_point m_start_wall;
+        std::chrono::steady_clock::time_point m_pause_wall;
+        double m_start_cpu;
+        double m_pause_cpu;
+        double m_paused_wall;
+        double m_paused_cpu;
+        double m_wall = 0;
+        double m_cpu = 0;
+    };
+
+
+    struct benchmark
+    {
+        std::string m_name;
+        std::function<void(state&)> m_fn;
+        std::vector<long> m_args;
+        std::vector<size_t> m_threads;
+
+        // Runs the benchmark once per value. The value is available as state.arg()
+        benchmark& args(std::initializer_list<long> values)
+        {
+            m_args.assign(values);
+            return *this;
+        }
+
+        // Runs the benchmark concurrently on each number of threads. Threads start together.
+        benchmark& threads(std::initializer_list<size_t> values)
+        {
+            m_threads.assign(values);
+            return *this;
+        }
+    };
+
+
+    inline std::vector<benchmark>& registry()
+    {
+        static std::vector<benchmark> benchmarks;
+        return benchmarks;
+    }
+
+
+    inline benchmark& register_benchmark(const char * name, std::function<void(state&)> fn)
+    {
+        registry().push_back(benchmark{name, fn, {}, {}});
+        return registry().back();
+    }
+
+
+    struct result
+    {
+        std::string m_name;
+        size_t m_iterations;
+        double m_real_ns; // per iteration
+        double m_cpu_ns; // per iteration, averaged over threads
+        double m_items_per_second;
+    };
+
+
+    // Runs fn with iterations passes on thread_count threads released together
+    inline result run_once(const benchmark& bench, long arg, size_t thread_count, size_t iterations)
+    {
+        std::vector<state> states;
+        for (size_t index = 0; index < thread_count; ++index)
+            states.emplace_back(iterations, arg, index, thread_count);
+
+        if (thread_count == 1)
+        {
+            bench.m_fn(states[0]);
+        }
+        else
+        {
+            std::mutex lock;
+            std::condition_variable go;
+            bool started = false;
+            std::vector<std::thread> threads;
+            for (size_t index = 0; index < thread_count; ++index)
+            {
+                threads.emplace_back([&, index]() {
+                    {
+                        std::unique_lock<std::mutex> guard(lock);
+                        go.wait(guard, [&]() { return started; });
+                    }
+                    bench.m_fn(states[index]);
+                });
+            }
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                started = true;
+            }
+            go.notify_all();
+            for (auto& thread: threads)
+                thread.join();
+        }
+
+        double wall = 0, cpu = 0;
+        size_t items = 0;
+        for (auto& item: states)
+        {
+            wall = std::max(wall, item.wall_seconds());
+            cpu += item.cpu_seconds();
+            items += item.items_processed();
+        }
+
+        result out;
+        out.m_iterations = iterations;
+        out.m_real_ns = wall * 1e9 / iterations;
+        out.m_cpu_ns = cpu * 1e9 / iterations / thread_count;
+        out.m_items_per_second = items && wall > 0 ? items / wall : 0;
+        return out;
+    }
+
+
+    // Grows the iteration count until a run takes min_time seconds then reports that run
+    inline result run(const benchmark& bench, long arg, size_t thread_count, double min_time)
+    {
+        size_t iterations = 1;
+        for (;;)
+        {
+            result out = run_once(bench, arg, thread_count, iterations);
+            const double seconds = out.m_real_ns * iterations * 1e-9;
+            if (seconds >= min_time || iterations >= 1000000000)
+                return out;
+
+            // Aim 40% past min_time from the measured rate but never grow more than 10x in one step
+            double multiplier = seconds > 0 ? min_time * 1.4 / seconds : 10.0;
+            iterations = static_cast<size_t>(iterations * std::min(std::max(multiplier, 2.0), 10.0));
+        }
+    }
+
+
+    inline std::string _json_escape(const std::string& text)
+    {
+        std::string escaped;
+        for (char c: text)
+        {
+            if (c == '"' || c == '\\')
+                escaped += '\\';
+            escaped += c;
+        }
+        return escaped;
+    }
+
+
+    // Command line: --filter=<substring> --min_time=<seconds> --out=<file>. JSON goes to stdout unless --out
+    // is given. Progress is written to stderr.
+    inline int run_all(int argc, char ** argv)
+    {
+        std::string filter;
+        std::string out_path;
+        double min_time = 0.2;
+        for (int index = 1; index < argc; ++index)
+        {
+            const char * arg = argv[index];
+            if (!std::strncmp(arg, "--filter=", 9))
+                filter = arg + 9;
+            else if (!std::strncmp(arg, "--min_time=", 11))
+                min_time = std::stod(arg + 11);
+            else if (!std::strncmp(arg, "--out=", 6))
+                out_path = arg + 6;
+            else
+            {
+                std::fprintf(stderr, "usage: %s [--filter=<substring>] [--min_time=<seconds>] [--out=<file>]\n", argv[0]);
+                return 1;
+            }
+        }
+
+        std::vector<result> results;
+        for (auto& bench: registry())
+        {
+            std::vector<long> args = bench.m_args.empty() ? std::vector<long>{-1} : bench.m_args;
+            std::vector<size_t> threads = bench.m_threads.empty() ? std::vector<size_t>{1} : bench.m_threads;
+            for (long arg: args)
+            {
+                for (size_t thread_count: threads)
+                {
+                    std::string name = bench.m_name;
+                    if (arg >= 0)
+                        name += "/" + std::to_string(arg);
+                    if (!bench.m_threads.empty())
+                        name += "/threads:" + std::to_string(thread_count);
+                    if (name.find(filter) == std::string::npos)
+                        continue;
+
+                    result out = run(bench, arg, thread_count, min_time);
+                    out.m_name = name;
+                    std::fprintf(stderr, "%-60s %14.1f ns %14.1f ns %12zu\n", name.c_str(), out.m_real_ns, out.m_cpu_ns,
+                                 out.m_iterations);
+                    results.push_back(out);
+                }
+            }
+        }
+
+        FILE * out_file = out_path.empty() ? stdout : std::fopen(out_path.c_str(), "w");
+        if (!out_file)
+        {
+            std::perror(out_path.c_str());
+            return 1;
+        }
+
+        char date[64];
+        std::time_t now = std::time(nullptr);
+        std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+        std::fprintf(out_file, "{\n  \"context\": {\n    \"date\": \"%s\",\n    \"num_cpus\": %u,\n", date,
+                     std::thread::hardware_concurrency());
+#ifdef NDEBUG
+        std::fprintf(out_file, "    \"library_build_type\": \"release\"\n  },\n");
+#else
+        std::fprintf(out_file, "    \"library_build_type\": \"debug\"\n  },\n");
+#endif
+        std::fprintf(out_file, "  \"benchmarks\": [\n");
+        for (size_t index = 0; index < results.size(); ++index)
+        {
+            const result& out = results[index];
+            std::fprintf(out_file, "    {\n      \"name\": \"%s\",\n      \"run_type\": \"iteration\",\n"
+                         "      \"iterations\": %zu,\n      \"real_time\": %.3f,\n      \"cpu_time\": %.3f,\n"
+                         "      \"time_unit\": \"ns\"", _json_escape(out.m_name).c_str(), out.m_iterations,
+                         out.m_real_ns, out.m_cpu_ns);
+            if (out.m_items_per_second > 0)
+                std::fprintf(out_file, ",\n      \"items_per_second\": %.3f", out.m_items_per_second);
+            std::fprintf(out_file, "\n    }%s\n", index + 1 < results.size() ? "," : "");
+        }
+        std::fprintf(out_file, "  ]\n}\n");
+
+        if (out_file != stdout)
+            std::fclose(out_file);
+        return 0;
+    }
+}
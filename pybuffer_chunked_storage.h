@@ -0,0 +1,566 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2020 Kuberan Naganathan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include "pybuffer_storage.h"
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <utility>
+#include <vector>
+
+
+// Storage for long lived segments that see positional inserts and removes away from the end. vector_storage
+// moves the whole tail on every such change. chunked_storage keeps the elements in contiguous chunks of at most
+// chunk_rows elements and finds the chunk holding a position through a Fenwick tree over the chunk sizes, so a
+// positional insert or remove touches one chunk plus O(log chunks) index entries. Each chunk is still one
+// contiguous buffer and can be exported on its own, e.g. through PyBufferRegionWrapper with the storage as owner.
+
+
+namespace pybuffer_container
+{
+    template <typename T, typename Allocator = std::allocator<T>>
+    class chunked_storage: public snapshot_container::storage_base<T, 48, virtual_iter::rand_iter<T, 48>>
+    {
+    public:
+        static const size_t npos = 0xFFFFFFFFFFFFFFFF;
+        static const size_t default_chunk_rows = 4096;
+        typedef typename snapshot_container::storage_base<T, 48, virtual_iter::rand_iter<T,48>> storage_base_t;
+        using storage_base_t::iter_mem_size;
+        typedef T value_type;
+        typedef Allocator allocator_type;
+        typedef std::vector<T, Allocator> chunk_type;
+        typedef std::shared_ptr<chunked_storage<T, Allocator>> shared_t;
+        typedef std::shared_ptr<storage_base_t> shared_base_t;
+        using fwd_iter_type = typename storage_base_t::fwd_iter_type;
+        using rand_iter_type = typename storage_base_t::rand_iter_type;
+        typedef virtual_iter::rand_iter<T,48> storage_iter_type;
+
+        // Positional iterator. Dereferencing locates the chunk through the index so it costs O(log chunks).
+        class const_iterator
+        {
+        public:
+            typedef std::random_access_iterator_tag iterator_category;
+            typedef T value_type;
+            typedef std::ptrdiff_t difference_type;
+            typedef const T* pointer;
+            typedef const T& reference;
+
+            const_iterator(): m_storage(nullptr), m_pos(0) {}
+            const_iterator(const chunked_storage * storage, size_t pos): m_storage(storage), m_pos(pos) {}
+
+            reference operator * () const { return (*m_storage)[m_pos]; }
+            pointer operator -> () const { return &(*m_storage)[m_pos]; }
+            reference operator [] (difference_type offset) const { return (*m_storage)[m_pos + offset]; }
+
+            const_iterator& operator ++ () { ++m_pos; return *this; }
+            const_iterator operator ++ (int) { const_iterator previous(*this); ++m_pos; return previous; }
+            const_iterator& operator -- () { --m_pos; return *this; }
+            const_iterator operator -- (int) { const_iterator previous(*this); --m_pos; return previous; }
+            const_iterator& operator += (difference_type offset) { m_pos += offset; return *this; }
+            const_iterator& operator -= (difference_type offset) { m_pos -= offset; return *this; }
+            const_iterator operator + (difference_type offset) const { return const_iterator(m_storage, m_pos + offset); }
+            const_iterator operator - (difference_type offset) const { return const_iterator(m_storage, m_pos - offset); }
+            difference_type operator - (const const_iterator& rhs) const
+            {
+                return static_cast<difference_type>(m_pos) - static_cast<difference_type>(rhs.m_pos);
+            }
+
+            bool operator == (const const_iterator& rhs) const { return m_pos == rhs.m_pos; }
+            bool operator != (const const_iterator& rhs) const { return m_pos != rhs.m_pos; }
+            bool operator < (const const_iterator& rhs) const { return m_pos < rhs.m_pos; }
+            bool operator > (const const_iterator& rhs) const { return m_pos > rhs.m_pos; }
+            bool operator <= (const const_iterator& rhs) const { return m_pos <= rhs.m_pos; }
+            bool operator >= (const const_iterator& rhs) const { return m_pos >= rhs.m_pos; }
+
+        private:
+            const chunked_storage * m_storage;
+            size_t m_pos;
+        };
+
+        void append(const T& value) override
+        {
+            insert(m_size, value);
+        }
+
+        void append(const fwd_iter_type& start_pos, const fwd_iter_type& end_pos) override
+        {
+            insert_range(m_size, fwd_iter_type(start_pos), end_pos);
+        }
+
+        void append(const rand_iter_type& start_pos, const rand_iter_type& end_pos) override
+        {
+            insert_range(m_size, rand_iter_type(start_pos), end_pos);
+        }
+
+        // Bulk append from a contiguous source
+        void append(const T * start_pos, const T * end_pos)
+        {
+            insert_range(m_size, start_pos, end_pos);
+        }
+
+        shared_base_t copy(size_t start_index = 0, size_t end_index = npos) const override;
+
+        void insert(size_t index, const T& value) override;
+
+        void insert(size_t index, const fwd_iter_type& start_pos, const fwd_iter_type& end_pos) override
+        {
+            insert_range(index, fwd_iter_type(start_pos), end_pos);
+        }
+
+        void insert(size_t index, const rand_iter_type& start_pos, const rand_iter_type& end_pos) override
+        {
+            insert_range(index, rand_iter_type(start_pos), end_pos);
+        }
+
+        // Bulk insert from a contiguous source
+        void insert(size_t index, const T * start_pos, const T * end_pos)
+        {
+            insert_range(index, start_pos, end_pos);
+        }
+
+        void remove(size_t index) override;
+
+        void remove(size_t start_index, size_t end_index) override;
+
+        size_t size() const override
+        {return m_size;}
+
+        const T& operator[](size_t index) const override
+        {
+            auto location = locate(index);
+            return m_chunks[location.first][location.second];
+        }
+
+        T& operator[](size_t index) override
+        {
+            auto location = locate(index);
+            return m_chunks[location.first][location.second];
+        }
+
+        const storage_iter_type begin() const override
+        {
+            return storage_iter_type(_iter_impl, const_iterator(this, 0));
+        }
+
+        const storage_iter_type end() const override
+        {
+            return storage_iter_type(_iter_impl, const_iterator(this, m_size));
+        }
+
+        const storage_iter_type iterator(size_t offset) const override
+        {
+            return storage_iter_type(_iter_impl, const_iterator(this, std::min(offset, m_size)));
+        }
+
+        storage_iter_type begin() override
+        {
+            return storage_iter_type(_iter_impl, const_iterator(this, 0));
+        }
+
+        storage_iter_type end() override
+        {
+            return storage_iter_type(_iter_impl, const_iterator(this, m_size));
+        }
+
+        storage_iter_type iterator(size_t offset) override
+        {
+            return storage_iter_type(_iter_impl, const_iterator(this, std::min(offset, m_size)));
+        }
+
+        size_t id() const override
+        {
+            return m_storage_id;
+        }
+
+        // Chunk access for zero copy export. Chunks are never empty. Pointers are valid until the next mutation.
+        size_t chunk_count() const
+        {
+            return m_chunks.size();
+        }
+
+        size_t chunk_size(size_t chunk) const
+        {
+            return m_chunks[chunk].size();
+        }
+
+        const T* chunk_data(size_t chunk) const
+        {
+            return m_chunks[chunk].data();
+        }
+
+        T* chunk_data(size_t chunk)
+        {
+            return m_chunks[chunk].data();
+        }
+
+        // Position of the first element of chunk within the storage
+        size_t chunk_start(size_t chunk) const
+        {
+            size_t start = 0;
+            for (size_t node = chunk; node; node -= node & (~node + 1))
+                start += m_index[node];
+            return start;
+        }
+
+        size_t chunk_rows() const
+        {
+            return m_chunk_rows;
+        }
+
+        static shared_t create(size_t chunk_rows = default_chunk_rows, const Allocator& allocator = Allocator())
+        {
+            return std::allocate_shared<chunked_storage<T, Allocator>>(allocator, chunk_rows, allocator);
+        }
+
+        template <typename InputIter>
+        static shared_t create(InputIter start_pos, InputIter end_pos, size_t chunk_rows = default_chunk_rows,
+                               const Allocator& allocator = Allocator())
+        {
+            auto storage = create(chunk_rows, allocator);
+            storage->insert_range(0, start_pos, end_pos);
+            return storage;
+        }
+
+        explicit chunked_storage(size_t chunk_rows = default_chunk_rows, const Allocator& allocator = Allocator()):
+        m_chunks(),
+        m_index(1, 0),
+        m_size(0),
+        m_chunk_rows(std::max<size_t>(chunk_rows, 4)),
+        m_allocator(allocator),
+        m_storage_id(storage_base_t::generate_storage_id())
+        {}
+
+        // All construction is through the storage creator mechanism
+        chunked_storage(const chunked_storage<T, Allocator>& rhs) = delete;
+        chunked_storage(chunked_storage<T, Allocator>&& rhs) = delete;
+
+    private:
+        // Returns the chunk holding index and the offset within it. index == size() maps to the end of the last
+        // chunk so it can be used as an insert position.
+        std::pair<size_t, size_t> locate(size_t index) const;
+
+        // m_index is a 1 based Fenwick tree: m_index[node] holds the total size of the chunks in
+        // (node - lowbit(node), node]. Rebuilt in O(chunks) whenever chunks are split, merged or dropped.
+        void index_add(size_t chunk, std::ptrdiff_t delta)
+        {
+            for (size_t node = chunk + 1; node < m_index.size(); node += node & (~node + 1))
+                m_index[node] += delta;
+        }
+
+        void rebuild_index();
+
+        // Folds chunk into a neighbour when it has shrunk below a quarter of chunk_rows and the result fits in
+        // three quarters. The gap between the split and merge thresholds keeps a chunk from bouncing between
+        // the two on alternating inserts and removes.
+        bool merge_small(size_t chunk);
+
+        template <typename InputIter>
+        void insert_range(size_t index, InputIter start_pos, InputIter end_pos);
+
+        static virtual_iter::std_rand_iter_impl<const_iterator, iter_mem_size> _iter_impl;
+        std::vector<chunk_type> m_chunks;
+        std::vector<size_t> m_index;
+        size_t m_size;
+        size_t m_chunk_rows;
+        Allocator m_allocator;
+        size_t m_storage_id;
+    };
+
+
+    template <typename T, typename Allocator>
+    std::pair<size_t, size_t> chunked_storage<T, Allocator>::locate(size_t index) const
+    {
+        const size_t chunk_count = m_chunks.size();
+        if (index >= m_size)
+            return chunk_count ? std::make_pair(chunk_count - 1, m_chunks.back().size()) : std::make_pair<size_t, size_t>(0, 0);
+
+        // Descend the tree from the highest power of two, keeping the largest prefix of chunks whose total
+        // size does not exceed index. The chunk after that prefix holds the element.
+        size_t node = 0;
+        size_t remaining = index;
+        size_t step = 1;
+        while (step * 2 <= chunk_count)
+            step *= 2;
+        for (; step; step /= 2)
+        {
+            if (node + step <= chunk_count && m_index[node + step] <= remaining)
+            {
+                node += step;
+                remaining -= m_index[node];
+            }
+        }
+        return std::make_pair(node, remaining);
+    }
+
+
+    template <typename T, typename Allocator>
+    void chunked_storage<T, Allocator>::rebuild_index()
+    {
+        const size_t chunk_count = m_chunks.size();
+        m_index.assign(chunk_count + 1, 0);
+        for (size_t node = 1; node <= chunk_count; ++node)
+        {
+            m_index[node] += m_chunks[node - 1].size();
+            const size_t parent = node + (node & (~node + 1));
+            if (parent <= chunk_count)
+                m_index[parent] += m_index[node];
+        }
+    }
+
+
+    template <typename T, typename Allocator>
+    bool chunked_storage<T, Allocator>::merge_small(size_t chunk)
+    {
+        if (chunk >= m_chunks.size() || m_chunks[chunk].size() >= m_chunk_rows / 4)
+            return false;
+
+        if (m_chunks[chunk].empty())
+        {
+            m_chunks.erase(m_chunks.begin() + chunk);
+            return true;
+        }
+
+        // Prefer the smaller neighbour so fewer elements move
+        size_t target = npos;
+        if (chunk > 0)
+            target = chunk - 1;
+        if (chunk + 1 < m_chunks.size() && (target == npos || m_chunks[chunk + 1].size() < m_chunks[target].size()))
+            target = chunk + 1;
+        if (target == npos || m_chunks[chunk].size() + m_chunks[target].size() > m_chunk_rows * 3 / 4)
+            return false;
+
+        auto& source = m_chunks[chunk];
+        auto& destination = m_chunks[target];
+        if (target < chunk)
+            destination.insert(destination.end(), std::make_move_iterator(source.begin()),
+                               std::make_move_iterator(source.end()));
+        else
+            destination.insert(destination.begin(), std::make_move_iterator(source.begin()),
+                               std::make_move_iterator(source.end()));
+        m_chunks.erase(m_chunks.begin() + chunk);
+        return true;
+    }
+
+
+    template <typename T, typename Allocator>
+    void chunked_storage<T, Allocator>::insert(size_t index, const T& value)
+    {
+        if (m_chunks.empty())
+        {
+            m_chunks.emplace_back(m_allocator);
+            m_chunks.back().reserve(m_chunk_rows);
+            rebuild_index();
+        }
+
+        auto location = locate(index);
+        if (m_chunks[location.first].size() >= m_chunk_rows)
+        {
+            // Split the full chunk in half. The chunk directory shifts by one entry and the index is rebuilt,
+            // which happens at most once every chunk_rows / 2 inserts into the same region.
+            auto& full = m_chunks[location.first];
+            const size_t half = full.size() / 2;
+            chunk_type upper(m_allocator);
+            upper.reserve(m_chunk_rows);
+            upper.insert(upper.end(), std::make_move_iterator(full.begin() + half), std::make_move_iterator(full.end()));
+            full.erase(full.begin() + half, full.end());
+            m_chunks.insert(m_chunks.begin() + location.first + 1, std::move(upper));
+            rebuild_index();
+
+            if (location.second > half)
+            {
+                location.first += 1;
+                location.second -= half;
+            }
+        }
+
+        auto& chunk = m_chunks[location.first];
+        chunk.insert(chunk.begin() + location.second, value);
+        index_add(location.first, 1);
+        ++m_size;
+    }
+
+
+    template <typename T, typename Allocator>
+    void chunked_storage<T, Allocator>::remove(size_t index)
+    {
+        auto location = locate(index);
+        auto& chunk = m_chunks[location.first];
+        chunk.erase(chunk.begin() + location.second);
+        --m_size;
+        if (merge_small(location.first))
+            rebuild_index();
+        else
+            index_add(location.first, -1);
+    }
+
+
+    template <typename T, typename Allocator>
+    void chunked_storage<T, Allocator>::remove(size_t start_index, size_t end_index)
+    {
+        end_index = std::min(end_index, m_size);
+        if (start_index >= end_index)
+            return;
+
+        auto location = locate(start_index);
+        size_t chunk = location.first;
+        size_t offset = location.second;
+        size_t remaining = end_index - start_index;
+        m_size -= remaining;
+
+        // Trim the first chunk, drop the chunks wholly inside the range and trim the last one
+        const size_t first_chunk = chunk;
+        size_t drop_begin = npos, drop_end = npos;
+        while (remaining)
+        {
+            auto& current = m_chunks[chunk];
+            const size_t count = std::min(remaining, current.size() - offset);
+            if (count == current.size())
+            {
+                if (drop_begin == npos)
+                    drop_begin = chunk;
+                drop_end = chunk + 1;
+            }
+            else
+            {
+                current.erase(current.begin() + offset, current.begin() + offset + count);
+            }
+            remaining -= count;
+            offset = 0;
+            ++chunk;
+        }
+
+        if (drop_begin != npos)
+            m_chunks.erase(m_chunks.begin() + drop_begin, m_chunks.begin() + drop_end);
+
+        // Only the chunks either side of the removed range can have shrunk
+        const size_t after = drop_begin == first_chunk ? first_chunk : first_chunk + 1;
+        merge_small(after);
+        if (after > 0)
+            merge_small(after - 1);
+        rebuild_index();
+    }
+
+
+    template <typename T, typename Allocator>
+    template <typename InputIter>
+    void chunked_storage<T, Allocator>::insert_range(size_t index, InputIter start_pos, InputIter end_pos)
+    {
+        if (start_pos == end_pos)
+            return;
+
+        if (m_chunks.empty())
+        {
+            m_chunks.emplace_back(m_allocator);
+            m_chunks.back().reserve(m_chunk_rows);
+        }
+
+        // Cut the target chunk at the insert position, top it up from the source, spill the rest of the source
+        // into fresh full chunks and then put the cut off tail back. The directory is updated with one insert.
+        auto location = locate(index);
+        auto& target = m_chunks[location.first];
+        chunk_type tail(std::make_move_iterator(target.begin() + location.second),
+                        std::make_move_iterator(target.end()), m_allocator);
+        target.erase(target.begin() + location.second, target.end());
+
+        size_t inserted = 0;
+        for (; start_pos != end_pos && target.size() < m_chunk_rows; ++start_pos, ++inserted)
+            target.push_back(*start_pos);
+
+        std::vector<chunk_type> fresh;
+        while (start_pos != end_pos)
+        {
+            fresh.emplace_back(m_allocator);
+            auto& chunk = fresh.back();
+            chunk.reserve(m_chunk_rows);
+            for (; start_pos != end_pos && chunk.size() < m_chunk_rows; ++start_pos, ++inserted)
+                chunk.push_back(*start_pos);
+        }
+
+        auto& last = fresh.empty() ? target : fresh.back();
+        if (last.size() + tail.size() <= m_chunk_rows)
+            last.insert(last.end(), std::make_move_iterator(tail.begin()), std::make_move_iterator(tail.end()));
+        else
+            fresh.push_back(std::move(tail));
+
+        m_chunks.insert(m_chunks.begin() + location.first + 1, std::make_move_iterator(fresh.begin()),
+                        std::make_move_iterator(fresh.end()));
+        m_size += inserted;
+        rebuild_index();
+    }
+
+
+    template <typename T, typename Allocator>
+    typename chunked_storage<T, Allocator>::shared_base_t chunked_storage<T, Allocator>::copy(size_t start_index,
+                                                                                              size_t end_index) const
+    {
+        if (end_index == npos || end_index > m_size)
+            end_index = m_size;
+
+        auto result = create(m_chunk_rows, m_allocator);
+        if (start_index >= end_index)
+            return result;
+
+        auto location = locate(start_index);
+        size_t remaining = end_index - start_index;
+        for (size_t chunk = location.first, offset = location.second; remaining; ++chunk, offset = 0)
+        {
+            const size_t count = std::min(remaining, m_chunks[chunk].size() - offset);
+            const T * source = m_chunks[chunk].data() + offset;
+            result->append(source, source + count);
+            remaining -= count;
+        }
+        return result;
+    }
+
+
+    template <typename T, typename Allocator>
+    virtual_iter::std_rand_iter_impl<typename chunked_storage<T, Allocator>::const_iterator,
+                                     chunked_storage<T, Allocator>::iter_mem_size>
+    chunked_storage<T, Allocator>::_iter_impl;
+
+
+    template <typename T, typename Allocator = std::allocator<T>>
+    struct chunked_storage_creator
+    {
+        typedef typename chunked_storage<T, Allocator>::shared_base_t shared_base_t;
+
+        explicit chunked_storage_creator(size_t chunk_rows = chunked_storage<T, Allocator>::default_chunk_rows):
+        m_chunk_rows(chunk_rows)
+        {}
+
+        shared_base_t operator() ()
+        {
+            return shared_base_t(chunked_storage<T, Allocator>::create(m_chunk_rows));
+        }
+
+        template <typename IterType>
+        shared_base_t operator() (IterType start_pos, IterType end_pos)
+        {
+            return shared_base_t(chunked_storage<T, Allocator>::create(start_pos, end_pos, m_chunk_rows));
+        }
+
+        size_t m_chunk_rows;
+    };
+}
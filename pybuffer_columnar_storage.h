@@ -0,0 +1,255 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2020 Kuberan Naganathan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include <snapshot_container/snapshot_storage.h>
+#include "pybuffer_struct_code.h"
+#include <array>
+#include <iterator>
+#include <memory>
+#include <tuple>
+#include <vector>
+
+
+namespace pybuffer_container
+{
+    // Structure of arrays storage for pod struct types. Every field of T is kept in its own contiguous
+    // std::vector so a scan over one field is unit stride and each column can be handed to python as a
+    // 1-d buffer with a single character format. Fields are found through pfr reflection and must all
+    // be scalars (see pybuffer_container_detail::scalar_struct_code).
+    //
+    // Rows are not stored anywhere as T, so unlike vector_storage this type cannot hand out T& and is not
+    // a snapshot_container::storage_base. Rows are read and written by value.
+    template <typename T>
+    class columnar_storage
+    {
+    public:
+        typedef T value_type;
+        typedef std::shared_ptr<columnar_storage<T>> shared_t;
+        static constexpr size_t field_count = boost::pfr::tuple_size_v<T>;
+
+        template <size_t I>
+        using field_type = boost::pfr::tuple_element_t<I, T>;
+
+        static shared_t create()
+        {
+            return std::make_shared<columnar_storage<T>>();
+        }
+
+        template <typename InputIter>
+        static shared_t create(InputIter start_pos, InputIter end_pos)
+        {
+            auto storage = create();
+            storage->append(start_pos, end_pos);
+            return storage;
+        }
+
+        void append(const T& value)
+        {
+            append_fields(value, std::make_index_sequence<field_count>());
+        }
+
+        template <typename InputIter>
+        void append(InputIter start_pos, InputIter end_pos)
+        {
+            if constexpr (std::is_base_of<std::random_access_iterator_tag,
+                          typename std::iterator_traits<InputIter>::iterator_category>::value)
+                reserve(size() + (end_pos - start_pos));
+
+            for (; start_pos != end_pos; ++start_pos)
+                append(*start_pos);
+        }
+
+        void insert(size_t index, const T& value)
+        {
+            insert_fields(index, value, std::make_index_sequence<field_count>());
+        }
+
+        void remove(size_t index)
+        {
+            remove(index, index + 1);
+        }
+
+        void remove(size_t start_index, size_t end_index)
+        {
+            remove_fields(start_index, end_index, std::make_index_sequence<field_count>());
+        }
+
+        void reserve(size_t count)
+        {
+            reserve_fields(count, std::make_index_sequence<field_count>());
+        }
+
+        // Reassembles the row at index
+        T get(size_t index) const
+        {
+            return get_fields(index, std::make_index_sequence<field_count>());
+        }
+
+        void set(size_t index, const T& value)
+        {
+            set_fields(index, value, std::make_index_sequence<field_count>());
+        }
+
+        size_t size() const
+        {
+            return std::get<0>(m_columns).size();
+        }
+
+        size_t id() const
+        {
+            return m_storage_id;
+        }
+
+        template <size_t I>
+        const field_type<I> * column() const
+        {
+            return std::get<I>(m_columns).data();
+        }
+
+        template <size_t I>
+        field_type<I> * column()
+        {
+            return std::get<I>(m_columns).data();
+        }
+
+        // Run time column access for buffer exporters
+        const void * column_data(size_t field) const
+        {
+            return column_data_impl(field, std::make_index_sequence<field_count>());
+        }
+
+        static size_t column_itemsize(size_t field)
+        {
+            return _column_itemsizes[field];
+        }
+
+        // Null terminated single character struct code with static storage duration
+        static const char * column_format(size_t field)
+        {
+            return _column_formats[field].data();
+        }
+
+        columnar_storage():
+        m_storage_id(storage_base_t::generate_storage_id())
+        {}
+
+        // As with vector_storage, construction is only through create
+        columnar_storage(const columnar_storage<T>& rhs) = delete;
+        columnar_storage(columnar_storage<T>&& rhs) = delete;
+
+    private:
+        typedef snapshot_container::storage_base<T, 48, virtual_iter::rand_iter<T, 48>> storage_base_t;
+
+        template <size_t ...I>
+        static auto make_columns(std::index_sequence<I...>)
+        {
+            return std::tuple<std::vector<field_type<I>>...>();
+        }
+
+        typedef decltype(make_columns(std::make_index_sequence<field_count>())) columns_t;
+
+        template <size_t ...I>
+        static constexpr bool all_scalar(std::index_sequence<I...>)
+        {
+            return ((pybuffer_container_detail::scalar_struct_code<field_type<I>>() != 0) && ...);
+        }
+
+        static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable");
+        static_assert(all_scalar(std::make_index_sequence<field_count>()), "columnar_storage requires scalar fields");
+
+        template <size_t ...I>
+        void append_fields(const T& value, std::index_sequence<I...>)
+        {
+            (std::get<I>(m_columns).push_back(boost::pfr::get<I>(value)), ...);
+        }
+
+        template <size_t ...I>
+        void insert_fields(size_t index, const T& value, std::index_sequence<I...>)
+        {
+            (std::get<I>(m_columns).insert(std::get<I>(m_columns).begin() + index, boost::pfr::get<I>(value)), ...);
+        }
+
+        template <size_t ...I>
+        void remove_fields(size_t start_index, size_t end_index, std::index_sequence<I...>)
+        {
+            (std::get<I>(m_columns).erase(std::get<I>(m_columns).begin() + start_index,
+                                          std::get<I>(m_columns).begin() + end_index), ...);
+        }
+
+        template <size_t ...I>
+        void reserve_fields(size_t count, std::index_sequence<I...>)
+        {
+            (std::get<I>(m_columns).reserve(count), ...);
+        }
+
+        template <size_t ...I>
+        T get_fields(size_t index, std::index_sequence<I...>) const
+        {
+            T result{};
+            ((boost::pfr::get<I>(result) = std::get<I>(m_columns)[index]), ...);
+            return result;
+        }
+
+        template <size_t ...I>
+        void set_fields(size_t index, const T& value, std::index_sequence<I...>)
+        {
+            ((std::get<I>(m_columns)[index] = boost::pfr::get<I>(value)), ...);
+        }
+
+        template <size_t ...I>
+        const void * column_data_impl(size_t field, std::index_sequence<I...>) const
+        {
+            const void * pointers[] = {static_cast<const void*>(std::get<I>(m_columns).data())...};
+            return pointers[field];
+        }
+
+        template <size_t ...I>
+        static constexpr std::array<size_t, field_count> make_itemsizes(std::index_sequence<I...>)
+        {
+            return {{sizeof(field_type<I>)...}};
+        }
+
+        template <size_t ...I>
+        static constexpr std::array<std::array<char, 2>, field_count> make_formats(std::index_sequence<I...>)
+        {
+            return {{{{pybuffer_container_detail::scalar_struct_code<field_type<I>>(), 0}}...}};
+        }
+
+        static constexpr std::array<size_t, field_count> _column_itemsizes =
+            make_itemsizes(std::make_index_sequence<field_count>());
+        static constexpr std::array<std::array<char, 2>, field_count> _column_formats =
+            make_formats(std::make_index_sequence<field_count>());
+
+        columns_t m_columns;
+        size_t m_storage_id;
+    };
+
+
+    // Converts row oriented data, for example a vector_storage segment, into columnar form
+    template <typename T>
+    typename columnar_storage<T>::shared_t make_columnar(const T * rows, size_t count)
+    {
+        return columnar_storage<T>::create(rows, rows + count);
+    }
+}
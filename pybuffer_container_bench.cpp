@@ -0,0 +1,288 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2020 Kuberan Naganathan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <Python.h>
+#include "pybuffer_interface.h"
+#include "pybuffer_chunked_storage.h"
+#include "pybuffer_bench.h"
+#include <vector>
+
+
+// Regression benchmarks for the hot paths: vector_storage mutation, the storage registry under
+// contention, struct code lookup and buffer export through an embedded interpreter.
+//
+//     build/pybuffer_container_bench/pybuffer_container_bench --out=bench.json
+
+
+using namespace pybuffer_container;
+using pybuffer_bench::state;
+
+
+struct bench_record
+{
+    int i1;
+    double d1;
+    char c1;
+    long l1;
+};
+
+typedef vector_storage<bench_record> storage_t;
+
+
+static std::vector<bench_record> make_records(size_t count)
+{
+    std::vector<bench_record> records(count);
+    for (size_t index = 0; index < count; ++index)
+        records[index] = bench_record{static_cast<int>(index), index * 0.5, 'x', static_cast<long>(index)};
+    return records;
+}
+
+
+static void storage_append(state& st)
+{
+    auto records = make_records(st.arg());
+    for (auto _: st)
+    {
+        auto storage = storage_t::create();
+        for (auto& record: records)
+            storage->append(record);
+        pybuffer_bench::do_not_optimize(storage->data());
+    }
+    st.set_items_processed(st.iterations() * st.arg());
+}
+
+
+static void storage_append_bulk(state& st)
+{
+    auto records = make_records(st.arg());
+    for (auto _: st)
+    {
+        auto storage = storage_t::create();
+        storage->append(records.data(), records.data() + records.size());
+        pybuffer_bench::do_not_optimize(storage->data());
+    }
+    st.set_items_processed(st.iterations() * st.arg());
+}
+
+
+// Insert in the middle then remove it again so the size stays put. Cost is dominated by the tail move.
+static void storage_insert_remove(state& st)
+{
+    auto records = make_records(st.arg());
+    auto storage = storage_t::create(records.begin(), records.end());
+    const size_t middle = records.size() / 2;
+    for (auto _: st)
+    {
+        storage->insert(middle, records[0]);
+        storage->remove(middle);
+    }
+    pybuffer_bench::do_not_optimize(storage->data());
+}
+
+
+// The same pattern on chunked_storage where only the chunk holding the middle shifts
+static void chunked_insert_remove(state& st)
+{
+    auto records = make_records(st.arg());
+    auto storage = chunked_storage<bench_record>::create(records.data(), records.data() + records.size());
+    const size_t middle = records.size() / 2;
+    for (auto _: st)
+    {
+        storage->insert(middle, records[0]);
+        storage->remove(middle);
+    }
+    pybuffer_bench::do_not_optimize(storage->chunk_data(0));
+}
+
+
+static void storage_remove_range(state& st)
+{
+    auto records = make_records(st.arg());
+    auto storage = storage_t::create(records.begin(), records.end());
+    const size_t quarter = records.size() / 4;
+    for (auto _: st)
+    {
+        storage->remove(quarter, 2 * quarter);
+        st.pause_timing();
+        storage->insert(quarter, records.data(), records.data() + quarter);
+        st.resume_timing();
+    }
+    pybuffer_bench::do_not_optimize(storage->data());
+}
+
+
+// Reconciliation style batch: one replace every 16 rows, applied as a single merge pass
+static void storage_apply_batch(state& st)
+{
+    auto records = make_records(st.arg());
+    auto storage = storage_t::create(records.begin(), records.end());
+    std::vector<storage_edit<bench_record>> edits;
+    for (size_t position = 0; position + 16 <= records.size(); position += 16)
+    {
+        edits.push_back(storage_edit<bench_record>{storage_edit<bench_record>::insert, position, 2, records.data()});
+        edits.push_back(storage_edit<bench_record>{storage_edit<bench_record>::remove, position, 2, nullptr});
+    }
+    for (auto _: st)
+        storage->apply_batch(edits);
+    pybuffer_bench::do_not_optimize(storage->data());
+    st.set_items_processed(st.iterations() * edits.size());
+}
+
+
+// Whole storage copies alias the source buffer so this measures the copy on write setup
+static void storage_copy(state& st)
+{
+    auto records = make_records(st.arg());
+    auto storage = storage_t::create(records.begin(), records.end());
+    for (auto _: st)
+    {
+        auto copy = storage->copy();
+        pybuffer_bench::do_not_optimize(copy.get());
+    }
+    st.set_items_processed(st.iterations() * st.arg());
+}
+
+
+// Every thread shares one creator: create, locate it, locate an older id, drop most storages
+static pybuffer_storage_creator<bench_record> shared_creator;
+
+static void creator_create_locate(state& st)
+{
+    std::vector<pybuffer_storage_creator<bench_record>::shared_base_t> live(16);
+    size_t index = 0;
+    for (auto _: st)
+    {
+        auto storage = shared_creator();
+        auto& slot = live[index++ % live.size()];
+        const size_t previous_id = slot ? slot->id() : storage->id();
+        slot = storage;
+        pybuffer_bench::do_not_optimize(shared_creator.locate(storage->id()));
+        pybuffer_bench::do_not_optimize(shared_creator.locate(previous_id));
+    }
+}
+
+
+static void struct_code_lookup(state& st)
+{
+    for (auto _: st)
+        pybuffer_bench::do_not_optimize(pybuffer_container_detail::get_py_struct_code<bench_record>());
+}
+
+
+static void struct_field_find(state& st)
+{
+    for (auto _: st)
+        pybuffer_bench::do_not_optimize(pybuffer_container_detail::py_struct_fields<bench_record>::find("f3"));
+}
+
+
+// The buffer benchmarks share one interpreter. Each iteration holds the GIL the whole time.
+static storage_t::shared_t export_storage()
+{
+    static storage_t::shared_t storage = []() {
+        auto records = make_records(4096);
+        return storage_t::create(records.begin(), records.end());
+    }();
+    return storage;
+}
+
+
+static void storage_wrapper_create(state& st)
+{
+    auto storage = export_storage();
+    for (auto _: st)
+    {
+        PyObject * wrapper = reinterpret_cast<PyObject*>(PyBufferStorageWrapper<bench_record>::create_py_storage_wrapper(storage));
+        Py_DECREF(wrapper);
+    }
+}
+
+
+static void storage_getbuffer(state& st)
+{
+    PyObject * wrapper = reinterpret_cast<PyObject*>(
+        PyBufferStorageWrapper<bench_record>::create_py_storage_wrapper(export_storage()));
+    Py_buffer view;
+    for (auto _: st)
+    {
+        PyObject_GetBuffer(wrapper, &view, PyBUF_FULL_RO);
+        PyBuffer_Release(&view);
+    }
+    Py_DECREF(wrapper);
+}
+
+
+static void storage_memoryview(state& st)
+{
+    PyObject * wrapper = reinterpret_cast<PyObject*>(
+        PyBufferStorageWrapper<bench_record>::create_py_storage_wrapper(export_storage()));
+    for (auto _: st)
+    {
+        PyObject * memory_view = PyMemoryView_FromObject(wrapper);
+        Py_DECREF(memory_view);
+    }
+    Py_DECREF(wrapper);
+}
+
+
+static void storage_field_projection(state& st)
+{
+    PyObject * wrapper = reinterpret_cast<PyObject*>(
+        PyBufferStorageWrapper<bench_record>::create_py_storage_wrapper(export_storage()));
+    PyObject * key = PyLong_FromLong(1);
+    Py_buffer view;
+    for (auto _: st)
+    {
+        PyObject * region = PyBufferStorageWrapperImpl<bench_record>::field(wrapper, key);
+        PyObject_GetBuffer(region, &view, PyBUF_FULL_RO);
+        PyBuffer_Release(&view);
+        Py_DECREF(region);
+    }
+    Py_DECREF(key);
+    Py_DECREF(wrapper);
+}
+
+
+int main(int argc, char ** argv)
+{
+    Py_Initialize();
+
+    pybuffer_bench::register_benchmark("vector_storage/append", storage_append).args({64, 4096, 262144});
+    pybuffer_bench::register_benchmark("vector_storage/append_bulk", storage_append_bulk).args({64, 4096, 262144});
+    pybuffer_bench::register_benchmark("vector_storage/insert_remove", storage_insert_remove).args({64, 4096, 262144});
+    pybuffer_bench::register_benchmark("chunked_storage/insert_remove", chunked_insert_remove).args({64, 4096, 262144});
+    pybuffer_bench::register_benchmark("vector_storage/remove_range", storage_remove_range).args({64, 4096, 262144});
+    pybuffer_bench::register_benchmark("vector_storage/apply_batch", storage_apply_batch).args({64, 4096, 262144});
+    pybuffer_bench::register_benchmark("vector_storage/copy", storage_copy).args({64, 4096, 262144});
+    pybuffer_bench::register_benchmark("storage_creator/create_locate", creator_create_locate).threads({1, 2, 4, 8, 16});
+    pybuffer_bench::register_benchmark("struct_code/get_py_struct_code", struct_code_lookup);
+    pybuffer_bench::register_benchmark("struct_code/field_find", struct_field_find);
+    pybuffer_bench::register_benchmark("buffer/storage_wrapper_create", storage_wrapper_create);
+    pybuffer_bench::register_benchmark("buffer/getbuffer_release", storage_getbuffer);
+    pybuffer_bench::register_benchmark("buffer/memoryview", storage_memoryview);
+    pybuffer_bench::register_benchmark("buffer/field_projection", storage_field_projection);
+
+    int status = pybuffer_bench::run_all(argc, argv);
+    Py_FinalizeEx();
+    return status;
+}
@@ -0,0 +1,529 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2020 Kuberan Naganathan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "pybuffer_storage.h"
+#include "pybuffer_chunked_storage.h"
+#include "pybuffer_snapshot_file.h"
+#include "pybuffer_shm_storage.h"
+#include "pybuffer_pin_tracker.h"
+#include "pybuffer_struct_code.h"
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <unistd.h>
+
+
+// Behaviour tests for the storages underneath the python interface. Python itself is not needed: everything
+// here is reachable from C++. Build with scons pybuffer_container_test; the exit status is the number of
+// failed checks.
+
+
+using namespace pybuffer_container;
+
+
+static int failures = 0;
+
+
+#define PYBUFFER_CHECK(condition) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition << std::endl; \
+            ++failures; \
+        } \
+    } while (0)
+
+
+struct test_record
+{
+    int i1;
+    double d1;
+};
+
+
+typedef vector_storage<int> int_storage;
+typedef vector_storage<test_record> record_storage;
+
+
+template <typename Storage>
+std::vector<int> contents(const Storage& storage)
+{
+    std::vector<int> result;
+    for (size_t index = 0; index < storage.size(); ++index)
+        result.push_back(storage[index]);
+    return result;
+}
+
+
+std::vector<int> iota(size_t count, int first = 0)
+{
+    std::vector<int> result(count);
+    for (size_t index = 0; index < count; ++index)
+        result[index] = first + int(index);
+    return result;
+}
+
+
+std::string temp_path(const std::string& name)
+{
+    return "/tmp/pybuffer_container_test." + std::to_string(::getpid()) + "." + name;
+}
+
+
+record_storage::shared_t make_records(pybuffer_storage_creator<test_record>& creator, int first, size_t count)
+{
+    std::vector<test_record> rows;
+    for (size_t index = 0; index < count; ++index)
+        rows.push_back(test_record{first + int(index), (first + int(index)) * 0.5});
+    return std::static_pointer_cast<record_storage>(creator(rows.begin(), rows.end()));
+}
+
+
+void remove_directory(const std::string& path)
+{
+    if (DIR * directory = ::opendir(path.c_str()))
+    {
+        while (auto entry = ::readdir(directory))
+        {
+            std::string name(entry->d_name);
+            if (name != "." && name != "..")
+                ::unlink((path + "/" + name).c_str());
+        }
+        ::closedir(directory);
+    }
+    ::rmdir(path.c_str());
+}
+
+
+bool same_records(const std::vector<record_storage::shared_t>& lhs, const std::vector<record_storage::shared_t>& rhs)
+{
+    if (lhs.size() != rhs.size())
+        return false;
+    for (size_t segment = 0; segment < lhs.size(); ++segment)
+    {
+        const record_storage& left = *lhs[segment];
+        const record_storage& right = *rhs[segment];
+        if (left.size() != right.size())
+            return false;
+        for (size_t index = 0; index < left.size(); ++index)
+            if (left[index].i1 != right[index].i1 || left[index].d1 != right[index].d1)
+                return false;
+    }
+    return true;
+}
+
+
+void test_apply_batch()
+{
+    typedef storage_edit<int> edit_t;
+    std::mt19937 rng(7);
+    for (int trial = 0; trial < 500; ++trial)
+    {
+        const size_t size = rng() % 40;
+        const auto initial = iota(size);
+        auto storage = std::const_pointer_cast<int_storage>(int_storage::create(initial.begin(), initial.end()));
+        // Every other trial applies the batch to an alias so the merge path runs as well as the in place one
+        auto alias = trial % 2 ? storage->copy() : int_storage::shared_base_t();
+
+        std::vector<std::vector<int>> values;
+        values.reserve(16);
+        std::vector<edit_t> edits;
+        std::vector<int> expected;
+        size_t cursor = 0;
+        while (cursor <= size && edits.size() < 16 && rng() % 5)
+        {
+            const size_t position = cursor + rng() % (size - cursor + 1);
+            for (; cursor < position; ++cursor)
+                expected.push_back(initial[cursor]);
+            if (rng() % 2)
+            {
+                values.push_back(iota(rng() % 4, 1000 * (trial + 1)));
+                edits.push_back(edit_t{edit_t::insert, position, values.back().size(), values.back().data()});
+                expected.insert(expected.end(), values.back().begin(), values.back().end());
+            }
+            else
+            {
+                const size_t count = std::min<size_t>(rng() % 4, size - position);
+                edits.push_back(edit_t{edit_t::remove, position, count, nullptr});
+                cursor += count;
+            }
+        }
+        expected.insert(expected.end(), initial.begin() + cursor, initial.end());
+
+        storage->apply_batch(edits);
+        PYBUFFER_CHECK(contents(*storage) == expected);
+        if (alias)
+            PYBUFFER_CHECK(contents(*std::static_pointer_cast<const int_storage>(alias)) == initial);
+    }
+
+    // An empty batch changes nothing and does not copy a shared buffer
+    const auto initial = iota(100);
+    auto storage = std::const_pointer_cast<int_storage>(int_storage::create(initial.begin(), initial.end()));
+    auto alias = storage->copy();
+    const int * buffer = storage->data();
+    storage->apply_batch({});
+    storage->apply_batch({edit_t{edit_t::insert, 5, 0, nullptr}, edit_t{edit_t::remove, 10, 0, nullptr}});
+    PYBUFFER_CHECK(storage->data() == buffer && !storage->is_exclusive());
+    PYBUFFER_CHECK(contents(*storage) == initial);
+
+    // Invalid batches throw before anything is changed
+    int value = -1;
+    const std::vector<std::vector<edit_t>> invalid = {
+        {edit_t{edit_t::remove, 10, 1, nullptr}, edit_t{edit_t::remove, 5, 1, nullptr}},    // out of order
+        {edit_t{edit_t::remove, 10, 5, nullptr}, edit_t{edit_t::insert, 12, 1, &value}},    // inside a remove
+        {edit_t{edit_t::remove, 98, 3, nullptr}},                                            // past the end
+        {edit_t{edit_t::insert, 101, 1, &value}},                                            // past the end
+        {edit_t{edit_t::insert, 0, 1, &value}, edit_t{edit_t::insert, 4, 2, nullptr}}};      // no values
+    for (auto& batch: invalid)
+    {
+        bool threw = false;
+        try
+        {
+            storage->apply_batch(batch);
+        }
+        catch (const std::invalid_argument&)
+        {
+            threw = true;
+        }
+        PYBUFFER_CHECK(threw);
+        PYBUFFER_CHECK(contents(*storage) == initial && storage->data() == buffer);
+    }
+}
+
+
+void test_struct_code()
+{
+    using namespace pybuffer_container_detail;
+    // Padding is explicit, and a reader in native mode decodes the same offsets
+    PYBUFFER_CHECK(std::string(get_py_struct_code<test_record>()) == "i4xd");
+    std::vector<py_format_item> items;
+    size_t size = 0;
+    PYBUFFER_CHECK(flatten_py_format(get_py_struct_code<test_record>(), items, size) && size == sizeof(test_record));
+    PYBUFFER_CHECK(items.size() == 2 && items[1].offset == offsetof(test_record, d1));
+    PYBUFFER_CHECK(py_format_matches<test_record>("T{i:i1:xxxxd:d1:}", sizeof(test_record)));
+    PYBUFFER_CHECK(!py_format_matches<test_record>("T{=i:i1:d:d1:}", sizeof(test_record)));
+
+    // A packed layout, which native mode would pad, is pinned with '^'
+    PYBUFFER_CHECK(_layout_checked_code("ci", 5) == "^ci");
+    PYBUFFER_CHECK(_layout_checked_code("c3xi", 8) == "c3xi");
+}
+
+
+void test_copy_on_write()
+{
+    const auto initial = iota(100);
+    auto source = std::const_pointer_cast<int_storage>(int_storage::create(initial.begin(), initial.end()));
+    const int * buffer = source->data();
+
+    // A quarter of the buffer or more aliases it, less is copied
+    auto quarter = std::static_pointer_cast<int_storage>(source->copy(10, 10 + 100 / int_storage::share_fraction));
+    auto smaller = std::static_pointer_cast<int_storage>(source->copy(10, 9 + 100 / int_storage::share_fraction));
+    PYBUFFER_CHECK(quarter->data() == buffer + 10 && quarter->pin_key() == source->pin_key());
+    PYBUFFER_CHECK(smaller->data() != buffer + 10 && smaller->is_exclusive());
+    PYBUFFER_CHECK(!source->is_exclusive() && !quarter->is_exclusive());
+    PYBUFFER_CHECK(contents(*quarter) == iota(25, 10) && contents(*smaller) == iota(24, 10));
+
+    // The first mutation of either side copies it out and leaves the other alone
+    const auto generation = quarter->generation();
+    quarter->append(-1);
+    PYBUFFER_CHECK(quarter->data() != buffer + 10 && quarter->is_exclusive() && quarter->generation() > generation);
+    PYBUFFER_CHECK(source->data() == buffer && contents(*source) == initial);
+    (*std::static_pointer_cast<int_storage>(source->copy(0, 50)))[0] = -2;
+    PYBUFFER_CHECK(contents(*source) == initial);
+
+    // An alias left holding the buffer alone trims it in place instead of copying
+    auto half = std::static_pointer_cast<int_storage>(source->copy(50));
+    source.reset();
+    half->remove(0);
+    PYBUFFER_CHECK(half->is_exclusive() && half->data() == buffer && contents(*half) == iota(49, 51));
+
+    // mutable_data takes a private buffer first
+    auto other = std::static_pointer_cast<int_storage>(half->copy());
+    other->mutable_data()[0] = -3;
+    PYBUFFER_CHECK((*std::static_pointer_cast<const int_storage>(half))[0] == 51);
+}
+
+
+void test_chunked_storage()
+{
+    std::mt19937 rng(11);
+    for (size_t chunk_rows: {4, 16, 64})
+    {
+        auto storage = chunked_storage<int>::create(chunk_rows);
+        std::vector<int> expected;
+        for (int step = 0; step < 5000; ++step)
+        {
+            const int operation = rng() % 5;
+            if (operation < 2)
+            {
+                const size_t index = rng() % (expected.size() + 1);
+                const int value = int(rng());
+                storage->insert(index, value);
+                expected.insert(expected.begin() + index, value);
+            }
+            else if (operation == 2)
+            {
+                std::vector<int> values = iota(rng() % (chunk_rows * 3), step);
+                const size_t index = rng() % (expected.size() + 1);
+                storage->insert(index, values.data(), values.data() + values.size());
+                expected.insert(expected.begin() + index, values.begin(), values.end());
+            }
+            else if (!expected.empty())
+            {
+                const size_t start = rng() % expected.size();
+                const size_t end = start + rng() % std::min<size_t>(expected.size() - start + 1, chunk_rows * 2);
+                storage->remove(start, end);
+                expected.erase(expected.begin() + start, expected.begin() + end);
+            }
+
+            if (step % 50 == 0)
+            {
+                // Chunks stay within bounds and the index agrees with their sizes
+                size_t start = 0;
+                for (size_t chunk = 0; chunk < storage->chunk_count(); ++chunk)
+                {
+                    PYBUFFER_CHECK(storage->chunk_size(chunk) > 0 && storage->chunk_size(chunk) <= chunk_rows);
+                    PYBUFFER_CHECK(storage->chunk_start(chunk) == start);
+                    start += storage->chunk_size(chunk);
+                }
+                PYBUFFER_CHECK(start == expected.size());
+                PYBUFFER_CHECK(contents(*storage) == expected);
+            }
+        }
+        PYBUFFER_CHECK(storage->size() == expected.size() && contents(*storage) == expected);
+
+        if (expected.size() > 10)
+        {
+            auto copy = std::static_pointer_cast<chunked_storage<int>>(storage->copy(3, expected.size() - 2));
+            PYBUFFER_CHECK(contents(*copy) == std::vector<int>(expected.begin() + 3, expected.end() - 2));
+        }
+    }
+
+    // Removing most of a storage merges the remaining small chunks
+    const auto values = iota(1000);
+    auto storage = chunked_storage<int>::create(64);
+    storage->insert(0, values.data(), values.data() + values.size());
+    const size_t full_chunks = storage->chunk_count();
+    for (size_t index = 0; index < 900; ++index)
+        storage->remove(storage->size() - 1 - (index * 7) % storage->size());
+    PYBUFFER_CHECK(storage->size() == 100 && storage->chunk_count() < full_chunks);
+    PYBUFFER_CHECK(storage->chunk_count() <= 100 * 4 / 64 + 1);
+}
+
+
+void test_snapshot_file()
+{
+    pybuffer_storage_creator<test_record> creator;
+    std::vector<record_storage::shared_t> segments;
+    int first = 0;
+    for (size_t count: {5, 0, 3000, 7})
+    {
+        segments.push_back(make_records(creator, first, count));
+        first += int(count);
+    }
+
+    const std::string path = temp_path("snapshot");
+    save_snapshot<test_record>(path, segments);
+    pybuffer_storage_creator<test_record> loader;
+    std::vector<record_storage::shared_t> loaded;
+    PYBUFFER_CHECK(load_snapshot(path, loader, loaded));
+    PYBUFFER_CHECK(same_records(loaded, segments));
+    for (auto& segment: loaded)
+        PYBUFFER_CHECK(loader.locate(segment->id()) == segment);
+
+    auto mapping = snapshot_mapping<test_record>::open(path);
+    PYBUFFER_CHECK(mapping && mapping->segment_count() == 4 && mapping->segment_size(2) == 3000);
+    PYBUFFER_CHECK(mapping && mapping->segment_data(2)[10].i1 == 15);
+
+    // A truncated file is rejected rather than read past its end
+    ::truncate(path.c_str(), 100);
+    PYBUFFER_CHECK(!load_snapshot(path, loader, loaded) && loaded.empty());
+    ::unlink(path.c_str());
+}
+
+
+void test_snapshot_chain()
+{
+    pybuffer_storage_creator<test_record> creator;
+    std::vector<record_storage::shared_t> view;
+    for (int segment = 0; segment < 20; ++segment)
+        view.push_back(make_records(creator, segment * 100, 100));
+
+    const std::vector<std::string> paths = {temp_path("chain0"), temp_path("chain1"), temp_path("chain2")};
+    snapshot_chain_writer<test_record> writer;
+    PYBUFFER_CHECK(writer.write(paths[0], view) == 0);
+
+    // Replace one segment, append one and modify one in place. The in place change keeps the storage id,
+    // so only its generation tells the writer the earlier copy is stale.
+    view[3] = make_records(creator, -50, 10);
+    view.push_back(make_records(creator, 9000, 20));
+    const size_t id = view[5]->id();
+    (*view[5])[0] = test_record{-1, -1.0};
+    PYBUFFER_CHECK(view[5]->id() == id);
+    PYBUFFER_CHECK(writer.write(paths[1], view) == 1);
+
+    pybuffer_storage_creator<test_record> loader;
+    std::vector<record_storage::shared_t> loaded;
+    PYBUFFER_CHECK(load_snapshot_chain({paths[0], paths[1]}, loader, loaded) && same_records(loaded, view));
+    PYBUFFER_CHECK(loaded.size() > 5 && (*loaded[5])[0].i1 == -1);
+
+    // Batches change segments in place too: one replacing a row within the buffer, one growing past it
+    typedef storage_edit<test_record> edit_t;
+    const test_record replacement = {42, 42.0};
+    const std::uint64_t generation = view[2]->generation();
+    view[2]->apply_batch({edit_t{edit_t::insert, 0, 1, &replacement}, edit_t{edit_t::remove, 0, 1, nullptr}});
+    view[4]->apply_batch({edit_t{edit_t::insert, 100, 1, &replacement}});
+    PYBUFFER_CHECK(view[2]->generation() != generation);
+    view.erase(view.begin() + 7);
+    PYBUFFER_CHECK(writer.write(paths[2], view) == 2);
+
+    PYBUFFER_CHECK(load_snapshot_chain(paths, loader, loaded) && same_records(loaded, view));
+    PYBUFFER_CHECK(loaded.size() > 4 && (*loaded[2])[0].i1 == 42 && loaded[4]->size() == 101);
+    // The base still holds the segments as they were, including the one since modified in place
+    PYBUFFER_CHECK(load_snapshot(paths[0], loader, loaded) && loaded.size() == 20);
+    PYBUFFER_CHECK(loaded.size() == 20 && (*loaded[3])[0].i1 == 300 && (*loaded[5])[0].i1 == 500);
+
+    // A delta cannot be loaded without its base, or with links missing
+    PYBUFFER_CHECK(!load_snapshot(paths[1], loader, loaded));
+    PYBUFFER_CHECK(!load_snapshot_chain({paths[0], paths[2]}, loader, loaded));
+    for (auto& path: paths)
+        ::unlink(path.c_str());
+}
+
+
+void test_shm_registry()
+{
+    const std::string name = "test" + std::to_string(::getpid());
+    const std::vector<test_record> rows = {{1, 0.5}, {2, 1.0}, {3, 1.5}};
+    size_t first_id = 0;
+    {
+        shm_storage_creator<test_record> publisher(name, 64, "/tmp");
+        auto storage = std::static_pointer_cast<mmap_storage<test_record>>(publisher(rows.begin(), rows.end()));
+        PYBUFFER_CHECK(publisher.publish(storage));
+        first_id = storage->id();
+
+        shm_storage_reader<test_record> reader(name, "/tmp");
+        auto segment = reader.locate(first_id);
+        PYBUFFER_CHECK(segment && segment->size() == 3 && segment->data()[2].i1 == 3);
+        PYBUFFER_CHECK(!reader.locate(first_id + 1000));
+
+        PYBUFFER_CHECK(publisher.withdraw(first_id));
+        PYBUFFER_CHECK(!reader.locate(first_id));
+        // A mapping already made outlives the withdrawal
+        PYBUFFER_CHECK(segment->data()[0].i1 == 1);
+    }
+
+    // A reader attached to a previous publisher instance does not see the new one's segments until it
+    // reattaches, and never maps a stale segment
+    {
+        shm_storage_reader<test_record> reader(name, "/tmp");
+        shm_storage_creator<test_record> publisher(name, 64, "/tmp");
+        auto storage = std::static_pointer_cast<mmap_storage<test_record>>(publisher(rows.begin(), rows.end()));
+        PYBUFFER_CHECK(publisher.publish(storage));
+        PYBUFFER_CHECK(!reader.locate(first_id));
+        PYBUFFER_CHECK(reader.reattach() && !reader.reattach());
+        auto segment = reader.locate(storage->id());
+        PYBUFFER_CHECK(segment && segment->size() == 3);
+
+        // A full registry refuses to publish
+        std::vector<mmap_storage<test_record>::shared_t> published;
+        bool refused = false;
+        for (int index = 0; index < 128 && !refused; ++index)
+        {
+            auto next = std::static_pointer_cast<mmap_storage<test_record>>(publisher(rows.begin(), rows.end()));
+            published.push_back(next);
+            refused = !publisher.publish(next);
+        }
+        PYBUFFER_CHECK(refused);
+    }
+    remove_directory(_shm_namespace_path("/tmp", name));
+}
+
+
+void test_pin_tracker()
+{
+    buffer_pin_tracker pins;
+    size_t callbacks = 0, reported = 0;
+    pins.set_soft_limit(1000, [&](size_t bytes, size_t) { ++callbacks; reported = bytes; });
+
+    int first = 0, second = 0;
+    pins.pin(&first, 1, 600);
+    pins.pin(&first, 2, 600); // a second export of the same buffer through an alias is not counted again
+    PYBUFFER_CHECK(pins.pinned_bytes() == 600 && callbacks == 0);
+    auto pinned = pins.pinned();
+    PYBUFFER_CHECK(pinned.size() == 1 && pinned[0].m_id == 1 && pinned[0].m_exports == 2);
+
+    pins.pin(&second, 3, 500);
+    PYBUFFER_CHECK(pins.pinned_bytes() == 1100 && callbacks == 1 && reported == 1100);
+    pins.pin(&second, 3, 500); // still over the limit: reported once per crossing
+    PYBUFFER_CHECK(callbacks == 1);
+
+    pins.unpin(&first);
+    PYBUFFER_CHECK(pins.pinned_bytes() == 1100);
+    pins.unpin(&first);
+    PYBUFFER_CHECK(pins.pinned_bytes() == 500 && pins.high_water_bytes() == 1100);
+    pins.unpin(&second);
+    pins.unpin(&second);
+    PYBUFFER_CHECK(pins.pinned_bytes() == 0 && pins.pinned().empty());
+
+    // Back under the limit, so crossing it again is reported again
+    pins.pin(&first, 1, 2000);
+    PYBUFFER_CHECK(callbacks == 2);
+    pins.unpin(&first);
+    pins.reset_high_water();
+    PYBUFFER_CHECK(pins.high_water_bytes() == 0);
+
+    // Storages made by a creator carry its tracker, and aliases of them share the pin of their buffer
+    pybuffer_storage_creator<int> creator;
+    const auto values = iota(100);
+    auto storage = std::static_pointer_cast<int_storage>(creator(values.begin(), values.end()));
+    auto alias = std::static_pointer_cast<int_storage>(storage->copy(0, 50));
+    PYBUFFER_CHECK(storage->pin_tracker() == creator.pin_tracker() && alias->pin_tracker() == creator.pin_tracker());
+    PYBUFFER_CHECK(alias->pin_key() == storage->pin_key() && alias->pin_bytes() == storage->pin_bytes());
+    PYBUFFER_CHECK(storage->pin_bytes() >= values.size() * sizeof(int));
+}
+
+
+int main()
+{
+    test_apply_batch();
+    test_struct_code();
+    test_copy_on_write();
+    test_chunked_storage();
+    test_snapshot_file();
+    test_snapshot_chain();
+    test_shm_registry();
+    test_pin_tracker();
+
+    if (failures)
+        std::cerr << failures << " checks failed" << std::endl;
+    else
+        std::cout << "all checks passed" << std::endl;
+    return failures;
+}
@@ -23,219 +23,310 @@
  */
 #pragma once
 #include <Python.h>
-#include <metal.hpp> // https://github.com/brunocodutra/metal
-#include <boost/pfr.hpp> // https://github.com/apolukhin/magic_get
 #include "pybuffer_container.h"
+#include "pybuffer_storage.h"
+#include "pybuffer_struct_code.h"
+#include "pybuffer_columnar_storage.h"
+#include "pybuffer_reduce.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <type_traits>
 #include <vector>
+#include <string>
+#include <utility>
 
 
 namespace pybuffer_container_detail
 {
-    // https://docs.python.org/3.8/library/struct.html
-    template <typename T>
-    using struct_code_map = metal::at_key<
-    metal::map<
-        metal::pair<char, metal::number<'c'>>,
-        metal::pair<std::uint8_t, metal::number<'B'>>,
-        metal::pair<bool,
-                    std::conditional< sizeof(bool) == 4, metal::number<'I'>,
-                    std::conditional< sizeof(bool) == 2, metal::number<'H'>, metal::number<'B'>>::type>::type>,
-        metal::pair<short, metal::number<'h'>>,
-        metal::pair<std::uint16_t, metal::number<'H'>>,
-        metal::pair<int, metal::number<'i'>>,
-        metal::pair<unsigned int, metal::number<'I'>>,
-        metal::pair<size_t, metal::number<'Q'>>,
-        metal::pair<ssize_t, metal::number<'q'>>,
-        metal::pair<float, metal::number<'f'>>,
-        metal::pair<double, metal::number<'d'>>
-    >, T>;
+    // Wrapper objects are allocated through their type's tp_alloc with the C++ impl constructed inline in
+    // the same block, so creating a wrapper is one allocation. Destroyed wrappers are parked on a per type
+    // free list and reused by the next create. Every entry point runs with the GIL held so the free list
+    // needs no locking.
+    //
+    // None of the wrappers can take part in a reference cycle (the only python reference held is an
+    // iterator's reference on its view) so the types do not set Py_TPFLAGS_HAVE_GC.
+    template <typename Wrapper, typename Impl>
+    struct _py_wrapper_allocator
+    {
+        static constexpr size_t max_free = 64;
 
+        // Returns nullptr with a python error set on failure
+        template <typename ...Args>
+        static Wrapper * create(PyTypeObject * type, Args&&... args)
+        {
+            Wrapper * wrapper;
+            auto& free_list = _free_list();
+            if (!free_list.empty())
+            {
+                wrapper = free_list.back();
+                free_list.pop_back();
+                PyObject_Init(reinterpret_cast<PyObject*>(wrapper), type);
+            }
+            else
+            {
+                wrapper = reinterpret_cast<Wrapper*>(type->tp_alloc(type, 0));
+                if (!wrapper)
+                    return nullptr;
+            }
 
-    template <typename T>
-    using size_map = metal::at_key<
-    metal::map<
-            metal::pair<metal::number<'c'>, metal::number<1>>,
-            metal::pair<metal::number<'B'>, metal::number<1>>,
-            metal::pair<metal::number<'h'>, metal::number<2>>,
-            metal::pair<metal::number<'H'>, metal::number<2>>,
-            metal::pair<metal::number<'i'>, metal::number<4>>,
-            metal::pair<metal::number<'I'>, metal::number<4>>,
-            metal::pair<metal::number<'q'>, metal::number<8>>,
-            metal::pair<metal::number<'Q'>, metal::number<8>>,
-            metal::pair<metal::number<'f'>, metal::number<4>>,
-            metal::pair<metal::number<'d'>, metal::number<8>>,
-            metal::pair<metal::number<'P'>, metal::number<8>>>, T>;
-
-
-    template <typename T, size_t count_in, size_t max_size_in>
-    struct py_struct_element
-    {
-        using type = T;
-        using value = struct_code_map<T>;
-        static constexpr size_t count = count_in;
-        static constexpr size_t value_size = size_map<value>::value;
-        static constexpr size_t max_size = std::max(max_size_in, value_size);
-    };
+            try
+            {
+                wrapper->m_impl = new (&wrapper->m_impl_storage) Impl(std::forward<Args>(args)...);
+            }
+            catch (...)
+            {
+                wrapper->m_impl = nullptr;
+                Py_DECREF(reinterpret_cast<PyObject*>(wrapper));
+                PyErr_NoMemory();
+                return nullptr;
+            }
+            return wrapper;
+        }
 
+        // tp_dealloc for the wrapper type
+        static void destroy(PyObject * object)
+        {
+            Wrapper * wrapper = reinterpret_cast<Wrapper*>(object);
+            if (wrapper->m_impl)
+                wrapper->m_impl->~Impl();
+            wrapper->m_impl = nullptr;
+
+            auto& free_list = _free_list();
+            if (free_list.size() < max_free)
+                free_list.push_back(wrapper);
+            else
+                Py_TYPE(object)->tp_free(object);
+        }
 
-    template <typename T, size_t count_in, size_t max_size_in>
-    struct py_struct_element<T*, count_in, max_size_in>
-    {
-        using type = T*;
-        using value = metal::number<'P'>;
-        static constexpr size_t count = count_in;
-        static constexpr size_t max_size = 8;
+    private:
+        static std::vector<Wrapper*>& _free_list()
+        {
+            // Capacity is reserved up front so parking a wrapper in destroy never allocates
+            static std::vector<Wrapper*> free_list = []() {
+                std::vector<Wrapper*> result;
+                result.reserve(max_free);
+                return result;
+            }();
+            return free_list;
+        }
     };
 
 
-    template <typename Args>
-    struct extract_py_struct_element_impl;
-
+    template <typename T>
+    struct PyBufferViewWrapperImpl
+    {
+        static PyObject * tp_str(PyObject * obj);
+        // This length is the number of slices in the view
+        static Py_ssize_t sq_length(PyObject * obj);
+        // This returns the slice wrapper at the specified index
+        static PyObject * sq_item(PyObject * obj, Py_ssize_t index);
+        // Integer keys select a segment as sq_item does, negative ones counting from the end. A slice
+        // selects segments and returns a tuple of their storage wrappers.
+        static PyObject * mp_subscript(PyObject * obj, PyObject * key);
+        // rows(slice) selects a range of rows across the whole view and returns a tuple of zero-copy
+        // buffers, one per segment the range overlaps
+        static PyObject * rows(PyObject * obj, PyObject * key);
+        // Returns a PyBufferViewIterator over the segments of the view
+        static PyObject * tp_iter(PyObject * obj);
+        // Exports the whole view as one C-contiguous buffer. A single segment view is exported in place.
+        // Otherwise the segments are stitched into m_stitched, which is shared by overlapping exports, is
+        // counted in the pinned bytes of the segments' tracker and is freed when the last export is released.
+        // Zero-copy access to a multi segment view is through segments() or iteration.
+        static int bf_getbuffer(PyObject * exporter, Py_buffer * view, int flags);
+        static void bf_releasebuffer(PyObject * exporter, Py_buffer * view);
+        // Returns a tuple holding one zero-copy memoryview per storage segment
+        static PyObject * segments(PyObject * obj, PyObject * unused);
+        // Returns a storage wrapper for the segment at the given index which may be exported writable
+        static PyObject * writable_segment(PyObject * obj, PyObject * arg);
+        // Reductions over one member of every record in the view, selected by index or name. The
+        // segments are scanned natively and in parallel with the GIL released.
+        static PyObject * sum(PyObject * obj, PyObject * key);
+        static PyObject * min(PyObject * obj, PyObject * key);
+        static PyObject * max(PyObject * obj, PyObject * key);
+        static PyObject * mean(PyObject * obj, PyObject * key);
+        static PyObject * reduce(PyObject * obj, PyObject * key, pybuffer_container::reduction_op op);
+        // filter(member, op, value) with op one of < <= == != >= >. Returns a read only buffer holding a
+        // copy of every matching record, found by a parallel scan with the GIL released.
+        static PyObject * filter(PyObject * obj, PyObject * args);
+
+        typedef typename pybuffer_container::vector_storage<T>::shared_t shared_storage_t;
 
-    template <typename T, typename N, bool = std::is_same<T, typename N::type>::value>
-    struct pystruct_combine_type;
+        pybuffer_container::container_view<T> m_view;
+        std::vector<shared_storage_t> m_storage_elements;
+        shared_storage_t m_stitched; // contiguous copy of all segments, held only while exported
+        Py_ssize_t m_exports; // number of outstanding whole view exports
+        std::vector<Py_ssize_t> m_offsets; // row number of the first element of each segment
+        Py_ssize_t m_shape; // total number of elements across all segments
+        Py_ssize_t m_strides; // sizeof(T)
 
+        PyBufferViewWrapperImpl(const pybuffer_container::container_view<T>& view):
+            m_view(view),
+            m_storage_elements(view->get_storage_elements()),
+            m_exports(0),
+            m_shape(0),
+            m_strides(sizeof(T))
+        {
+            m_offsets.reserve(m_storage_elements.size());
+            for (auto& storage: m_storage_elements)
+            {
+                m_offsets.push_back(m_shape);
+                m_shape += storage->size();
+            }
+        }
 
-    template <typename T, typename ...Args>
-    struct extract_py_struct_element_impl<metal::list<T, Args...>> :public extract_py_struct_element_impl<metal::list<Args...>>
-    {
-        using list_t = typename extract_py_struct_element_impl<metal::list<Args...>>::result;
-        using front = metal::front<list_t>;
-        using rest = metal::range<list_t, metal::number<1>, metal::size<list_t>>;
-        using combined_elem = typename pystruct_combine_type<T, front>::result;
-        using result = metal::join<combined_elem, rest>;
+        // Pointer to the start of a contiguous buffer holding every element in the view, stitching the
+        // segments into m_stitched if there is more than one
+        const T * contiguous_data();
+        // Read only region wrapper over count rows of segment, starting at row start and step rows apart
+        PyObject * segment_region(size_t segment, Py_ssize_t start, Py_ssize_t count, Py_ssize_t step);
     };
 
 
     template <typename T>
-    struct extract_py_struct_element_impl<metal::list<T>>
-    {
-        using result = metal::list<py_struct_element<T, 1, 0>>;
-    };
-
-
-    template <>
-    struct extract_py_struct_element_impl< metal::list<>>
+    struct PyBufferStorageWrapperImpl
     {
-        using result = metal::list<>;
-    };
+        static PyObject * tp_str(PyObject * object);
+        static int bf_getbuffer(PyObject * exporter, Py_buffer * view, int flags);
+        static void bf_releasebuffer(PyObject * exporter, Py_buffer * view);
+        // Returns a zero-copy strided region holding one member of every record. The member is selected
+        // by index or by name (see py_struct_field_names).
+        static PyObject * field(PyObject * object, PyObject * key);
+        static PyObject * exports(PyObject * object, PyObject * unused);
 
+        typedef typename pybuffer_container::vector_storage<T>::shared_t shared_storage_t;
 
-    template <typename T, typename N>
-    struct pystruct_combine_type<T, N, true>
-    {
-        using result = metal::list<py_struct_element<T, N::count + 1, 0>>;
-    };
+        shared_storage_t m_storage; // shared ptr
+        Py_ssize_t m_shape; // m_storage->size. buffer protocol views need this
+        Py_ssize_t m_strides; // sizeof(T)
+        bool m_writable; // opt-in: PyBUF_WRITABLE requests are honored
+        Py_ssize_t m_exports; // number of outstanding buffer exports
 
+        PyBufferStorageWrapperImpl(const shared_storage_t& storage,
+                                   bool writable = false):
+            m_storage(storage),
+            m_writable(writable),
+            m_exports(0)
+        {
+            m_shape = m_storage->size();
+            m_strides = sizeof(T);
+        }
 
-    template <typename T, typename N>
-    struct pystruct_combine_type<T, N, false>
-    {
-        using result = metal::list<py_struct_element<T, 1, N::max_size>, N>;
+        // Copy on write: if any snapshot shares m_storage, replace it with a private copy so writes
+        // through an exported buffer stay invisible to every other live snapshot. Returns false if the
+        // storage is shared and buffers are still exported since those would be left on the old storage.
+        bool detach();
     };
 
 
-    template <template <typename ...> class T, typename ... Args>
-    auto extract_py_struct_elements(T<Args...> prototype)
+    // Iterates the segments of a view, yielding the same storage wrapper view[i] returns for each one
+    template <typename T>
+    struct PyBufferViewIteratorImpl
     {
-        return typename extract_py_struct_element_impl<metal::list<Args...>>::result();
-    }
+        static PyObject * tp_iternext(PyObject * object);
 
+        PyObject * m_view; // strong reference on the PyBufferViewWrapper
+        size_t m_next; // index of the next segment
 
-    template <typename T>
-    std::string extract_value()
-    {
-        size_t n = T::count;
-        std::string s;
-        if (T::count == 1)
+        PyBufferViewIteratorImpl(PyObject * view):
+            m_view(view),
+            m_next(0)
         {
-            s += T::value::value;
+            Py_INCREF(m_view);
         }
-        else
+
+        ~PyBufferViewIteratorImpl()
         {
-            s += std::to_string(T::count);
-            s += T::value::value;
+            Py_DECREF(m_view);
         }
-        return s;
-    }
+    };
 
 
-    template <typename ...Args>
-    std::string make_pystruct_code(metal::list<Args...> metal_list)
+    // Exports an arbitrary 1-d region of memory owned by a C++ object: a column of a columnar_storage,
+    // a single field projected out of a vector_storage segment or a row range of one. m_owner keeps the
+    // memory alive for as long as the wrapper, and so any buffer exported from it, exists.
+    struct PyBufferRegionWrapperImpl
     {
-        std::string result;
-        (result += ... += extract_value<Args>());
-        if (result.size())
+        static PyObject * tp_str(PyObject * object);
+        static int bf_getbuffer(PyObject * exporter, Py_buffer * view, int flags);
+        static void bf_releasebuffer(PyObject * exporter, Py_buffer * view);
+
+        std::shared_ptr<const void> m_owner;
+        void * m_buf;
+        Py_ssize_t m_shape; // number of items
+        Py_ssize_t m_strides; // bytes between consecutive items. Equal to m_itemsize when contiguous
+        Py_ssize_t m_itemsize;
+        const char * m_format; // struct code with static storage duration
+        // Set when m_owner is a tracked storage so exports of the region count as pins of its whole buffer
+        std::shared_ptr<pybuffer_container::buffer_pin_tracker> m_pin_tracker;
+        const void * m_pin_key = nullptr;
+        size_t m_pin_id = 0;
+        size_t m_pin_bytes = 0;
+
+        PyBufferRegionWrapperImpl(const std::shared_ptr<const void>& owner, const void * buf, Py_ssize_t shape,
+                                  Py_ssize_t strides, Py_ssize_t itemsize, const char * format):
+            m_owner(owner),
+            m_buf(const_cast<void*>(buf)),
+            m_shape(shape),
+            m_strides(strides),
+            m_itemsize(itemsize),
+            m_format(format)
         {
-            size_t alignment = metal::front<metal::list<Args...>>::max_size;
-            if (alignment > 1)
-            {
-                result += (alignment == 2 ? "0h" : (alignment == 4 ? "0i" : "0P"));
-            }
         }
-        return result;
-    }
-
-
-    template <typename StructType>
-    std::string _get_py_struct_code_impl()
-    {
-        static_assert(std::is_trivially_copyable<StructType>::value, "StructType must be trivially copyable");
-
-        // Use pfr to obtain a tuple containing the types of all the elements in the pod struct
-        auto reflection_type_info = boost::pfr::flat_structure_to_tuple(StructType());
-        using python_type_info = decltype(extract_py_struct_elements(reflection_type_info));
-        return make_pystruct_code(python_type_info());
-    }
-
-
-    template <typename StructType>
-    std::string get_py_struct_code()
-    {
-        static std::string result = _get_py_struct_code_impl<T>();
-        return result;
-    }
+    };
 
 
+    // Python write path. append() takes any object exporting a C-contiguous buffer of T records, checks its
+    // PEP 3118 format field by field against T once (append_raw() skips the check for raw bytes), and with
+    // the GIL released copies the rows into new vector_storage segments made by m_creator. The segments are
+    // then handed to m_sink, with the GIL held, for the owner to add to its container.
     template <typename T>
-    struct PyBufferViewWrapperImpl
+    struct PyBufferIngestWrapperImpl
     {
-        static void tp_dealloc(PyObject * obj);
-        static PyObject * tp_str(PyObject * obj);
-        // This length is the number of slices in the view
-        static Py_ssize_t sq_length(PyObject * obj);
-        // This returns the slice wrapper at the specified index
-        static PyObject * sq_item(PyObject * obj, Py_ssize_t index);
-        pybuffer_container::container_view<T> m_view;
-        std::vector<pybuffer_container::container_view::shared_storage_t> m_storage_elements;
+        typedef pybuffer_container::pybuffer_storage_creator<T> creator_t;
+        typedef typename creator_t::shared_base_t segment_t;
+        typedef std::function<void(std::vector<segment_t>& segments)> sink_t;
 
-        PyBufferViewWrapperImpl(const pybuffer_container::container_view<T>& view):
-            m_view(view),
-            m_storage_elements(view->get_storage_elements())
+        static PyObject * tp_str(PyObject * object);
+        // Returns the number of rows ingested
+        static PyObject * append(PyObject * object, PyObject * source);
+        // As append, for byte buffers the caller asserts hold packed T records
+        static PyObject * append_raw(PyObject * object, PyObject * source);
+        static PyObject * ingest(PyObject * object, PyObject * source, bool raw);
+        // Returns the number of rows in a buffer whose format matches T, or -1 with a python error set. A raw
+        // buffer only needs a length that is a multiple of sizeof(T).
+        static Py_ssize_t row_count(const Py_buffer& buffer, bool raw);
+
+        creator_t m_creator;
+        sink_t m_sink;
+        size_t m_segment_rows; // maximum rows per new segment
+
+        PyBufferIngestWrapperImpl(const creator_t& creator, const sink_t& sink, size_t segment_rows):
+            m_creator(creator),
+            m_sink(sink),
+            m_segment_rows(std::max<size_t>(segment_rows, 1))
         {
         }
     };
 
 
     template <typename T>
-    struct PyBufferStorageWrapperImpl
+    struct PyColumnarStorageWrapperImpl
     {
-        static void tp_dealloc(PyObject * object);
         static PyObject * tp_str(PyObject * object);
-        static int bf_getbuffer(PyObject * exporter, Py_buffer * view, int flags);
-        static void bf_releasebuffer(Py_buffer * view);
+        // This length is the number of fields (columns)
+        static Py_ssize_t sq_length(PyObject * object);
+        // This returns a region wrapper exporting the column at the specified field index
+        static PyObject * sq_item(PyObject * object, Py_ssize_t index);
 
-        pybuffer_container::container_view::shared_storage_t m_storage; // shared ptr
-        std::string m_format; // py struct code format
-        Py_ssize_t m_shape; // m_storage->size. buffer protocol views need this
-        Py_ssize_t m_strides; // sizeof(T)
+        typename pybuffer_container::columnar_storage<T>::shared_t m_storage;
 
-        PyBufferStorageWrapperImpl(const pybuffer_container::container_view::shared_storage_t& storage):
-            m_storage(storage),
-            m_format(get_py_struct_code<T>())
+        PyColumnarStorageWrapperImpl(const typename pybuffer_container::columnar_storage<T>::shared_t& storage):
+            m_storage(storage)
         {
-            m_shape = m_storage->size();
-            m_strides = sizeof(T);
         }
     };
 }
@@ -248,21 +339,99 @@ namespace pybuffer_container
     template <typename T>
     struct PyBufferViewWrapper
     {
+       typedef pybuffer_container_detail::PyBufferViewWrapperImpl<T> impl_t;
        PyObject_HEAD // PyObject ob_base;
-       PyBufferViewWrapperImpl<T> * m_impl;
+       impl_t * m_impl; // points into m_impl_storage
+       std::aligned_storage_t<sizeof(impl_t), alignof(impl_t)> m_impl_storage;
        // Must be called after python has been initialized.
        static PyBufferViewWrapper * create_py_view_wrapper(const pybuffer_container::container_view<T>& view);
     };
 
 
+    template <typename T>
+    struct PyBufferViewIterator
+    {
+        typedef pybuffer_container_detail::PyBufferViewIteratorImpl<T> impl_t;
+        PyObject_HEAD
+        impl_t * m_impl; // points into m_impl_storage
+        std::aligned_storage_t<sizeof(impl_t), alignof(impl_t)> m_impl_storage;
+        // Must be called after python has been initialized.
+        static PyBufferViewIterator * create_py_view_iterator(PyObject * view);
+    };
+
+
     template <typename T>
     struct PyBufferStorageWrapper
     {
+        typedef pybuffer_container_detail::PyBufferStorageWrapperImpl<T> impl_t;
+        PyObject_HEAD
+        impl_t * m_impl; // points into m_impl_storage
+        std::aligned_storage_t<sizeof(impl_t), alignof(impl_t)> m_impl_storage;
+        // The wrapper shares ownership of the segment so it outlives view_wrapper if need be.
+        // writable wrappers detach from shared storage on the first writable export
+        static PyBufferStorageWrapper * create_py_storage_wrapper(const PyBufferViewWrapper<T> * view_wrapper,
+                                                                  Py_ssize_t index, bool writable = false);
+        // Wraps a storage segment held directly by C++ code
+        static PyBufferStorageWrapper * create_py_storage_wrapper(const typename impl_t::shared_storage_t& storage,
+                                                                  bool writable = false);
+
+        // The storage the wrapper currently exports. After a writable export of a shared segment this is the
+        // private copy python wrote into, which nothing else references: put it back into the container (e.g.
+        // by replacing the segment) to keep the writes. They are discarded with the wrapper otherwise.
+        const typename impl_t::shared_storage_t& storage() const
+        {
+            return m_impl->m_storage;
+        }
+    };
+
+
+    struct PyBufferRegionWrapper
+    {
+        typedef pybuffer_container_detail::PyBufferRegionWrapperImpl impl_t;
+        PyObject_HEAD
+        impl_t * m_impl; // points into m_impl_storage
+        std::aligned_storage_t<sizeof(impl_t), alignof(impl_t)> m_impl_storage;
+        // Must be called after python has been initialized.
+        static PyBufferRegionWrapper * create_py_region_wrapper(const std::shared_ptr<const void>& owner, const void * buf,
+                                                                Py_ssize_t shape, Py_ssize_t strides, Py_ssize_t itemsize,
+                                                                const char * format);
+        // Exports a whole read only segment (anything with value_type, data() and size(), e.g. shm_segment)
+        // as a 1-d contiguous buffer that keeps the segment alive
+        template <typename Segment>
+        static PyBufferRegionWrapper * create_py_segment_region(const std::shared_ptr<const Segment>& segment);
+        // Exports a whole mmap_storage without copying. The region holds an export guard, so the storage
+        // refuses to grow, which could move its mapping, until the region is destroyed.
+        template <typename Storage>
+        static PyBufferRegionWrapper * create_py_mapped_region(const std::shared_ptr<Storage>& storage);
+    };
+
+
+    // Python interface for a columnar_storage. Each column is exported as its own 1-d contiguous buffer.
+    template <typename T>
+    struct PyColumnarStorageWrapper
+    {
+        typedef pybuffer_container_detail::PyColumnarStorageWrapperImpl<T> impl_t;
+        PyObject_HEAD
+        impl_t * m_impl; // points into m_impl_storage
+        std::aligned_storage_t<sizeof(impl_t), alignof(impl_t)> m_impl_storage;
+        // Must be called after python has been initialized.
+        static PyColumnarStorageWrapper * create_py_columnar_wrapper(const typename columnar_storage<T>::shared_t& storage);
+    };
+
+
+    template <typename T>
+    struct PyBufferIngestWrapper
+    {
+        typedef pybuffer_container_detail::PyBufferIngestWrapperImpl<T> impl_t;
+        typedef typename impl_t::creator_t creator_t;
+        typedef typename impl_t::sink_t sink_t;
         PyObject_HEAD
-        PyBufferStorageWrapperImpl<T> * m_impl;
-        // Note that PyBufferStorageWrapper owns a reference on view_wrapper.
-        static int bf_getbuffer(PyObject* exporter, Py_buffer* view, int flags);
-        static PyBufferStorageWrapper * create_py_storage_wrapper(const PyBufferViewWrapper * view_wrapper, Py_ssize_t index);
+        impl_t * m_impl; // points into m_impl_storage
+        std::aligned_storage_t<sizeof(impl_t), alignof(impl_t)> m_impl_storage;
+        static constexpr size_t default_segment_rows = 1 << 16;
+        // Must be called after python has been initialized.
+        static PyBufferIngestWrapper * create_py_ingest_wrapper(const creator_t& creator, const sink_t& sink,
+                                                                size_t segment_rows = default_segment_rows);
     };
 
 
@@ -270,12 +439,41 @@ namespace pybuffer_container
     PyTypeObject * pybuffer_view_type()
     {
         using namespace pybuffer_container_detail;
-        static std::string tp_name = "pybuffer_interface.PyBufferViewWrapper_" +
+        static std::string tp_name = std::string("pybuffer_interface.PyBufferViewWrapper_") +
         get_py_struct_code<T>();
 
-        static std::string doc_string = "Python wrapper for pybuffer_container::container_view with struct signature " +
+        static std::string doc_string = std::string("Python wrapper for pybuffer_container::container_view with struct signature ") +
         get_py_struct_code<T>();
 
+        static PyBufferProcs buffer_protocol_methods = {
+            &PyBufferViewWrapperImpl<T>::bf_getbuffer,
+            &PyBufferViewWrapperImpl<T>::bf_releasebuffer
+        };
+
+        static PyMethodDef methods[] = {
+            {"segments", &PyBufferViewWrapperImpl<T>::segments, METH_NOARGS,
+             "Return a tuple of zero-copy memoryviews, one per storage segment"},
+            {"rows", &PyBufferViewWrapperImpl<T>::rows, METH_O,
+             "rows(slice): return a tuple of zero-copy buffers over a range of rows, one per segment it overlaps"},
+            {"writable_segment", &PyBufferViewWrapperImpl<T>::writable_segment, METH_O,
+             "Return the segment at the given index as a storage wrapper supporting writable export. "
+             "The segment is copied on the first writable export if other snapshots share it, so writes land "
+             "in a private copy. The owning C++ code must fetch it with PyBufferStorageWrapper::storage() and "
+             "put it back into the container; otherwise the writes are discarded with the wrapper"},
+            {"sum", &PyBufferViewWrapperImpl<T>::sum, METH_O,
+             "Return the sum of a numeric member, selected by index or name, over every record in the view"},
+            {"min", &PyBufferViewWrapperImpl<T>::min, METH_O,
+             "Return the minimum of a numeric member, selected by index or name, over every record in the view"},
+            {"max", &PyBufferViewWrapperImpl<T>::max, METH_O,
+             "Return the maximum of a numeric member, selected by index or name, over every record in the view"},
+            {"mean", &PyBufferViewWrapperImpl<T>::mean, METH_O,
+             "Return the mean of a numeric member, selected by index or name, over every record in the view"},
+            {"filter", &PyBufferViewWrapperImpl<T>::filter, METH_VARARGS,
+             "filter(member, op, value): return a buffer of the records whose member compares to value as op "
+             "('<', '<=', '==', '!=', '>=', '>') requests"},
+            {nullptr, nullptr, 0, nullptr}
+        };
+
         static PySequenceMethods sequence_methods = {
             &PyBufferViewWrapperImpl<T>::sq_length,
             0, /* concat not supported. TODO: Investigate feasibility */
@@ -289,12 +487,18 @@ namespace pybuffer_container
             0 /* in place repeat */
         };
 
+        static PyMappingMethods mapping_methods = {
+            &PyBufferViewWrapperImpl<T>::sq_length,
+            &PyBufferViewWrapperImpl<T>::mp_subscript,
+            0 /* assignment not allowed */
+        };
+
        static PyTypeObject tp_object = {
             PyVarObject_HEAD_INIT(nullptr, 0)
             tp_name.c_str(),
-            sizeof(PyBufferViewWrapper), /* tp_basicsize */
+            sizeof(PyBufferViewWrapper<T>), /* tp_basicsize */
             0, /* tp_itemsize */
-            &PyBufferViewWrapperImpl<T>::tp_dealloc,
+            &_py_wrapper_allocator<PyBufferViewWrapper<T>, PyBufferViewWrapperImpl<T>>::destroy,
             0, /* tp_vectorcall_offset: TODOL investigate */
             0, /* tp_getattr deprecated */
             0, /* tp_setattr deprecated */
@@ -302,22 +506,22 @@ namespace pybuffer_container
             0, /* tp_repr */
             0,
             &sequence_methods, /* tp_as_sequence */
-            0, /* tp_as_mapping */
+            &mapping_methods, /* tp_as_mapping */
             0, /* tp_hash */
             0, /* tp_call */
             &PyBufferViewWrapperImpl<T>::tp_str,
             0, /* tp_getattro */
             0, /* tp_setattro */
-            0, /* tp_as_buffer TODO: Set this */
-            0, /* tp_flags TODO: Set correctly */
+            &buffer_protocol_methods, /* tp_as_buffer */
+            Py_TPFLAGS_DEFAULT, /* tp_flags */
             doc_string.c_str(), /* tp_doc */
             0, /* tp_traverse (for objects setting Py_TPFLAGS_HAVE_GC) */
             0, /* tp_clear. This is related to tp_traverse */
             0, /* tp_richcompare */
             0, /* tp_weaklist_offset */
-            0, /* tp_iter. TODO: Set */
+            &PyBufferViewWrapperImpl<T>::tp_iter, /* tp_iter */
             0, /* tp_iternext */
-            0, /* tp_methods */
+            methods, /* tp_methods */
             0, /* tp_members */
             0, /* tp_getset */
             0, /* tp_base (base type for this type) */
@@ -326,9 +530,9 @@ namespace pybuffer_container
             0, /* tp_descr_set */
             0, /* tp_dict_offset */
             0, /* tp_init: TODO: Investigate object initialization */
-            0, /* tp_alloc: Investigate allocation and initialization */
+            0, /* tp_alloc: PyType_GenericAlloc, inherited by PyType_Ready */
             0, /* tp_new */
-            0, /* tp_free: TODO: Investigate need for this */
+            0, /* tp_free: PyObject_Del, inherited by PyType_Ready */
             0, /* tp_is_gc: Should return 1 for collectible instance and 0 for otherwise */
             0, /* tp_bases: Only applicable for types created in Python source files */
             0, /* tp_mro: method resolution order. Only for types defined in Py source files */
@@ -342,8 +546,73 @@ namespace pybuffer_container
             // for PyBufferContainerWrapper
         };
 
-        // Note: Caller is responsible for calling PyType_Ready
-        return &tp_object;
+       if (!(PyType_GetFlags(&tp_object) & Py_TPFLAGS_READY))
+           PyType_Ready(&tp_object);
+       return &tp_object;
+    }
+
+
+    template <typename T>
+    PyTypeObject * pybuffer_view_iterator_type()
+    {
+        using namespace pybuffer_container_detail;
+        static std::string tp_name = std::string("pybuffer_interface.PyBufferViewIterator_") +
+        get_py_struct_code<T>();
+
+       static PyTypeObject tp_object = {
+            PyVarObject_HEAD_INIT(nullptr, 0)
+            tp_name.c_str(),
+            sizeof(PyBufferViewIterator<T>), /* tp_basicsize */
+            0, /* tp_itemsize */
+            &_py_wrapper_allocator<PyBufferViewIterator<T>, PyBufferViewIteratorImpl<T>>::destroy,
+            0, /* tp_vectorcall_offset */
+            0, /* tp_getattr deprecated */
+            0, /* tp_setattr deprecated */
+            0, /* tp_as_async */
+            0, /* tp_repr */
+            0,
+            0, /* tp_as_sequence */
+            0, /* tp_as_mapping */
+            0, /* tp_hash */
+            0, /* tp_call */
+            0, /* tp_str */
+            0, /* tp_getattro */
+            0, /* tp_setattro */
+            0, /* tp_as_buffer */
+            Py_TPFLAGS_DEFAULT, /* tp_flags */
+            "Iterator over the segments of a PyBufferViewWrapper", /* tp_doc */
+            0, /* tp_traverse (for objects setting Py_TPFLAGS_HAVE_GC) */
+            0, /* tp_clear. This is related to tp_traverse */
+            0, /* tp_richcompare */
+            0, /* tp_weaklist_offset */
+            &PyObject_SelfIter, /* tp_iter */
+            &PyBufferViewIteratorImpl<T>::tp_iternext, /* tp_iternext */
+            0, /* tp_methods */
+            0, /* tp_members */
+            0, /* tp_getset */
+            0, /* tp_base (base type for this type) */
+            0, /* tp_dict. Set by PyType_Ready */
+            0, /* tp_descr_get */
+            0, /* tp_descr_set */
+            0, /* tp_dict_offset */
+            0, /* tp_init */
+            0, /* tp_alloc */
+            0, /* tp_new */
+            0, /* tp_free */
+            0, /* tp_is_gc */
+            0, /* tp_bases: Only applicable for types created in Python source files */
+            0, /* tp_mro: method resolution order. Only for types defined in Py source files */
+            0, /* tp_cache: Internal use only */
+            0, /* tp_subclasses: Internal use only */
+            0, /* tp_weaklist: Internal use only */
+            0, /* tp_del: deprecated. Use tp_finalize */
+            0, /* tp_version: Internal use only */
+            0, /* tp_finalize */
+        };
+
+       if (!(PyType_GetFlags(&tp_object) & Py_TPFLAGS_READY))
+           PyType_Ready(&tp_object);
+       return &tp_object;
     }
 
 
@@ -351,10 +620,10 @@ namespace pybuffer_container
     PyTypeObject * pybuffer_storage_type()
     {
         using namespace pybuffer_container_detail;
-        static std::string tp_name = "pybuffer_interface.PyBufferStorageWrapper_" +
+        static std::string tp_name = std::string("pybuffer_interface.PyBufferStorageWrapper_") +
         get_py_struct_code<T>();
 
-        static std::string doc_string = "Python wrapper for pybuffer_container::container_view::shared_storage_t with struct signature " +
+        static std::string doc_string = std::string("Python wrapper for pybuffer_container::container_view::shared_storage_t with struct signature ") +
         get_py_struct_code<T>();
 
         static PyBufferProcs buffer_protocol_methods = {
@@ -362,12 +631,20 @@ namespace pybuffer_container
           &PyBufferStorageWrapperImpl<T>::bf_releasebuffer
         };
 
+        static PyMethodDef methods[] = {
+            {"field", &PyBufferStorageWrapperImpl<T>::field, METH_O,
+             "Return a zero-copy strided buffer over one member of every record, selected by index or name"},
+            {"exports", &PyBufferStorageWrapperImpl<T>::exports, METH_NOARGS,
+             "Return the number of buffers currently exported from this storage"},
+            {nullptr, nullptr, 0, nullptr}
+        };
+
        static PyTypeObject tp_object = {
             PyVarObject_HEAD_INIT(nullptr, 0)
             tp_name.c_str(),
-            sizeof(PyBufferViewWrapper), /* tp_basicsize */
+            sizeof(PyBufferStorageWrapper<T>), /* tp_basicsize */
             0, /* tp_itemsize */
-            &PyBufferStorageWrapperImpl<T>::tp_dealloc,
+            &_py_wrapper_allocator<PyBufferStorageWrapper<T>, PyBufferStorageWrapperImpl<T>>::destroy,
             0, /* tp_vectorcall_offset: TODOL investigate */
             0, /* tp_getattr deprecated */
             0, /* tp_setattr deprecated */
@@ -390,7 +667,7 @@ namespace pybuffer_container
             0, /* tp_weaklist_offset */
             0, /* tp_iter.(This type implements the sequence protocol so iter implemented based on that) */
             0, /* tp_iternext */
-            0, /* tp_methods */
+            methods, /* tp_methods */
             0, /* tp_members */
             0, /* tp_getset */
             0, /* tp_base (base type for this type) */
@@ -399,9 +676,9 @@ namespace pybuffer_container
             0, /* tp_descr_set */
             0, /* tp_dict_offset */
             0, /* tp_init: TODO: Investigate object initialization */
-            0, /* tp_alloc: Investigate allocation and initialization */
+            0, /* tp_alloc: PyType_GenericAlloc, inherited by PyType_Ready */
             0, /* tp_new: for immutable types, initialization should go here... */
-            0, /* tp_free: TODO: Investigate need for this */
+            0, /* tp_free: PyObject_Del, inherited by PyType_Ready */
             0, /* tp_is_gc: Should return 1 for collectible instance and 0 for otherwise */
             0, /* tp_bases: Only applicable for types created in Python source files */
             0, /* tp_mro: method resolution order. Only for types defined in Py source files */
@@ -415,10 +692,238 @@ namespace pybuffer_container
             // for PyBufferContainerWrapper
         };
 
-       if (!PyType_GetFlags(&tp_object) & Py_TPFLAGS_READY)
+       if (!(PyType_GetFlags(&tp_object) & Py_TPFLAGS_READY))
            PyType_Ready(&tp_object);
        return &tp_object;
     }
+
+    inline PyTypeObject * pybuffer_region_type()
+    {
+        using namespace pybuffer_container_detail;
+        static PyBufferProcs buffer_protocol_methods = {
+          &PyBufferRegionWrapperImpl::bf_getbuffer,
+          &PyBufferRegionWrapperImpl::bf_releasebuffer
+        };
+
+       static PyTypeObject tp_object = {
+            PyVarObject_HEAD_INIT(nullptr, 0)
+            "pybuffer_interface.PyBufferRegionWrapper",
+            sizeof(PyBufferRegionWrapper), /* tp_basicsize */
+            0, /* tp_itemsize */
+            &_py_wrapper_allocator<PyBufferRegionWrapper, PyBufferRegionWrapperImpl>::destroy,
+            0, /* tp_vectorcall_offset */
+            0, /* tp_getattr deprecated */
+            0, /* tp_setattr deprecated */
+            0, /* tp_as_async */
+            0, /* tp_repr */
+            0,
+            0, /* tp_as_sequence */
+            0, /* tp_as_mapping */
+            0, /* tp_hash */
+            0, /* tp_call */
+            &PyBufferRegionWrapperImpl::tp_str,
+            0, /* tp_getattro */
+            0, /* tp_setattro */
+            &buffer_protocol_methods, /* buffer protocol */
+            Py_TPFLAGS_DEFAULT, /* tp_flags */
+            "Python wrapper exporting a 1-d region of a pybuffer_container storage", /* tp_doc */
+            0, /* tp_traverse (for objects setting Py_TPFLAGS_HAVE_GC) */
+            0, /* tp_clear. This is related to tp_traverse */
+            0, /* tp_richcompare */
+            0, /* tp_weaklist_offset */
+            0, /* tp_iter */
+            0, /* tp_iternext */
+            0, /* tp_methods */
+            0, /* tp_members */
+            0, /* tp_getset */
+            0, /* tp_base (base type for this type) */
+            0, /* tp_dict. Set by PyType_Ready */
+            0, /* tp_descr_get */
+            0, /* tp_descr_set */
+            0, /* tp_dict_offset */
+            0, /* tp_init */
+            0, /* tp_alloc */
+            0, /* tp_new */
+            0, /* tp_free */
+            0, /* tp_is_gc */
+            0, /* tp_bases: Only applicable for types created in Python source files */
+            0, /* tp_mro: method resolution order. Only for types defined in Py source files */
+            0, /* tp_cache: Internal use only */
+            0, /* tp_subclasses: Internal use only */
+            0, /* tp_weaklist: Internal use only */
+            0, /* tp_del: deprecated. Use tp_finalize */
+            0, /* tp_version: Internal use only */
+            0, /* tp_finalize */
+        };
+
+       if (!(PyType_GetFlags(&tp_object) & Py_TPFLAGS_READY))
+           PyType_Ready(&tp_object);
+       return &tp_object;
+    }
+
+
+    template <typename T>
+    PyTypeObject * pybuffer_columnar_type()
+    {
+        using namespace pybuffer_container_detail;
+        static std::string tp_name = std::string("pybuffer_interface.PyColumnarStorageWrapper_") +
+        get_py_struct_code<T>();
+
+        static std::string doc_string = std::string("Python wrapper for pybuffer_container::columnar_storage with struct signature ") +
+        get_py_struct_code<T>();
+
+        static PySequenceMethods sequence_methods = {
+            &PyColumnarStorageWrapperImpl<T>::sq_length,
+            0, /* concat not supported */
+            0, /* repeat not supported */
+            &PyColumnarStorageWrapperImpl<T>::sq_item,
+            0, /* formerly sq_slice. */
+            0, /* assign not allowed */
+            0, /* was assign slice. Not supported */
+            0, /* sq_contains not supported */
+            0, /* in place concat */
+            0 /* in place repeat */
+        };
+
+       static PyTypeObject tp_object = {
+            PyVarObject_HEAD_INIT(nullptr, 0)
+            tp_name.c_str(),
+            sizeof(PyColumnarStorageWrapper<T>), /* tp_basicsize */
+            0, /* tp_itemsize */
+            &_py_wrapper_allocator<PyColumnarStorageWrapper<T>, PyColumnarStorageWrapperImpl<T>>::destroy,
+            0, /* tp_vectorcall_offset */
+            0, /* tp_getattr deprecated */
+            0, /* tp_setattr deprecated */
+            0, /* tp_as_async */
+            0, /* tp_repr */
+            0,
+            &sequence_methods, /* tp_as_sequence */
+            0, /* tp_as_mapping */
+            0, /* tp_hash */
+            0, /* tp_call */
+            &PyColumnarStorageWrapperImpl<T>::tp_str,
+            0, /* tp_getattro */
+            0, /* tp_setattro */
+            0, /* tp_as_buffer: columns are exported individually */
+            Py_TPFLAGS_DEFAULT, /* tp_flags */
+            doc_string.c_str(), /* tp_doc */
+            0, /* tp_traverse (for objects setting Py_TPFLAGS_HAVE_GC) */
+            0, /* tp_clear. This is related to tp_traverse */
+            0, /* tp_richcompare */
+            0, /* tp_weaklist_offset */
+            0, /* tp_iter (iteration falls back on the sequence protocol) */
+            0, /* tp_iternext */
+            0, /* tp_methods */
+            0, /* tp_members */
+            0, /* tp_getset */
+            0, /* tp_base (base type for this type) */
+            0, /* tp_dict. Set by PyType_Ready */
+            0, /* tp_descr_get */
+            0, /* tp_descr_set */
+            0, /* tp_dict_offset */
+            0, /* tp_init */
+            0, /* tp_alloc */
+            0, /* tp_new */
+            0, /* tp_free */
+            0, /* tp_is_gc */
+            0, /* tp_bases: Only applicable for types created in Python source files */
+            0, /* tp_mro: method resolution order. Only for types defined in Py source files */
+            0, /* tp_cache: Internal use only */
+            0, /* tp_subclasses: Internal use only */
+            0, /* tp_weaklist: Internal use only */
+            0, /* tp_del: deprecated. Use tp_finalize */
+            0, /* tp_version: Internal use only */
+            0, /* tp_finalize */
+        };
+
+       if (!(PyType_GetFlags(&tp_object) & Py_TPFLAGS_READY))
+           PyType_Ready(&tp_object);
+       return &tp_object;
+    }
+
+
+    template <typename T>
+    PyTypeObject * pybuffer_ingest_type()
+    {
+        using namespace pybuffer_container_detail;
+        static std::string tp_name = std::string("pybuffer_interface.PyBufferIngestWrapper_") +
+        get_py_struct_code<T>();
+
+        static std::string doc_string = std::string("Bulk ingest of python buffers into pybuffer_container storage with struct signature ") +
+        get_py_struct_code<T>();
+
+        static PyMethodDef methods[] = {
+            {"append", &PyBufferIngestWrapperImpl<T>::append, METH_O,
+             "Copy every record of a C-contiguous buffer whose format matches the record layout into new "
+             "storage segments. Returns the number of records ingested"},
+            {"append_raw", &PyBufferIngestWrapperImpl<T>::append_raw, METH_O,
+             "Copy a C-contiguous buffer of packed records into new storage segments without checking its "
+             "format. Returns the number of records ingested"},
+            {nullptr, nullptr, 0, nullptr}
+        };
+
+       static PyTypeObject tp_object = {
+            PyVarObject_HEAD_INIT(nullptr, 0)
+            tp_name.c_str(),
+            sizeof(PyBufferIngestWrapper<T>), /* tp_basicsize */
+            0, /* tp_itemsize */
+            &_py_wrapper_allocator<PyBufferIngestWrapper<T>, PyBufferIngestWrapperImpl<T>>::destroy,
+            0, /* tp_vectorcall_offset */
+            0, /* tp_getattr deprecated */
+            0, /* tp_setattr deprecated */
+            0, /* tp_as_async */
+            0, /* tp_repr */
+            0,
+            0, /* tp_as_sequence */
+            0, /* tp_as_mapping */
+            0, /* tp_hash */
+            0, /* tp_call */
+            &PyBufferIngestWrapperImpl<T>::tp_str,
+            0, /* tp_getattro */
+            0, /* tp_setattro */
+            0, /* tp_as_buffer */
+            Py_TPFLAGS_DEFAULT, /* tp_flags */
+            doc_string.c_str(), /* tp_doc */
+            0, /* tp_traverse (for objects setting Py_TPFLAGS_HAVE_GC) */
+            0, /* tp_clear. This is related to tp_traverse */
+            0, /* tp_richcompare */
+            0, /* tp_weaklist_offset */
+            0, /* tp_iter */
+            0, /* tp_iternext */
+            methods, /* tp_methods */
+            0, /* tp_members */
+            0, /* tp_getset */
+            0, /* tp_base (base type for this type) */
+            0, /* tp_dict. Set by PyType_Ready */
+            0, /* tp_descr_get */
+            0, /* tp_descr_set */
+            0, /* tp_dict_offset */
+            0, /* tp_init */
+            0, /* tp_alloc */
+            0, /* tp_new */
+            0, /* tp_free */
+            0, /* tp_is_gc */
+            0, /* tp_bases: Only applicable for types created in Python source files */
+            0, /* tp_mro: method resolution order. Only for types defined in Py source files */
+            0, /* tp_cache: Internal use only */
+            0, /* tp_subclasses: Internal use only */
+            0, /* tp_weaklist: Internal use only */
+            0, /* tp_del: deprecated. Use tp_finalize */
+            0, /* tp_version: Internal use only */
+            0, /* tp_finalize */
+        };
+
+       if (!(PyType_GetFlags(&tp_object) & Py_TPFLAGS_READY))
+           PyType_Ready(&tp_object);
+       return &tp_object;
+    }
+
+
+    // Adds storage_stats() to an extension module. It returns {element type: {counter: value}} with the
+    // counters of read_storage_stats plus outstanding_exports, and outstanding_exports_by_storage mapping the
+    // id of each storage with exports to their count. The dict is empty unless the build defines
+    // PYBUFFER_STATS. Returns -1 with a python error set on failure.
+    int add_storage_stats_function(PyObject * module);
 }
 
 
@@ -27,40 +27,89 @@
 
 namespace pybuffer_container_detail
 {
+    // Resolves a python member index or name to the field description of T. Sets a python error and
+    // returns nullptr if the key is not valid.
     template <typename T>
-    void PyBufferViewWrapperImpl<T>::tp_dealloc(PyObject * obj)
+    const py_struct_field * _lookup_struct_field(PyObject * key)
     {
-        using namespace pybuffer_container;
-        PyBufferViewWrapper<T> * view_wrapper = static_cast<PyBufferViewWrapper*>(obj);
-        if (obj->m_impl)
-            delete obj->m_impl;
+        typedef py_struct_fields<T> fields_t;
+        const py_struct_field * selected = nullptr;
+
+        if (PyLong_Check(key))
+        {
+            Py_ssize_t index = PyLong_AsSsize_t(key);
+            if (index == -1 && PyErr_Occurred())
+                return nullptr;
+            if (index >= 0 && index < static_cast<Py_ssize_t>(fields_t::count))
+                selected = &fields_t::value()[index];
+        }
+        else if (PyUnicode_Check(key))
+        {
+            const char * name = PyUnicode_AsUTF8(key);
+            if (!name)
+                return nullptr;
+            selected = fields_t::find(name);
+        }
+        else
+        {
+            PyErr_SetString(PyExc_TypeError, "expected a member index or name");
+            return nullptr;
+        }
+
+        if (!selected)
+            PyErr_SetObject(PyExc_KeyError, key);
+        return selected;
+    }
+
 
-        // auto type_object = Py_Type(obj);
+    // Pins or unpins the buffer behind storage in its creator's tracker, if it has one
+    template <typename Storage>
+    void _pin_storage(const Storage& storage)
+    {
+        if (auto& pins = storage->pin_tracker())
+            pins->pin(storage->pin_key(), storage->id(), storage->pin_bytes());
+    }
+
+
+    template <typename Storage>
+    void _unpin_storage(const Storage& storage)
+    {
+        if (auto& pins = storage->pin_tracker())
+            pins->unpin(storage->pin_key());
+    }
 
-        // PyBufferViewWrapper objects are constructed with c++ new
-        delete view_wrapper;
-        return;
+
+    // Makes exports of a region over storage count against the storage's pin tracker, if it has one
+    template <typename Storage>
+    PyObject * _track_region_pins(pybuffer_container::PyBufferRegionWrapper * region, const Storage& storage)
+    {
+        if (region && storage->pin_tracker())
+        {
+            region->m_impl->m_pin_tracker = storage->pin_tracker();
+            region->m_impl->m_pin_key = storage->pin_key();
+            region->m_impl->m_pin_id = storage->id();
+            region->m_impl->m_pin_bytes = storage->pin_bytes();
+        }
+        return reinterpret_cast<PyObject*>(region);
     }
 
 
     template <typename T>
-    PyObject * tp_str(PyObject * obj)
+    PyObject * PyBufferViewWrapperImpl<T>::tp_str(PyObject * obj)
     {
-        using namespace pybuffer_container;
-        PyBufferViewWrapper * view_wrapper = static_cast<PyBufferViewWrapper*>(obj);
         // TODO: Add more detail
-        return PyString_FromString("PyBufferViewWrapper instance");
+        return PyUnicode_FromString("PyBufferViewWrapper instance");
     }
 
 
     template <typename T>
-    Py_ssize_t sq_length(PyObject * obj)
+    Py_ssize_t PyBufferViewWrapperImpl<T>::sq_length(PyObject * obj)
     {
         using namespace pybuffer_container;
-        PyBufferViewWrapper * view_wrapper = static_cast<PyBufferViewWrapper*>(obj);
+        PyBufferViewWrapper<T> * view_wrapper = reinterpret_cast<PyBufferViewWrapper<T>*>(obj);
         if (!view_wrapper->m_impl)
             return 0;
-        return view_wrapper->m_impl->m_storage_elements->size();
+        return view_wrapper->m_impl->m_storage_elements.size();
     }
 
 
@@ -68,28 +117,469 @@ namespace pybuffer_container_detail
     PyObject * PyBufferViewWrapperImpl<T>::sq_item(PyObject * obj, Py_ssize_t index)
     {
         using namespace pybuffer_container;
-        PyBufferViewWrapper * view_wrapper = static_cast<PyBufferViewWrapper*>(obj);
-        if (index < 0 || index >= obj->m_impl->m_storage_elements.size())
-            return PyErr_SetString(PyExc_IndexError, "Index out of bounds to PyBufferViewWrapper object");
-        return PyBufferStorageWrapper<T>::create_py_storage_wrapper(view_wrapper, index);
+        PyBufferViewWrapper<T> * view_wrapper = reinterpret_cast<PyBufferViewWrapper<T>*>(obj);
+        if (index < 0 || index >= static_cast<Py_ssize_t>(view_wrapper->m_impl->m_storage_elements.size()))
+        {
+            PyErr_SetString(PyExc_IndexError, "Index out of bounds to PyBufferViewWrapper object");
+            return nullptr;
+        }
+        return reinterpret_cast<PyObject*>(PyBufferStorageWrapper<T>::create_py_storage_wrapper(view_wrapper, index));
+    }
+
+
+    template <typename T>
+    PyObject * PyBufferViewWrapperImpl<T>::segment_region(size_t segment, Py_ssize_t start, Py_ssize_t count,
+                                                          Py_ssize_t step)
+    {
+        using namespace pybuffer_container;
+        auto& storage = m_storage_elements[segment];
+        return _track_region_pins(PyBufferRegionWrapper::create_py_region_wrapper(
+            storage, storage->data() + start, count, step * sizeof(T), sizeof(T), get_py_struct_code<T>()), storage);
     }
 
 
     template <typename T>
-    void PyBufferStorageWrapperImpl<T>::tp_dealloc(PyObject * object)
+    PyObject * PyBufferViewWrapperImpl<T>::mp_subscript(PyObject * obj, PyObject * key)
     {
         using namespace pybuffer_container;
-        PyBufferStorageWrapper * storage_wrapper = static_cast<PyBufferStorageWrapper*>(object);
-        delete storage_wrapper->m_impl;
-        delete storage_wrapper;
-        return;
+        if (!PySlice_Check(key))
+        {
+            Py_ssize_t index = PyNumber_AsSsize_t(key, PyExc_IndexError);
+            if (index == -1 && PyErr_Occurred())
+                return nullptr;
+            // The sequence protocol applied this for us before mp_subscript took over integer keys
+            if (index < 0)
+                index += sq_length(obj);
+            return sq_item(obj, index);
+        }
+
+        Py_ssize_t start, stop, step;
+        if (PySlice_Unpack(key, &start, &stop, &step) < 0)
+            return nullptr;
+
+        const Py_ssize_t count = PySlice_AdjustIndices(sq_length(obj), &start, &stop, step);
+        PyObject * result = PyTuple_New(count);
+        if (!result)
+            return nullptr;
+
+        for (Py_ssize_t index = 0; index < count; ++index, start += step)
+        {
+            PyObject * segment = sq_item(obj, start);
+            if (!segment)
+            {
+                Py_DECREF(result);
+                return nullptr;
+            }
+            PyTuple_SET_ITEM(result, index, segment);
+        }
+        return result;
+    }
+
+
+    template <typename T>
+    PyObject * PyBufferViewWrapperImpl<T>::rows(PyObject * obj, PyObject * key)
+    {
+        using namespace pybuffer_container;
+        if (!PySlice_Check(key))
+        {
+            PyErr_SetString(PyExc_TypeError, "PyBufferViewWrapper.rows expects a slice");
+            return nullptr;
+        }
+
+        auto impl = reinterpret_cast<PyBufferViewWrapper<T>*>(obj)->m_impl;
+        Py_ssize_t start, stop, step;
+        if (PySlice_Unpack(key, &start, &stop, &step) < 0)
+            return nullptr;
+
+        if (step < 0)
+        {
+            PyErr_SetString(PyExc_ValueError, "PyBufferViewWrapper slices must have a positive step");
+            return nullptr;
+        }
+
+        Py_ssize_t remaining = PySlice_AdjustIndices(impl->m_shape, &start, &stop, step);
+        std::vector<PyObject*> regions;
+        while (remaining > 0)
+        {
+            // Empty segments share their offset with the next segment so upper_bound steps over them
+            const size_t segment = std::upper_bound(impl->m_offsets.begin(), impl->m_offsets.end(), start) -
+                                   impl->m_offsets.begin() - 1;
+            const Py_ssize_t local = start - impl->m_offsets[segment];
+            const Py_ssize_t available = (static_cast<Py_ssize_t>(impl->m_storage_elements[segment]->size()) -
+                                          local + step - 1) / step;
+            const Py_ssize_t count = std::min(remaining, available);
+
+            PyObject * region = impl->segment_region(segment, local, count, step);
+            if (!region)
+            {
+                for (auto created: regions)
+                    Py_DECREF(created);
+                return nullptr;
+            }
+            regions.push_back(region);
+            start += count * step;
+            remaining -= count;
+        }
+
+        PyObject * result = PyTuple_New(regions.size());
+        if (!result)
+        {
+            for (auto created: regions)
+                Py_DECREF(created);
+            return nullptr;
+        }
+
+        for (size_t index = 0; index < regions.size(); ++index)
+            PyTuple_SET_ITEM(result, index, regions[index]);
+        return result;
+    }
+
+
+    template <typename T>
+    PyObject * PyBufferViewWrapperImpl<T>::tp_iter(PyObject * obj)
+    {
+        using namespace pybuffer_container;
+        return reinterpret_cast<PyObject*>(PyBufferViewIterator<T>::create_py_view_iterator(obj));
+    }
+
+
+    template <typename T>
+    PyObject * PyBufferViewIteratorImpl<T>::tp_iternext(PyObject * object)
+    {
+        using namespace pybuffer_container;
+        auto impl = reinterpret_cast<PyBufferViewIterator<T>*>(object)->m_impl;
+        auto view_wrapper = reinterpret_cast<PyBufferViewWrapper<T>*>(impl->m_view);
+
+        // Returning nullptr without an exception set signals the end of iteration
+        if (impl->m_next == view_wrapper->m_impl->m_storage_elements.size())
+            return nullptr;
+
+        return reinterpret_cast<PyObject*>(PyBufferStorageWrapper<T>::create_py_storage_wrapper(view_wrapper,
+                                                                                               impl->m_next++));
+    }
+
+
+    template <typename T>
+    const T * PyBufferViewWrapperImpl<T>::contiguous_data()
+    {
+        // A single segment is already contiguous so there is nothing to stitch
+        if (m_storage_elements.size() == 1)
+            return m_storage_elements[0]->data();
+
+        if (!m_stitched)
+        {
+            m_stitched = std::make_shared<pybuffer_container::vector_storage<T>>();
+            m_stitched->resize(m_shape);
+            T * pos = m_stitched->mutable_data();
+            for (auto& storage: m_storage_elements)
+            {
+                pos = std::copy(storage->data(), storage->data() + storage->size(), pos);
+                if (!m_stitched->pin_tracker() && storage->pin_tracker())
+                    m_stitched->set_pin_tracker(storage->pin_tracker());
+            }
+        }
+        return m_stitched->data();
+    }
+
+
+    template <typename T>
+    int PyBufferViewWrapperImpl<T>::bf_getbuffer(PyObject * exporter, Py_buffer * view, int flags)
+    {
+        using namespace pybuffer_container;
+        // Views are snapshots and are never writable. F-contiguous is equivalent to C-contiguous
+        // for 1-d buffers so it is accepted along with every other layout request.
+        if (flags & PyBUF_WRITABLE)
+        {
+            PyErr_SetString(PyExc_BufferError, "PyBufferViewWrapper only exports read only buffers");
+            view->obj = nullptr;
+            return -1;
+        }
+
+        PyBufferViewWrapper<T> * view_wrapper = reinterpret_cast<PyBufferViewWrapper<T>*>(exporter);
+        auto impl = view_wrapper->m_impl;
+        const T * data;
+        try
+        {
+            data = impl->contiguous_data();
+        }
+        catch (std::bad_alloc&)
+        {
+            PyErr_NoMemory();
+            view->obj = nullptr;
+            return -1;
+        }
+
+        Py_INCREF(exporter);
+        view->obj = exporter;
+        view->readonly = 1;
+        view->buf = const_cast<T*>(data);
+        view->len = impl->m_shape * sizeof(T);
+        view->itemsize = sizeof(T);
+        view->ndim = 1;
+        view->shape = (flags & PyBUF_ND) == PyBUF_ND ? &impl->m_shape : nullptr;
+        view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? &impl->m_strides : nullptr;
+        view->suboffsets = nullptr;
+        view->internal = nullptr;
+
+        if (flags & PyBUF_FORMAT)
+            view->format = const_cast<char*>(get_py_struct_code<T>());
+        else
+            view->format = nullptr;
+
+        // The export keeps every segment alive, and the stitched copy while any export remains
+        for (auto& storage: impl->m_storage_elements)
+        {
+            _pin_storage(storage);
+            PYBUFFER_STAT_EXPORT(T, storage->id(), true);
+        }
+        if (impl->m_stitched)
+            _pin_storage(impl->m_stitched);
+        ++impl->m_exports;
+
+        PYBUFFER_STAT(T, stat_buffer_exports, 1);
+        return 0;
+    }
+
+
+    template <typename T>
+    void PyBufferViewWrapperImpl<T>::bf_releasebuffer(PyObject * exporter, Py_buffer * view)
+    {
+        // PyBuffer_Release drops the reference on view->obj
+        using namespace pybuffer_container;
+        auto impl = reinterpret_cast<PyBufferViewWrapper<T>*>(exporter)->m_impl;
+        for (auto& storage: impl->m_storage_elements)
+        {
+            _unpin_storage(storage);
+            PYBUFFER_STAT_EXPORT(T, storage->id(), false);
+        }
+        if (impl->m_stitched)
+            _unpin_storage(impl->m_stitched);
+
+        // Nothing can see the stitched copy once the last export is gone
+        if (--impl->m_exports == 0)
+            impl->m_stitched.reset();
+        PYBUFFER_STAT(T, stat_buffer_releases, 1);
+    }
+
+
+    template <typename T>
+    PyObject * PyBufferViewWrapperImpl<T>::segments(PyObject * obj, PyObject * unused)
+    {
+        using namespace pybuffer_container;
+        PyBufferViewWrapper<T> * view_wrapper = reinterpret_cast<PyBufferViewWrapper<T>*>(obj);
+        const Py_ssize_t count = view_wrapper->m_impl->m_storage_elements.size();
+        PyObject * result = PyTuple_New(count);
+        if (!result)
+            return nullptr;
+
+        for (Py_ssize_t index = 0; index < count; ++index)
+        {
+            PyObject * storage_wrapper = reinterpret_cast<PyObject*>(
+                PyBufferStorageWrapper<T>::create_py_storage_wrapper(view_wrapper, index));
+            if (!storage_wrapper)
+            {
+                Py_DECREF(result);
+                return nullptr;
+            }
+
+            // The memoryview holds its own reference on the storage wrapper through the exported buffer
+            PyObject * memory_view = PyMemoryView_FromObject(storage_wrapper);
+            Py_DECREF(storage_wrapper);
+            if (!memory_view)
+            {
+                Py_DECREF(result);
+                return nullptr;
+            }
+            PyTuple_SET_ITEM(result, index, memory_view);
+        }
+        return result;
+    }
+
+
+    template <typename T>
+    PyObject * PyBufferViewWrapperImpl<T>::writable_segment(PyObject * obj, PyObject * arg)
+    {
+        using namespace pybuffer_container;
+        PyBufferViewWrapper<T> * view_wrapper = reinterpret_cast<PyBufferViewWrapper<T>*>(obj);
+        Py_ssize_t index = PyLong_AsSsize_t(arg);
+        if (index == -1 && PyErr_Occurred())
+            return nullptr;
+
+        if (index < 0 || index >= static_cast<Py_ssize_t>(view_wrapper->m_impl->m_storage_elements.size()))
+        {
+            PyErr_SetString(PyExc_IndexError, "Index out of bounds to PyBufferViewWrapper object");
+            return nullptr;
+        }
+        return reinterpret_cast<PyObject*>(PyBufferStorageWrapper<T>::create_py_storage_wrapper(view_wrapper, index, true));
+    }
+
+
+    template <typename T>
+    PyObject * PyBufferViewWrapperImpl<T>::reduce(PyObject * obj, PyObject * key, pybuffer_container::reduction_op op)
+    {
+        using namespace pybuffer_container;
+        PyBufferViewWrapper<T> * view_wrapper = reinterpret_cast<PyBufferViewWrapper<T>*>(obj);
+        const py_struct_field * selected = _lookup_struct_field<T>(key);
+        if (!selected)
+            return nullptr;
+
+        const size_t field = selected - py_struct_fields<T>::value().data();
+        auto& segments = view_wrapper->m_impl->m_storage_elements;
+        reduction_value result;
+        bool reduced;
+
+        // The view holds references on every segment and snapshots are immutable so the scan is safe
+        // without the GIL
+        Py_BEGIN_ALLOW_THREADS
+        reduced = reduce_field<T>(work_stealing_pool::shared(), segments, field, op, result);
+        Py_END_ALLOW_THREADS
+
+        if (!reduced)
+        {
+            PyErr_Format(PyExc_TypeError, "member %s is not numeric", selected->name);
+            return nullptr;
+        }
+
+        switch (result.kind)
+        {
+            case reduction_value::signed_integer: return PyLong_FromLongLong(result.signed_value);
+            case reduction_value::unsigned_integer: return PyLong_FromUnsignedLongLong(result.unsigned_value);
+            case reduction_value::floating: return PyFloat_FromDouble(result.floating_value);
+            case reduction_value::overflow:
+                PyErr_Format(PyExc_OverflowError, "sum of member %s does not fit in 64 bits", selected->name);
+                return nullptr;
+            default:
+                PyErr_SetString(PyExc_ValueError, "reduction over an empty view");
+                return nullptr;
+        }
+    }
+
+
+    template <typename T>
+    PyObject * PyBufferViewWrapperImpl<T>::filter(PyObject * obj, PyObject * args)
+    {
+        using namespace pybuffer_container;
+        PyObject * key;
+        const char * op_name;
+        PyObject * operand_object;
+        if (!PyArg_ParseTuple(args, "OsO", &key, &op_name, &operand_object))
+            return nullptr;
+
+        const py_struct_field * selected = _lookup_struct_field<T>(key);
+        if (!selected)
+            return nullptr;
+
+        static const std::pair<const char*, compare_op> op_names[] = {
+            {"<", compare_op::lt}, {"<=", compare_op::le}, {"==", compare_op::eq},
+            {"!=", compare_op::ne}, {">=", compare_op::ge}, {">", compare_op::gt}
+        };
+
+        const std::pair<const char*, compare_op> * op = nullptr;
+        for (auto& candidate: op_names)
+            if (std::strcmp(candidate.first, op_name) == 0)
+                op = &candidate;
+
+        if (!op)
+        {
+            PyErr_Format(PyExc_ValueError, "unknown comparison %s", op_name);
+            return nullptr;
+        }
+
+        reduction_value operand = {reduction_value::floating, 0, 0, 0.0};
+        if (PyLong_Check(operand_object))
+        {
+            int overflow = 0;
+            operand.kind = reduction_value::signed_integer;
+            operand.signed_value = PyLong_AsLongLongAndOverflow(operand_object, &overflow);
+            if (overflow > 0)
+            {
+                operand.kind = reduction_value::unsigned_integer;
+                operand.unsigned_value = PyLong_AsUnsignedLongLong(operand_object);
+            }
+            else if (overflow < 0)
+            {
+                PyErr_SetString(PyExc_OverflowError, "filter operand is out of range");
+                return nullptr;
+            }
+        }
+        else
+        {
+            operand.floating_value = PyFloat_AsDouble(operand_object);
+        }
+
+        if (PyErr_Occurred())
+            return nullptr;
+
+        PyBufferViewWrapper<T> * view_wrapper = reinterpret_cast<PyBufferViewWrapper<T>*>(obj);
+        auto& segments = view_wrapper->m_impl->m_storage_elements;
+        const size_t field = selected - py_struct_fields<T>::value().data();
+        auto matches = std::make_shared<std::vector<T>>();
+        bool filtered;
+
+        Py_BEGIN_ALLOW_THREADS
+        filtered = filter_field<T>(work_stealing_pool::shared(), segments, field, op->second, operand, *matches);
+        Py_END_ALLOW_THREADS
+
+        if (!filtered)
+        {
+            PyErr_Format(PyExc_TypeError, "member %s is not numeric", selected->name);
+            return nullptr;
+        }
+
+        return reinterpret_cast<PyObject*>(PyBufferRegionWrapper::create_py_region_wrapper(
+            matches, matches->data(), matches->size(), sizeof(T), sizeof(T), get_py_struct_code<T>()));
+    }
+
+
+    template <typename T>
+    PyObject * PyBufferViewWrapperImpl<T>::sum(PyObject * obj, PyObject * key)
+    {
+        return reduce(obj, key, pybuffer_container::reduction_op::sum);
+    }
+
+
+    template <typename T>
+    PyObject * PyBufferViewWrapperImpl<T>::min(PyObject * obj, PyObject * key)
+    {
+        return reduce(obj, key, pybuffer_container::reduction_op::min);
+    }
+
+
+    template <typename T>
+    PyObject * PyBufferViewWrapperImpl<T>::max(PyObject * obj, PyObject * key)
+    {
+        return reduce(obj, key, pybuffer_container::reduction_op::max);
+    }
+
+
+    template <typename T>
+    PyObject * PyBufferViewWrapperImpl<T>::mean(PyObject * obj, PyObject * key)
+    {
+        return reduce(obj, key, pybuffer_container::reduction_op::mean);
     }
 
 
     template <typename T>
     PyObject* PyBufferStorageWrapperImpl<T>::tp_str(PyObject * object)
     {
-        return PyString_FromString("PyBufferStorage instance");
+        return PyUnicode_FromString("PyBufferStorage instance");
+    }
+
+
+    template <typename T>
+    bool PyBufferStorageWrapperImpl<T>::detach()
+    {
+        if (m_storage.use_count() == 1 && m_storage->is_exclusive())
+            return true;
+
+        // Taking a private buffer moves the data, which read only exports may still point at
+        if (m_exports)
+            return false;
+
+        if (m_storage.use_count() != 1)
+            m_storage = std::static_pointer_cast<pybuffer_container::vector_storage<T>>(m_storage->copy());
+        m_storage->mutable_data();
+        return true;
     }
 
 
@@ -97,38 +587,384 @@ namespace pybuffer_container_detail
     int PyBufferStorageWrapperImpl<T>::bf_getbuffer(PyObject* exporter, Py_buffer* view, int flags)
     {
         using namespace pybuffer_container;
-        // Only C-style contiguous RO buffers are supported
-        if (flags & (PyBUF_WRITABLE | PyBUF_F_CONTIGUOUS))
+        pybuffer_container::PyBufferStorageWrapper<T> * wrapper = reinterpret_cast<PyBufferStorageWrapper<T>*>(exporter);
+        auto impl = wrapper->m_impl;
+        const bool writable = flags & PyBUF_WRITABLE;
+
+        if (writable && !impl->m_writable)
         {
-            view->obj = 0;
+            PyErr_SetString(PyExc_BufferError, "PyBufferStorageWrapper was not created for writable export");
+            view->obj = nullptr;
             return -1;
         }
 
-        pybuffer_container::PyBufferStorageWrapper<T> * wrapper = static_cast<PyBufferStorageWrapper*>(exporter);
-        Py_INCREF(wrapper);
-        view->obj = wrapper;
-        view->readonly = 1;
-        view->buf = wrapper->m_impl->m_storage->data();
+        if (writable && !impl->detach())
+        {
+            PyErr_SetString(PyExc_BufferError, "Shared storage cannot be detached while read only buffers are exported");
+            view->obj = nullptr;
+            return -1;
+        }
+
+        // Only C-style contiguous buffers are exported. For 1-d buffers this is also F-contiguous.
+        Py_INCREF(exporter);
+        view->obj = exporter;
+        view->readonly = writable ? 0 : 1;
+        view->buf = writable ? impl->m_storage->mutable_data() : const_cast<T*>(impl->m_storage->data());
         view->ndim = 1;
-        view->len = wrapper->m_impl->m_storage->size();
-        view->shape = &wrapper->m_impl->m_shape;
+        view->len = impl->m_shape * sizeof(T);
+        view->shape = (flags & PyBUF_ND) == PyBUF_ND ? &impl->m_shape : nullptr;
         view->itemsize = sizeof(T);
-        view->strides = &wrapper->m_impl->m_strides;
+        view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? &impl->m_strides : nullptr;
         view->suboffsets = nullptr;
+        view->internal = nullptr;
 
         if (flags & PyBUF_FORMAT)
-            view->format = wrapper->m_impl->m_format.data();
+            view->format = const_cast<char*>(get_py_struct_code<T>());
         else
             view->format = nullptr;
 
+        ++impl->m_exports;
+        _pin_storage(impl->m_storage);
+        PYBUFFER_STAT(T, stat_buffer_exports, 1);
+        PYBUFFER_STAT_EXPORT(T, impl->m_storage->id(), true);
+        return 0;
+    }
+
+
+    template <typename T>
+    void PyBufferStorageWrapperImpl<T>::bf_releasebuffer(PyObject* exporter, Py_buffer* view)
+    {
+        // PyBuffer_Release drops the reference on view->obj
+        using namespace pybuffer_container;
+        auto impl = reinterpret_cast<PyBufferStorageWrapper<T>*>(exporter)->m_impl;
+        impl->m_exports -= 1;
+        // Python may have written through the buffer at any point since it was exported
+        if (!view->readonly)
+            impl->m_storage->mark_modified();
+        _unpin_storage(impl->m_storage);
+        PYBUFFER_STAT(T, stat_buffer_releases, 1);
+        PYBUFFER_STAT_EXPORT(T, impl->m_storage->id(), false);
+    }
+
+
+    template <typename T>
+    PyObject * PyBufferStorageWrapperImpl<T>::exports(PyObject * object, PyObject * unused)
+    {
+        using namespace pybuffer_container;
+        return PyLong_FromSsize_t(reinterpret_cast<PyBufferStorageWrapper<T>*>(object)->m_impl->m_exports);
+    }
+
+
+    template <typename T>
+    PyObject * PyBufferStorageWrapperImpl<T>::field(PyObject * object, PyObject * key)
+    {
+        using namespace pybuffer_container;
+        auto impl = reinterpret_cast<PyBufferStorageWrapper<T>*>(object)->m_impl;
+        const py_struct_field * selected = _lookup_struct_field<T>(key);
+        if (!selected)
+            return nullptr;
+
+        const char * base = reinterpret_cast<const char*>(impl->m_storage->data());
+        return _track_region_pins(PyBufferRegionWrapper::create_py_region_wrapper(
+            impl->m_storage, base + selected->offset, impl->m_shape, sizeof(T), selected->size, selected->format),
+            impl->m_storage);
+    }
+
+
+    inline PyObject * PyBufferRegionWrapperImpl::tp_str(PyObject * object)
+    {
+        return PyUnicode_FromString("PyBufferRegion instance");
+    }
+
+
+    inline int PyBufferRegionWrapperImpl::bf_getbuffer(PyObject * exporter, Py_buffer * view, int flags)
+    {
+        using namespace pybuffer_container;
+        auto impl = reinterpret_cast<PyBufferRegionWrapper*>(exporter)->m_impl;
+        const bool contiguous = impl->m_strides == impl->m_itemsize;
+
+        if (flags & PyBUF_WRITABLE)
+        {
+            PyErr_SetString(PyExc_BufferError, "PyBufferRegionWrapper only exports read only buffers");
+            view->obj = nullptr;
+            return -1;
+        }
+
+        // Consumers which do not accept strides assume a contiguous buffer
+        if (!contiguous && ((flags & PyBUF_STRIDES) != PyBUF_STRIDES ||
+                            (flags & PyBUF_ANY_CONTIGUOUS) == PyBUF_ANY_CONTIGUOUS ||
+                            (flags & PyBUF_C_CONTIGUOUS) == PyBUF_C_CONTIGUOUS ||
+                            (flags & PyBUF_F_CONTIGUOUS) == PyBUF_F_CONTIGUOUS))
+        {
+            PyErr_SetString(PyExc_BufferError, "PyBufferRegionWrapper region is strided and requires PyBUF_STRIDES");
+            view->obj = nullptr;
+            return -1;
+        }
+
+        Py_INCREF(exporter);
+        view->obj = exporter;
+        view->readonly = 1;
+        view->buf = impl->m_buf;
+        view->len = impl->m_shape * impl->m_itemsize;
+        view->itemsize = impl->m_itemsize;
+        view->ndim = 1;
+        view->shape = (flags & PyBUF_ND) == PyBUF_ND ? &impl->m_shape : nullptr;
+        view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? &impl->m_strides : nullptr;
+        view->suboffsets = nullptr;
+        view->internal = nullptr;
+        view->format = (flags & PyBUF_FORMAT) ? const_cast<char*>(impl->m_format) : nullptr;
+        if (impl->m_pin_tracker)
+            impl->m_pin_tracker->pin(impl->m_pin_key, impl->m_pin_id, impl->m_pin_bytes);
         return 0;
     }
 
 
+    inline void PyBufferRegionWrapperImpl::bf_releasebuffer(PyObject * exporter, Py_buffer * view)
+    {
+        // PyBuffer_Release drops the reference on view->obj
+        using namespace pybuffer_container;
+        auto impl = reinterpret_cast<PyBufferRegionWrapper*>(exporter)->m_impl;
+        if (impl->m_pin_tracker)
+            impl->m_pin_tracker->unpin(impl->m_pin_key);
+    }
+
+
+    template <typename T>
+    PyObject * PyColumnarStorageWrapperImpl<T>::tp_str(PyObject * object)
+    {
+        return PyUnicode_FromString("PyColumnarStorage instance");
+    }
+
+
+    template <typename T>
+    Py_ssize_t PyColumnarStorageWrapperImpl<T>::sq_length(PyObject * object)
+    {
+        return pybuffer_container::columnar_storage<T>::field_count;
+    }
+
+
+    template <typename T>
+    PyObject * PyColumnarStorageWrapperImpl<T>::sq_item(PyObject * object, Py_ssize_t index)
+    {
+        using namespace pybuffer_container;
+        typedef columnar_storage<T> storage_t;
+        auto impl = reinterpret_cast<PyColumnarStorageWrapper<T>*>(object)->m_impl;
+        if (index < 0 || index >= static_cast<Py_ssize_t>(storage_t::field_count))
+        {
+            PyErr_SetString(PyExc_IndexError, "Index out of bounds to PyColumnarStorageWrapper object");
+            return nullptr;
+        }
+
+        const Py_ssize_t itemsize = storage_t::column_itemsize(index);
+        return reinterpret_cast<PyObject*>(PyBufferRegionWrapper::create_py_region_wrapper(
+            impl->m_storage, impl->m_storage->column_data(index), impl->m_storage->size(),
+            itemsize, itemsize, storage_t::column_format(index)));
+    }
+
+
+    // Maps the exception being handled to a python exception type and message. Must be called from a catch
+    // block but does not need the GIL.
+    inline PyObject * _current_exception_error(std::string& message)
+    {
+        try
+        {
+            throw;
+        }
+        catch (std::bad_alloc&)
+        {
+            message = "out of memory";
+            return PyExc_MemoryError;
+        }
+        catch (std::exception& e)
+        {
+            message = e.what();
+            return PyExc_RuntimeError;
+        }
+        catch (...)
+        {
+            message = "unknown C++ exception";
+            return PyExc_RuntimeError;
+        }
+    }
+
+
+    template <typename T>
+    PyObject * PyBufferIngestWrapperImpl<T>::tp_str(PyObject * object)
+    {
+        return PyUnicode_FromString("PyBufferIngest instance");
+    }
+
+
+    template <typename T>
+    Py_ssize_t PyBufferIngestWrapperImpl<T>::row_count(const Py_buffer& buffer, bool raw)
+    {
+        const char * format = buffer.format ? buffer.format : "B";
+        if (raw)
+        {
+            // The caller asserts the bytes are packed T records, so only the length is checked
+            if (buffer.len % sizeof(T))
+            {
+                PyErr_Format(PyExc_ValueError, "buffer length %zd is not a multiple of the record size %zu",
+                             buffer.len, sizeof(T));
+                return -1;
+            }
+            return buffer.len / sizeof(T);
+        }
+
+        if (!py_format_matches<T>(format, buffer.itemsize))
+        {
+            PyErr_Format(PyExc_TypeError, "buffer format %s with itemsize %zd does not match %s with itemsize %zu, "
+                         "use append_raw for raw bytes", format, buffer.itemsize, get_py_struct_code<T>(), sizeof(T));
+            return -1;
+        }
+        return buffer.len / sizeof(T);
+    }
+
+
+    template <typename T>
+    PyObject * PyBufferIngestWrapperImpl<T>::append(PyObject * object, PyObject * source)
+    {
+        return ingest(object, source, false);
+    }
+
+
     template <typename T>
-    void PyBufferStorageWrapperImpl<T>::bf_releasebuffer(Py_buffer* view)
+    PyObject * PyBufferIngestWrapperImpl<T>::append_raw(PyObject * object, PyObject * source)
+    {
+        return ingest(object, source, true);
+    }
+
+
+    template <typename T>
+    PyObject * PyBufferIngestWrapperImpl<T>::ingest(PyObject * object, PyObject * source, bool raw)
+    {
+        using namespace pybuffer_container;
+        auto impl = reinterpret_cast<PyBufferIngestWrapper<T>*>(object)->m_impl;
+        Py_buffer buffer;
+        if (PyObject_GetBuffer(source, &buffer, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0)
+            return nullptr;
+
+        const Py_ssize_t rows = row_count(buffer, raw);
+        if (rows < 0)
+        {
+            PyBuffer_Release(&buffer);
+            return nullptr;
+        }
+
+        std::vector<segment_t> segments;
+        PyObject * error_type = nullptr;
+        std::string error_message;
+
+        // The exported buffer cannot be resized or freed while it is held so the copy runs without the GIL
+        Py_BEGIN_ALLOW_THREADS
+        try
+        {
+            const char * pos = static_cast<const char*>(buffer.buf);
+            segments.reserve((rows + impl->m_segment_rows - 1) / impl->m_segment_rows);
+            std::vector<T> aligned;
+            for (Py_ssize_t start = 0; start < rows; start += impl->m_segment_rows)
+            {
+                const size_t count = std::min<size_t>(impl->m_segment_rows, rows - start);
+                const char * chunk = pos + start * sizeof(T);
+                if (reinterpret_cast<uintptr_t>(chunk) % alignof(T) == 0)
+                {
+                    const T * first = reinterpret_cast<const T*>(chunk);
+                    segments.push_back(impl->m_creator(first, first + count));
+                }
+                else
+                {
+                    // Byte buffers carry no alignment guarantee. Bounce those through an aligned copy.
+                    aligned.resize(count);
+                    std::memcpy(aligned.data(), chunk, count * sizeof(T));
+                    segments.push_back(impl->m_creator(aligned.data(), aligned.data() + count));
+                }
+            }
+        }
+        catch (...)
+        {
+            // Python errors can only be raised once the GIL is back
+            error_type = _current_exception_error(error_message);
+        }
+        Py_END_ALLOW_THREADS
+
+        PyBuffer_Release(&buffer);
+        if (error_type)
+        {
+            PyErr_SetString(error_type, error_message.c_str());
+            return nullptr;
+        }
+
+        try
+        {
+            impl->m_sink(segments);
+        }
+        catch (...)
+        {
+            error_type = _current_exception_error(error_message);
+            PyErr_SetString(error_type, error_message.c_str());
+            return nullptr;
+        }
+        return PyLong_FromSsize_t(rows);
+    }
+
+
+    inline PyObject * py_storage_stats(PyObject * module, PyObject * unused)
     {
-        Py_DECREF(view->obj);
+        using namespace pybuffer_container;
+        PyObject * result = PyDict_New();
+        if (!result)
+            return nullptr;
+
+        for (auto& stats: read_storage_stats())
+        {
+            PyObject * counters = PyDict_New();
+            if (!counters || PyDict_SetItemString(result, stats.m_type.c_str(), counters) != 0)
+            {
+                Py_XDECREF(counters);
+                Py_DECREF(result);
+                return nullptr;
+            }
+            Py_DECREF(counters);
+
+            for (size_t stat = 0; stat <= storage_stat_count; ++stat)
+            {
+                const bool outstanding = stat == storage_stat_count;
+                PyObject * value = PyLong_FromUnsignedLongLong(outstanding ? stats.outstanding_exports() :
+                                                               stats.m_counters[stat]);
+                const char * name = outstanding ? "outstanding_exports" :
+                                    storage_stat_name(static_cast<storage_stat>(stat));
+                if (!value || PyDict_SetItemString(counters, name, value) != 0)
+                {
+                    Py_XDECREF(value);
+                    Py_DECREF(result);
+                    return nullptr;
+                }
+                Py_DECREF(value);
+            }
+
+            PyObject * by_storage = PyDict_New();
+            if (!by_storage || PyDict_SetItemString(counters, "outstanding_exports_by_storage", by_storage) != 0)
+            {
+                Py_XDECREF(by_storage);
+                Py_DECREF(result);
+                return nullptr;
+            }
+            Py_DECREF(by_storage);
+            for (auto& entry: stats.m_exports_by_storage)
+            {
+                PyObject * id = PyLong_FromSize_t(entry.first);
+                PyObject * count = PyLong_FromUnsignedLongLong(entry.second);
+                const bool failed = !id || !count || PyDict_SetItem(by_storage, id, count) != 0;
+                Py_XDECREF(id);
+                Py_XDECREF(count);
+                if (failed)
+                {
+                    Py_DECREF(result);
+                    return nullptr;
+                }
+            }
+        }
+        return result;
     }
 }
 
@@ -136,21 +972,92 @@ namespace pybuffer_container
 {
     using namespace pybuffer_container_detail;
     template <typename T>
-    PyBufferViewWrapper * PyBufferViewWrapper<T>::create_py_view_wrapper(const pybuffer_container::container_view<T>& view)
+    PyBufferViewWrapper<T> * PyBufferViewWrapper<T>::create_py_view_wrapper(const pybuffer_container::container_view<T>& view)
+    {
+        return _py_wrapper_allocator<PyBufferViewWrapper<T>, PyBufferViewWrapperImpl<T>>::create(
+            pybuffer_view_type<T>(), view);
+    }
+
+
+    template <typename T>
+    PyBufferViewIterator<T> * PyBufferViewIterator<T>::create_py_view_iterator(PyObject * view)
+    {
+        return _py_wrapper_allocator<PyBufferViewIterator<T>, PyBufferViewIteratorImpl<T>>::create(
+            pybuffer_view_iterator_type<T>(), view);
+    }
+
+
+    template <typename T>
+    PyBufferStorageWrapper<T> * PyBufferStorageWrapper<T>::create_py_storage_wrapper(
+        const PyBufferViewWrapper<T> * view_wrapper, Py_ssize_t index, bool writable)
     {
-        PyBufferViewWrapper * view_wrapper = new PyBufferViewWrapper();
-        view_wrapper->m_impl = new PyBufferViewWrapperImpl<T>(view);
-        PyObject_Init(static_cast<PyObject*>(view_wrapper), pybuffer_view_type<T>());
-        return view_wrapper;
+        return create_py_storage_wrapper(view_wrapper->m_impl->m_storage_elements[index], writable);
     }
 
 
     template <typename T>
-    PyBufferStorageWrapper * create_py_storage_wrapper(const PyBufferViewWrapper * view_wrapper, Py_ssize_t index)
+    PyBufferStorageWrapper<T> * PyBufferStorageWrapper<T>::create_py_storage_wrapper(
+        const typename impl_t::shared_storage_t& storage, bool writable)
+    {
+        return _py_wrapper_allocator<PyBufferStorageWrapper<T>, PyBufferStorageWrapperImpl<T>>::create(
+            pybuffer_storage_type<T>(), storage, writable);
+    }
+
+
+    inline PyBufferRegionWrapper * PyBufferRegionWrapper::create_py_region_wrapper(const std::shared_ptr<const void>& owner,
+                                                                                  const void * buf, Py_ssize_t shape,
+                                                                                  Py_ssize_t strides, Py_ssize_t itemsize,
+                                                                                  const char * format)
     {
-        PyBufferStorageWrapper * wrapper = new PyBufferStorageWrapper();
-        wrapper->m_impl = new PyBufferStorageWrapperImpl(view_wrapper->m_impl->m_storage_elements[index]);
-        PyObject_Init(wrapper, pybuffer_storage_type<T>());
-        return wrapper;
+        return _py_wrapper_allocator<PyBufferRegionWrapper, PyBufferRegionWrapperImpl>::create(
+            pybuffer_region_type(), owner, buf, shape, strides, itemsize, format);
     }
-}
\ No newline at end of file
+
+
+    template <typename Segment>
+    PyBufferRegionWrapper * PyBufferRegionWrapper::create_py_segment_region(const std::shared_ptr<const Segment>& segment)
+    {
+        typedef typename Segment::value_type T;
+        return create_py_region_wrapper(segment, segment->data(), segment->size(), sizeof(T), sizeof(T),
+                                        pybuffer_container_detail::get_py_struct_code<T>());
+    }
+
+
+    template <typename Storage>
+    PyBufferRegionWrapper * PyBufferRegionWrapper::create_py_mapped_region(const std::shared_ptr<Storage>& storage)
+    {
+        typedef typename Storage::value_type T;
+        return create_py_region_wrapper(Storage::export_guard(storage), storage->data(), storage->size(), sizeof(T),
+                                        sizeof(T), pybuffer_container_detail::get_py_struct_code<T>());
+    }
+
+
+    template <typename T>
+    PyColumnarStorageWrapper<T> * PyColumnarStorageWrapper<T>::create_py_columnar_wrapper(
+        const typename columnar_storage<T>::shared_t& storage)
+    {
+        return _py_wrapper_allocator<PyColumnarStorageWrapper<T>, PyColumnarStorageWrapperImpl<T>>::create(
+            pybuffer_columnar_type<T>(), storage);
+    }
+
+
+    template <typename T>
+    PyBufferIngestWrapper<T> * PyBufferIngestWrapper<T>::create_py_ingest_wrapper(const creator_t& creator,
+                                                                                 const sink_t& sink,
+                                                                                 size_t segment_rows)
+    {
+        return _py_wrapper_allocator<PyBufferIngestWrapper<T>, PyBufferIngestWrapperImpl<T>>::create(
+            pybuffer_ingest_type<T>(), creator, sink, segment_rows);
+    }
+
+
+    inline int add_storage_stats_function(PyObject * module)
+    {
+        static PyMethodDef methods[] = {
+            {"storage_stats", &pybuffer_container_detail::py_storage_stats, METH_NOARGS,
+             "Return {element type: {counter: value}} for storage copies, element shifts, locates and buffer exports"},
+            {nullptr, nullptr, 0, nullptr}
+        };
+        return PyModule_AddFunctions(module, methods);
+    }
+}
@@ -0,0 +1,661 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2020 Kuberan Naganathan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include "pybuffer_storage.h"
+#include "pybuffer_struct_code.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+namespace pybuffer_container
+{
+    // Owns a file descriptor and a shared mapping of the whole file. Errors are reported with std::system_error.
+    class mapped_file
+    {
+    public:
+        // Takes ownership of fd. bytes must be the current size of the file.
+        mapped_file(int fd, size_t bytes, bool writable):
+        m_fd(fd),
+        m_data(nullptr),
+        m_size(bytes),
+        m_writable(writable)
+        {
+            if (m_size)
+            {
+                try
+                {
+                    map();
+                }
+                catch (...)
+                {
+                    // The destructor does not run for a throwing constructor
+                    ::close(m_fd);
+                    throw;
+                }
+            }
+        }
+
+        ~mapped_file()
+        {
+            if (m_data)
+                ::munmap(m_data, m_size);
+            ::close(m_fd);
+        }
+
+        mapped_file(const mapped_file&) = delete;
+        mapped_file& operator = (const mapped_file&) = delete;
+
+        static std::unique_ptr<mapped_file> open(const std::string& path, bool create, bool writable)
+        {
+            int flags = writable ? O_RDWR : O_RDONLY;
+            if (create)
+                flags |= O_CREAT | O_EXCL;
+
+            int fd = ::open(path.c_str(), flags | O_CLOEXEC, 0644);
+            if (fd < 0)
+                throw std::system_error(errno, std::generic_category(), "open " + path);
+
+            struct stat file_stat;
+            if (::fstat(fd, &file_stat) != 0)
+            {
+                int error = errno;
+                ::close(fd);
+                throw std::system_error(error, std::generic_category(), "fstat " + path);
+            }
+            return std::unique_ptr<mapped_file>(new mapped_file(fd, file_stat.st_size, writable));
+        }
+
+        // Grows or shrinks the file and its mapping. The mapping may move.
+        void resize(size_t bytes)
+        {
+            if (::ftruncate(m_fd, bytes) != 0)
+                throw std::system_error(errno, std::generic_category(), "ftruncate");
+
+            if (!m_data)
+            {
+                m_size = bytes;
+                map();
+                return;
+            }
+
+            void * data = ::mremap(m_data, m_size, bytes, MREMAP_MAYMOVE);
+            if (data == MAP_FAILED)
+                throw std::system_error(errno, std::generic_category(), "mremap");
+            m_data = data;
+            m_size = bytes;
+        }
+
+        void advise(int advice)
+        {
+            if (m_data)
+                ::madvise(m_data, m_size, advice);
+        }
+
+        void * data()
+        {return m_data;}
+
+        const void * data() const
+        {return m_data;}
+
+        size_t size() const
+        {return m_size;}
+
+        int fd() const
+        {return m_fd;}
+
+        bool writable() const
+        {return m_writable;}
+
+    private:
+        void map()
+        {
+            const int protection = m_writable ? PROT_READ | PROT_WRITE : PROT_READ;
+            void * data = ::mmap(nullptr, m_size, protection, MAP_SHARED, m_fd, 0);
+            if (data == MAP_FAILED)
+                throw std::system_error(errno, std::generic_category(), "mmap");
+            m_data = data;
+        }
+
+        int m_fd;
+        void * m_data;
+        size_t m_size;
+        bool m_writable;
+    };
+
+
+    // 64-bit FNV-1a hash of the struct code. Stored in file headers to reject files written for another type.
+    template <typename T>
+    std::uint64_t layout_signature()
+    {
+        std::uint64_t hash = 14695981039346656037ull;
+        for (const char * code = pybuffer_container_detail::get_py_struct_code<T>(); *code; ++code)
+        {
+            hash ^= static_cast<unsigned char>(*code);
+            hash *= 1099511628211ull;
+        }
+        hash ^= sizeof(T);
+        return hash;
+    }
+
+
+    struct _mmap_storage_header
+    {
+        static constexpr std::uint64_t magic_value = 0x31534d4d55425950ull; // "PYBUMMS1"
+        static constexpr size_t size = 64; // element data starts here so T may be aligned up to 64 bytes
+
+        std::uint64_t magic;
+        std::uint64_t signature; // layout_signature<T>()
+        std::uint64_t element_size;
+        std::uint64_t element_count;
+        std::uint64_t persistent_id; // survives restarts, unlike storage ids
+        std::uint64_t sequence; // 1 based position in container order set by record_order, 0 if never recorded
+        std::uint64_t epoch; // identifies the writer instance, see mmap_storage_creator::set_epoch
+    };
+
+
+    // vector_storage equivalent whose elements live in a memory mapped file. data() points straight into
+    // the page cache, so buffers exported from it need no copy and cold segments can be paged out by the
+    // kernel instead of being swapped. Each storage owns one file named after its persistent id. The file
+    // is removed when the storage is destroyed unless the creator has been told to retain files, which is
+    // how the contents survive a restart (see mmap_storage_creator::retain_files and reopen).
+    //
+    // Growing past the mapped capacity may move the mapping with mremap, so a storage refuses to grow while
+    // export guards (see export_guard) are outstanding and throws std::runtime_error instead.
+    template <typename T>
+    class mmap_storage: public snapshot_container::storage_base<T, 48, virtual_iter::rand_iter<T, 48>>
+    {
+    public:
+        static_assert(std::is_trivially_copyable<T>::value, "mmap_storage requires trivially copyable T");
+        static_assert(alignof(T) <= _mmap_storage_header::size, "T is aligned beyond the mmap_storage header");
+
+        static const size_t npos = 0xFFFFFFFFFFFFFFFF;
+        typedef typename snapshot_container::storage_base<T, 48, virtual_iter::rand_iter<T,48>> storage_base_t;
+        using storage_base_t::iter_mem_size;
+        typedef T value_type;
+        typedef std::shared_ptr<mmap_storage<T>> shared_t;
+        typedef std::shared_ptr<storage_base_t> shared_base_t;
+        using fwd_iter_type = typename storage_base_t::fwd_iter_type;
+        using rand_iter_type = typename storage_base_t::rand_iter_type;
+        typedef virtual_iter::rand_iter<T,48> storage_iter_type;
+
+        // State shared by a creator and every storage it makes
+        struct directory_t
+        {
+            std::string m_path;
+            std::atomic<std::uint64_t> m_next_persistent_id{1};
+            std::atomic<bool> m_retain_files{false};
+            std::atomic<std::uint64_t> m_epoch{0}; // written to the header of every new storage
+
+            std::string file_path(std::uint64_t persistent_id) const
+            {
+                return m_path + "/" + std::to_string(persistent_id) + ".pbseg";
+            }
+        };
+
+        void append(const T& value) override
+        {
+            // value may refer to an element of this storage which reserve could unmap
+            T copy_of_value = value;
+            reserve(size() + 1);
+            data()[size()] = copy_of_value;
+            set_size(size() + 1);
+        }
+
+        void append(const fwd_iter_type& start_pos, const fwd_iter_type& end_pos) override
+        {
+            fwd_iter_type start_pos_copy(start_pos);
+
+            std::function<bool(const value_type& v)> f =
+                    [this](const value_type& v)
+                    {
+                        append(v);
+                        return true;
+                    };
+
+            start_pos_copy.visit (end_pos, f);
+        }
+
+        void append(const rand_iter_type& start_pos, const rand_iter_type& end_pos) override
+        {
+            insert(size(), start_pos, end_pos);
+        }
+
+        shared_base_t copy(size_t start_index = 0, size_t end_index = npos) const override
+        {
+            if (end_index == npos)
+                end_index = size();
+            return create(m_directory, data() + start_index, data() + end_index);
+        }
+
+        void insert(size_t index, const T& value) override
+        {
+            // value may refer to an element of this storage which reserve could unmap
+            T copy_of_value = value;
+            open_gap(index, 1);
+            data()[index] = copy_of_value;
+        }
+
+        void insert(size_t index, const fwd_iter_type& start_pos, const fwd_iter_type& end_pos) override
+        {
+            // Gather first since the size of a forward range is not known up front
+            std::vector<T> values(start_pos, end_pos);
+            insert_span(index, values.data(), values.size());
+        }
+
+        void insert(size_t index, const rand_iter_type& start_pos, const rand_iter_type& end_pos) override
+        {
+            const size_t count = end_pos - start_pos;
+            open_gap(index, count);
+            std::copy(start_pos, end_pos, data() + index);
+        }
+
+        void remove(size_t index) override
+        {
+            remove(index, index + 1);
+        }
+
+        void remove(size_t start_index, size_t end_index) override
+        {
+            std::memmove(data() + start_index, data() + end_index, (size() - end_index) * sizeof(T));
+            set_size(size() - (end_index - start_index));
+        }
+
+        size_t size() const override
+        {return header()->element_count;}
+
+        const T& operator[](size_t index) const override
+        {return data()[index];}
+
+        T& operator[](size_t index) override
+        {return data()[index];}
+
+        const storage_iter_type begin() const override
+        {
+            return storage_iter_type(_iter_impl, static_cast<const T*>(data()));
+        }
+
+        const storage_iter_type end() const override
+        {
+            return storage_iter_type(_iter_impl, static_cast<const T*>(data()) + size());
+        }
+
+        const storage_iter_type iterator(size_t offset) const override
+        {
+            if (offset > size())
+                offset = size();
+            return storage_iter_type(_iter_impl, static_cast<const T*>(data()) + offset);
+        }
+
+        storage_iter_type begin() override
+        {
+            return storage_iter_type(_iter_impl, static_cast<const T*>(data()));
+        }
+
+        storage_iter_type end() override
+        {
+            return storage_iter_type(_iter_impl, static_cast<const T*>(data()) + size());
+        }
+
+        storage_iter_type iterator(size_t offset) override
+        {
+            if (offset > size())
+                offset = size();
+            return storage_iter_type(_iter_impl, static_cast<const T*>(data()) + offset);
+        }
+
+        size_t id() const override
+        {
+            return m_storage_id;
+        }
+
+        std::uint64_t persistent_id() const
+        {
+            return header()->persistent_id;
+        }
+
+        // Pointer into the mapping. Only valid until the next operation that grows the storage.
+        const T* data() const
+        {
+            return reinterpret_cast<const T*>(static_cast<const char*>(m_file->data()) + _mmap_storage_header::size);
+        }
+
+        T* data()
+        {
+            return reinterpret_cast<T*>(static_cast<char*>(m_file->data()) + _mmap_storage_header::size);
+        }
+
+        // Bulk append from a contiguous source
+        void append(const T * start_pos, const T * end_pos)
+        {
+            insert_span(size(), start_pos, end_pos - start_pos);
+        }
+
+        void reserve(size_t capacity)
+        {
+            if (capacity <= m_capacity)
+                return;
+            if (m_exports.load())
+                throw std::runtime_error("mmap_storage cannot grow while its mapping is exported");
+            size_t new_capacity = std::max(capacity, std::max<size_t>(m_capacity * 2, min_capacity));
+            m_file->resize(_mmap_storage_header::size + new_capacity * sizeof(T));
+            m_capacity = new_capacity;
+        }
+
+        // Keeps storage alive and its mapping in place until the returned pointer and every copy of it are
+        // released. Hand this to anything that holds data() beyond the current call, such as a python buffer.
+        static std::shared_ptr<const void> export_guard(const shared_t& storage)
+        {
+            storage->m_exports.fetch_add(1);
+            return std::shared_ptr<const void>(storage->data(), [storage](const void *)
+                                               {storage->m_exports.fetch_sub(1);});
+        }
+
+        size_t exports() const
+        {
+            return m_exports.load();
+        }
+
+        std::uint64_t epoch() const
+        {
+            return header()->epoch;
+        }
+
+        std::uint64_t sequence() const
+        {
+            return header()->sequence;
+        }
+
+        void set_sequence(std::uint64_t sequence)
+        {
+            static_cast<_mmap_storage_header*>(m_file->data())->sequence = sequence;
+        }
+
+        // Write dirty pages back to the file
+        void flush()
+        {
+            if (::msync(m_file->data(), m_file->size(), MS_SYNC) != 0)
+                throw std::system_error(errno, std::generic_category(), "msync");
+        }
+
+        static shared_t create(const std::shared_ptr<directory_t>& directory)
+        {
+            const std::uint64_t persistent_id = directory->m_next_persistent_id.fetch_add(1);
+            auto file = mapped_file::open(directory->file_path(persistent_id), true, true);
+            file->resize(_mmap_storage_header::size + min_capacity * sizeof(T));
+            auto storage_header = static_cast<_mmap_storage_header*>(file->data());
+            storage_header->magic = _mmap_storage_header::magic_value;
+            storage_header->signature = layout_signature<T>();
+            storage_header->element_size = sizeof(T);
+            storage_header->element_count = 0;
+            storage_header->persistent_id = persistent_id;
+            storage_header->sequence = 0;
+            storage_header->epoch = directory->m_epoch.load();
+            return std::make_shared<mmap_storage<T>>(directory, std::move(file));
+        }
+
+        static shared_t create(const std::shared_ptr<directory_t>& directory, const T * start_pos, const T * end_pos)
+        {
+            auto storage = create(directory);
+            storage->append(start_pos, end_pos);
+            return storage;
+        }
+
+        // Maps an existing segment file. Returns an empty pointer if the file was written for a different type.
+        static shared_t open(const std::shared_ptr<directory_t>& directory, const std::string& path)
+        {
+            auto file = mapped_file::open(path, false, true);
+            if (file->size() < _mmap_storage_header::size)
+                return shared_t();
+
+            auto storage_header = static_cast<const _mmap_storage_header*>(file->data());
+            if (storage_header->magic != _mmap_storage_header::magic_value ||
+                storage_header->signature != layout_signature<T>() ||
+                storage_header->element_size != sizeof(T) ||
+                _mmap_storage_header::size + storage_header->element_count * sizeof(T) > file->size())
+                return shared_t();
+
+            return std::make_shared<mmap_storage<T>>(directory, std::move(file));
+        }
+
+        mmap_storage(const std::shared_ptr<directory_t>& directory, std::unique_ptr<mapped_file> file):
+        m_directory(directory),
+        m_file(std::move(file)),
+        m_capacity((m_file->size() - _mmap_storage_header::size) / sizeof(T)),
+        m_storage_id(storage_base_t::generate_storage_id())
+        {}
+
+        ~mmap_storage()
+        {
+            if (!m_directory->m_retain_files.load())
+                ::unlink(m_directory->file_path(persistent_id()).c_str());
+        }
+
+        // All construction is through the storage creator mechanism
+        mmap_storage(const mmap_storage<T>& rhs) = delete;
+        mmap_storage(mmap_storage<T>&& rhs) = delete;
+
+    private:
+        static constexpr size_t min_capacity = 1024;
+
+        const _mmap_storage_header * header() const
+        {
+            return static_cast<const _mmap_storage_header*>(m_file->data());
+        }
+
+        void set_size(size_t new_size)
+        {
+            static_cast<_mmap_storage_header*>(m_file->data())->element_count = new_size;
+        }
+
+        // Makes room for count elements at index, leaving them uninitialized
+        void open_gap(size_t index, size_t count)
+        {
+            const size_t old_size = size();
+            reserve(old_size + count);
+            std::memmove(data() + index + count, data() + index, (old_size - index) * sizeof(T));
+            set_size(old_size + count);
+        }
+
+        void insert_span(size_t index, const T * values, size_t count)
+        {
+            if (!count)
+                return;
+            open_gap(index, count);
+            std::memcpy(data() + index, values, count * sizeof(T));
+        }
+
+        static virtual_iter::std_rand_iter_impl<const T*, iter_mem_size> _iter_impl;
+        std::shared_ptr<directory_t> m_directory;
+        std::unique_ptr<mapped_file> m_file;
+        size_t m_capacity;
+        size_t m_storage_id;
+        std::atomic<size_t> m_exports{0}; // outstanding export_guard pointers
+    };
+
+
+    template <typename T>
+    virtual_iter::std_rand_iter_impl<const T*, mmap_storage<T>::iter_mem_size> mmap_storage<T>::_iter_impl;
+
+
+    // Creates file backed storages in a directory and reopens them after a restart
+    template <typename T>
+    struct mmap_storage_creator
+    {
+        typedef mmap_storage<T> storage_t;
+        typedef typename storage_t::shared_base_t shared_base_t;
+        typedef typename storage_t::shared_t shared_t;
+        typedef typename storage_t::directory_t directory_t;
+        typedef _storage_registry<storage_t> control_t;
+
+        explicit mmap_storage_creator(const std::string& directory):
+        m_directory(std::make_shared<directory_t>()),
+        m_control(std::make_shared<control_t>())
+        {
+            m_directory->m_path = directory;
+            if (::mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST)
+                throw std::system_error(errno, std::generic_category(), "mkdir " + directory);
+        }
+
+        mmap_storage_creator(const mmap_storage_creator& other) = default;
+        mmap_storage_creator& operator = (const mmap_storage_creator& other) = default;
+
+        shared_base_t operator() ()
+        {
+            auto storage = storage_t::create(m_directory);
+            m_control->insert(storage);
+            return storage;
+        }
+
+        template <typename IterType>
+        shared_base_t operator() (IterType start_pos, IterType end_pos)
+        {
+            auto storage = storage_t::create(m_directory);
+            for (; start_pos != end_pos; ++start_pos)
+                storage->append(*start_pos);
+            m_control->insert(storage);
+            return storage;
+        }
+
+        shared_base_t operator() (const T * start_pos, const T * end_pos)
+        {
+            auto storage = storage_t::create(m_directory, start_pos, end_pos);
+            m_control->insert(storage);
+            return storage;
+        }
+
+        // Obtain a shared ptr to the storage identified by id. Returns an empty shared_ptr if not found
+        // or if the ptr has expired.
+        shared_t locate(size_t id)
+        {
+            return m_control->locate(id);
+        }
+
+        // Stamps each mmap_storage in segments with its position so reopen returns them in this order. Call
+        // with the container's segments, in container order, before retaining files at shutdown. Segments
+        // made by other creators are ignored.
+        template <typename SegmentRange>
+        void record_order(const SegmentRange& segments)
+        {
+            std::uint64_t sequence = 0;
+            for (auto& segment: segments)
+            {
+                if (auto storage = dynamic_cast<storage_t*>(&*segment))
+                    storage->set_sequence(++sequence);
+            }
+        }
+
+        // Maps every segment file left in the directory by a previous run and registers them with this
+        // creator. Storages are returned in the order last passed to record_order, followed by any never
+        // recorded in persistent id order. Files written for another element type are skipped. New storages
+        // are given persistent ids above the id in every segment file name found, accepted or not, so
+        // they never collide with a file left behind.
+        std::vector<shared_t> reopen()
+        {
+            std::vector<shared_t> result;
+            std::uint64_t next_id = 1;
+            DIR * directory = ::opendir(m_directory->m_path.c_str());
+            if (!directory)
+                throw std::system_error(errno, std::generic_category(), "opendir " + m_directory->m_path);
+
+            try
+            {
+                while (auto entry = ::readdir(directory))
+                {
+                    std::string name(entry->d_name);
+                    const std::string suffix(".pbseg");
+                    if (name.size() <= suffix.size() || name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0)
+                        continue;
+
+                    const std::uint64_t file_id = std::strtoull(name.c_str(), nullptr, 10);
+                    next_id = std::max(next_id, file_id + 1);
+
+                    auto storage = storage_t::open(m_directory, m_directory->m_path + "/" + name);
+                    if (storage)
+                        result.push_back(storage);
+                }
+            }
+            catch (...)
+            {
+                ::closedir(directory);
+                throw;
+            }
+            ::closedir(directory);
+
+            std::sort(result.begin(), result.end(), [](const shared_t& lhs, const shared_t& rhs)
+                      {
+                          // Unrecorded storages (sequence 0) sort after recorded ones
+                          const std::uint64_t lhs_sequence = lhs->sequence() - 1;
+                          const std::uint64_t rhs_sequence = rhs->sequence() - 1;
+                          if (lhs_sequence != rhs_sequence)
+                              return lhs_sequence < rhs_sequence;
+                          return lhs->persistent_id() < rhs->persistent_id();
+                      });
+
+            for (auto& storage: result)
+                m_control->insert(storage);
+
+            std::uint64_t current = m_directory->m_next_persistent_id.load();
+            while (current < next_id && !m_directory->m_next_persistent_id.compare_exchange_weak(current, next_id))
+            {}
+            return result;
+        }
+
+        // Stamped into the header of every storage created from now on, so readers can tell files written by
+        // this creator from files a later or earlier writer left under the same name
+        void set_epoch(std::uint64_t epoch)
+        {
+            m_directory->m_epoch.store(epoch);
+        }
+
+        // When set, segment files outlive their storages so they can be reopened by the next run.
+        // Typically set just before shutdown so storages dropped during normal operation are cleaned up.
+        void retain_files(bool retain = true)
+        {
+            m_directory->m_retain_files.store(retain);
+        }
+
+        void sweep()
+        {
+            m_control->sweep();
+        }
+
+        private:
+            std::shared_ptr<directory_t> m_directory;
+            std::shared_ptr<control_t> m_control;
+    };
+}
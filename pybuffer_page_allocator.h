@@ -0,0 +1,189 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2020 Kuberan Naganathan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include "pybuffer_storage.h"
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+
+// Page placement for large element buffers. Scans of exported segments touch every page once, so 4K pages
+// cost a TLB miss every few hundred rows and pages placed on the wrong socket are read remotely. page_allocator
+// maps large buffers itself so it can ask for 2MB pages and bind them to a NUMA node before the first touch.
+// Small allocations, which include the shared_ptr control blocks, go through operator new.
+
+
+namespace pybuffer_container
+{
+    struct page_policy
+    {
+        enum hugepage_mode
+        {
+            none,
+            transparent, // madvise(MADV_HUGEPAGE) on a 2MB aligned mapping; the kernel collapses it when it can
+            explicit_pages // MAP_HUGETLB from the reserved pool, falling back to transparent when it is exhausted
+        };
+
+        static const size_t hugepage_size = size_t(1) << 21;
+
+        hugepage_mode hugepages = none;
+        int numa_node = -1; // -1 leaves placement to the kernel, usually the node of the first touching thread
+        size_t min_bytes = hugepage_size; // smaller allocations use operator new
+
+        bool operator == (const page_policy& other) const
+        {
+            return hugepages == other.hugepages && numa_node == other.numa_node && min_bytes == other.min_bytes;
+        }
+
+        bool operator != (const page_policy& other) const
+        {
+            return !(*this == other);
+        }
+
+        // Bytes actually mapped for a request of bytes. Deterministic so deallocate can recompute it.
+        size_t mapped_size(size_t bytes) const
+        {
+            const size_t granule = hugepages == none ? static_cast<size_t>(::sysconf(_SC_PAGESIZE)) : hugepage_size;
+            return (bytes + granule - 1) / granule * granule;
+        }
+    };
+
+
+    namespace _page_allocator_detail
+    {
+        inline void * map_aligned(size_t bytes, size_t alignment)
+        {
+            // Over map by one alignment unit then unmap the slop on either side
+            void * raw = ::mmap(nullptr, bytes + alignment, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (raw == MAP_FAILED)
+                throw std::bad_alloc();
+
+            const uintptr_t start = reinterpret_cast<uintptr_t>(raw);
+            const uintptr_t aligned = (start + alignment - 1) / alignment * alignment;
+            if (aligned > start)
+                ::munmap(raw, aligned - start);
+            if (start + alignment > aligned)
+                ::munmap(reinterpret_cast<void*>(aligned + bytes), start + alignment - aligned);
+            return reinterpret_cast<void*>(aligned);
+        }
+
+
+        inline void * map_pages(const page_policy& policy, size_t bytes)
+        {
+            void * data = nullptr;
+            if (policy.hugepages == page_policy::explicit_pages)
+            {
+                data = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                if (data == MAP_FAILED)
+                    data = nullptr;
+            }
+
+            if (!data && policy.hugepages != page_policy::none)
+            {
+                data = map_aligned(bytes, page_policy::hugepage_size);
+                ::madvise(data, bytes, MADV_HUGEPAGE);
+            }
+            else if (!data)
+            {
+                data = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (data == MAP_FAILED)
+                    throw std::bad_alloc();
+            }
+
+            if (policy.numa_node >= 0)
+            {
+                // Best effort: a node that does not exist or a kernel without NUMA leaves default placement.
+                // mbind is called through syscall so libnuma is not needed.
+                const size_t bits_per_word = sizeof(unsigned long) * 8;
+                unsigned long node_mask[16] = {};
+                const size_t node = static_cast<size_t>(policy.numa_node);
+                if (node < sizeof(node_mask) * 8)
+                {
+                    node_mask[node / bits_per_word] = 1UL << (node % bits_per_word);
+                    ::syscall(SYS_mbind, data, bytes, MPOL_BIND, node_mask, sizeof(node_mask) * 8 + 1, 0);
+                }
+            }
+            return data;
+        }
+    }
+
+
+    // std compatible allocator applying a page_policy. Instances compare equal when their policies do, so
+    // vectors only exchange buffers between storages made under the same policy.
+    template <typename T>
+    struct page_allocator
+    {
+        typedef T value_type;
+
+        page_allocator() = default;
+
+        explicit page_allocator(const page_policy& policy):
+        m_policy(policy)
+        {}
+
+        template <typename U>
+        page_allocator(const page_allocator<U>& other):
+        m_policy(other.m_policy)
+        {}
+
+        T * allocate(size_t n)
+        {
+            const size_t bytes = n * sizeof(T);
+            if (bytes < m_policy.min_bytes)
+                return static_cast<T*>(::operator new(bytes));
+            return static_cast<T*>(_page_allocator_detail::map_pages(m_policy, m_policy.mapped_size(bytes)));
+        }
+
+        void deallocate(T * ptr, size_t n)
+        {
+            const size_t bytes = n * sizeof(T);
+            if (bytes < m_policy.min_bytes)
+                ::operator delete(ptr);
+            else
+                ::munmap(ptr, m_policy.mapped_size(bytes));
+        }
+
+        template <typename U>
+        bool operator == (const page_allocator<U>& other) const
+        {return m_policy == other.m_policy;}
+
+        template <typename U>
+        bool operator != (const page_allocator<U>& other) const
+        {return m_policy != other.m_policy;}
+
+        page_policy m_policy;
+    };
+
+
+    template <typename T>
+    using page_vector_storage = vector_storage<T, page_allocator<T>>;
+
+    // Each creator picks its policy, e.g. page_storage_creator<T>(page_allocator<T>(policy))
+    template <typename T>
+    using page_storage_creator = pybuffer_storage_creator<T, page_allocator<T>>;
+}
@@ -0,0 +1,443 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2020 Kuberan Naganathan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+#include <unistd.h>
+
+
+// Parallel execution over the storage segments of a view. Segments are cut into sub-ranges of at most
+// a grain of rows so one very large segment is spread over several threads, and the sub-ranges are run
+// on a work stealing pool. Results are gathered per sub-range and combined in segment order, so every
+// operation is deterministic for a given grain. Floating point sums may still differ from a serial scan
+// because the additions are grouped differently.
+
+
+namespace pybuffer_container
+{
+    // A run of rows [begin, end) inside segment number segment
+    struct segment_range
+    {
+        size_t segment;
+        size_t begin;
+        size_t end;
+    };
+
+
+    // Fixed size pool of worker threads. run() hands out task indices: each participant starts on its own
+    // contiguous block of tasks and, once that is drained, steals the back half of the largest block still
+    // queued elsewhere. The calling thread takes part in the work so a pool of size 1 has no workers at all.
+    class work_stealing_pool
+    {
+    public:
+        // thread_count includes the calling thread
+        explicit work_stealing_pool(size_t thread_count = default_thread_count()):
+            m_queues(std::max<size_t>(thread_count, 1)),
+            m_generation(0),
+            m_active(0),
+            m_remaining(0),
+            m_stop(false),
+            m_owner_pid(::getpid())
+        {
+            for (size_t index = 1; index < m_queues.size(); ++index)
+                m_workers.emplace_back([this, index]() { worker_loop(index); });
+        }
+
+        ~work_stealing_pool()
+        {
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                m_stop = true;
+            }
+            m_wake.notify_all();
+            for (auto& worker: m_workers)
+                worker.join();
+        }
+
+        work_stealing_pool(const work_stealing_pool&) = delete;
+        work_stealing_pool& operator = (const work_stealing_pool&) = delete;
+
+        size_t size() const
+        {
+            return m_queues.size();
+        }
+
+        // Calls fn(task) for every task in [0, task_count) and returns once all have finished. The first
+        // exception thrown by fn is rethrown here after the remaining tasks are drained. Calls made from
+        // inside a task, or while another thread is running a job, execute serially on the caller. So do
+        // calls in a child process made by fork(), which has the pool object but none of its workers.
+        template <typename Fn>
+        void run(size_t task_count, Fn&& fn)
+        {
+            if (!task_count)
+                return;
+
+            std::unique_lock<std::mutex> run_guard(m_run_lock, std::defer_lock);
+            if (task_count == 1 || m_queues.size() == 1 || _in_pool() || ::getpid() != m_owner_pid ||
+                !run_guard.try_lock())
+            {
+                for (size_t task = 0; task < task_count; ++task)
+                    fn(task);
+                return;
+            }
+
+            m_job = std::function<void(size_t)>(std::ref(fn));
+            m_error = nullptr;
+            const size_t per_queue = (task_count + m_queues.size() - 1) / m_queues.size();
+            for (size_t index = 0; index < m_queues.size(); ++index)
+            {
+                std::lock_guard<std::mutex> guard(m_queues[index].m_lock);
+                m_queues[index].m_begin = std::min(task_count, index * per_queue);
+                m_queues[index].m_end = std::min(task_count, (index + 1) * per_queue);
+            }
+
+            m_remaining.store(task_count, std::memory_order_release);
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                m_active = m_workers.size();
+                ++m_generation;
+            }
+            m_wake.notify_all();
+
+            _in_pool() = true;
+            drain(0);
+            _in_pool() = false;
+
+            // Every worker must leave this generation before the queues can be refilled by the next run
+            {
+                std::unique_lock<std::mutex> guard(m_lock);
+                m_done.wait(guard, [this]() {
+                    return m_active == 0 && m_remaining.load(std::memory_order_acquire) == 0;
+                });
+            }
+            m_job = nullptr;
+
+            if (m_error)
+                std::rethrow_exception(m_error);
+        }
+
+        static size_t default_thread_count()
+        {
+            return std::max<size_t>(std::thread::hardware_concurrency(), 1);
+        }
+
+        // Process wide pool sized to the hardware. A child made by fork() (e.g. python multiprocessing) gets
+        // a new pool on its first call; the parent's pool is abandoned there since its threads do not exist.
+        static work_stealing_pool& shared()
+        {
+            std::lock_guard<std::mutex> guard(_shared_lock());
+            auto& pool = _shared_pool();
+            if (!pool)
+            {
+                static const int registered = ::pthread_atfork(&_before_fork, &_after_fork_parent, &_after_fork_child);
+                (void)registered;
+                pool.reset(new work_stealing_pool);
+            }
+            return *pool;
+        }
+
+    private:
+        struct alignas(64) _task_queue
+        {
+            std::mutex m_lock;
+            size_t m_begin = 0;
+            size_t m_end = 0;
+        };
+
+        static bool& _in_pool()
+        {
+            static thread_local bool in_pool = false;
+            return in_pool;
+        }
+
+        static std::mutex& _shared_lock()
+        {
+            static std::mutex lock;
+            return lock;
+        }
+
+        static std::unique_ptr<work_stealing_pool>& _shared_pool()
+        {
+            static std::unique_ptr<work_stealing_pool> pool;
+            return pool;
+        }
+
+        // Holding the lock across fork() keeps the child from inheriting it locked by a thread that is gone
+        static void _before_fork()
+        {
+            _shared_lock().lock();
+        }
+
+        static void _after_fork_parent()
+        {
+            _shared_lock().unlock();
+        }
+
+        // Only the forking thread exists in the child. Destroying the old pool would join threads that are
+        // not there, so it is leaked and shared() builds a new one.
+        static void _after_fork_child()
+        {
+            _shared_pool().release();
+            _shared_lock().unlock();
+        }
+
+        void worker_loop(size_t index)
+        {
+            _in_pool() = true;
+            size_t seen_generation = 0;
+            for (;;)
+            {
+                {
+                    std::unique_lock<std::mutex> guard(m_lock);
+                    m_wake.wait(guard, [&]() { return m_stop || m_generation != seen_generation; });
+                    if (m_stop)
+                        return;
+                    seen_generation = m_generation;
+                }
+                drain(index);
+
+                std::lock_guard<std::mutex> guard(m_lock);
+                if (--m_active == 0)
+                    m_done.notify_all();
+            }
+        }
+
+        bool pop(size_t index, size_t& task)
+        {
+            std::lock_guard<std::mutex> guard(m_queues[index].m_lock);
+            if (m_queues[index].m_begin == m_queues[index].m_end)
+                return false;
+            task = m_queues[index].m_begin++;
+            return true;
+        }
+
+        // Moves the back half of the fullest other queue onto queue index
+        bool steal(size_t index)
+        {
+            size_t victim = index;
+            size_t most = 0;
+            for (size_t offset = 1; offset < m_queues.size(); ++offset)
+            {
+                size_t candidate = (index + offset) % m_queues.size();
+                std::lock_guard<std::mutex> guard(m_queues[candidate].m_lock);
+                size_t queued = m_queues[candidate].m_end - m_queues[candidate].m_begin;
+                if (queued > most)
+                {
+                    most = queued;
+                    victim = candidate;
+                }
+            }
+
+            if (victim == index)
+                return false;
+
+            size_t begin, end;
+            {
+                std::lock_guard<std::mutex> guard(m_queues[victim].m_lock);
+                end = m_queues[victim].m_end;
+                if (m_queues[victim].m_begin == end)
+                    return false;
+                begin = end - (end - m_queues[victim].m_begin + 1) / 2;
+                m_queues[victim].m_end = begin;
+            }
+
+            std::lock_guard<std::mutex> guard(m_queues[index].m_lock);
+            m_queues[index].m_begin = begin;
+            m_queues[index].m_end = end;
+            return true;
+        }
+
+        void drain(size_t index)
+        {
+            size_t task;
+            for (;;)
+            {
+                if (!pop(index, task))
+                {
+                    // Other participants may still be inside a task but there is nothing left to take
+                    if (!steal(index))
+                        return;
+                    continue;
+                }
+
+                try
+                {
+                    m_job(task);
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> guard(m_lock);
+                    if (!m_error)
+                        m_error = std::current_exception();
+                }
+
+                if (m_remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                {
+                    std::lock_guard<std::mutex> guard(m_lock);
+                    m_done.notify_all();
+                }
+            }
+        }
+
+        std::vector<_task_queue> m_queues;
+        std::vector<std::thread> m_workers;
+        std::mutex m_run_lock; // one job at a time
+        std::mutex m_lock;
+        std::condition_variable m_wake;
+        std::condition_variable m_done;
+        std::function<void(size_t)> m_job;
+        std::exception_ptr m_error;
+        size_t m_generation;
+        size_t m_active; // workers that have not yet left the current generation
+        std::atomic<size_t> m_remaining;
+        bool m_stop;
+        pid_t m_owner_pid; // process whose threads are m_workers
+    };
+
+
+    // Default number of rows per sub-range. Large enough that scheduling cost is noise, small enough that a
+    // 100M row snapshot yields work for every core.
+    constexpr size_t default_scan_grain = 1 << 16;
+
+
+    // Cuts every segment into sub-ranges of at most grain rows. Empty segments produce no ranges.
+    template <typename SegmentRange>
+    std::vector<segment_range> split_segments(const SegmentRange& segments, size_t grain = default_scan_grain)
+    {
+        grain = std::max<size_t>(grain, 1);
+        std::vector<segment_range> ranges;
+        size_t segment = 0;
+        for (auto& storage: segments)
+        {
+            const size_t size = storage->size();
+            for (size_t begin = 0; begin < size; begin += grain)
+                ranges.push_back(segment_range{segment, begin, std::min(size, begin + grain)});
+            ++segment;
+        }
+        return ranges;
+    }
+
+
+    // Runs fn(const T * rows, size_t count, const segment_range&) over every sub-range of segments in parallel
+    template <typename T, typename SegmentRange, typename Fn>
+    void parallel_scan(work_stealing_pool& pool, const SegmentRange& segments, Fn&& fn,
+                       size_t grain = default_scan_grain)
+    {
+        std::vector<const T*> bases;
+        for (auto& storage: segments)
+            bases.push_back(storage->data());
+
+        auto ranges = split_segments(segments, grain);
+        pool.run(ranges.size(), [&](size_t task) {
+            const segment_range& range = ranges[task];
+            fn(bases[range.segment] + range.begin, range.end - range.begin, range);
+        });
+    }
+
+
+    // Maps every sub-range to a partial result with map(const T * rows, size_t count) and folds the partials
+    // in segment order with combine(Result&, const Result&), starting from identity
+    template <typename T, typename Result, typename SegmentRange, typename Map, typename Combine>
+    Result parallel_reduce(work_stealing_pool& pool, const SegmentRange& segments, Result identity, Map&& map,
+                           Combine&& combine, size_t grain = default_scan_grain)
+    {
+        std::vector<const T*> bases;
+        for (auto& storage: segments)
+            bases.push_back(storage->data());
+
+        auto ranges = split_segments(segments, grain);
+        std::vector<Result> partials(ranges.size(), identity);
+        pool.run(ranges.size(), [&](size_t task) {
+            const segment_range& range = ranges[task];
+            partials[task] = map(bases[range.segment] + range.begin, range.end - range.begin);
+        });
+
+        for (auto& partial: partials)
+            combine(identity, partial);
+        return identity;
+    }
+
+
+    // Copies every row for which predicate(const T&) holds, keeping view order
+    template <typename T, typename SegmentRange, typename Predicate>
+    std::vector<T> parallel_filter(work_stealing_pool& pool, const SegmentRange& segments, Predicate&& predicate,
+                                   size_t grain = default_scan_grain)
+    {
+        std::vector<const T*> bases;
+        for (auto& storage: segments)
+            bases.push_back(storage->data());
+
+        auto ranges = split_segments(segments, grain);
+        std::vector<std::vector<T>> matches(ranges.size());
+        pool.run(ranges.size(), [&](size_t task) {
+            const segment_range& range = ranges[task];
+            const T * rows = bases[range.segment];
+            for (size_t index = range.begin; index < range.end; ++index)
+                if (predicate(rows[index]))
+                    matches[task].push_back(rows[index]);
+        });
+
+        size_t total = 0;
+        for (auto& partial: matches)
+            total += partial.size();
+
+        std::vector<T> result;
+        result.reserve(total);
+        for (auto& partial: matches)
+            result.insert(result.end(), partial.begin(), partial.end());
+        return result;
+    }
+
+
+    // Applies transform(const T&) to every row and returns the results in view order
+    template <typename T, typename SegmentRange, typename Transform>
+    auto parallel_transform(work_stealing_pool& pool, const SegmentRange& segments, Transform&& transform,
+                            size_t grain = default_scan_grain)
+    {
+        typedef std::decay_t<decltype(transform(std::declval<const T&>()))> result_t;
+        std::vector<size_t> starts;
+        size_t total = 0;
+        for (auto& storage: segments)
+        {
+            starts.push_back(total);
+            total += storage->size();
+        }
+
+        std::vector<result_t> result(total);
+        parallel_scan<T>(pool, segments, [&](const T * rows, size_t count, const segment_range& range) {
+            result_t * out = result.data() + starts[range.segment] + range.begin;
+            for (size_t index = 0; index < count; ++index)
+                out[index] = transform(rows[index]);
+        }, grain);
+        return result;
+    }
+}
@@ -0,0 +1,155 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2020 Kuberan Naganathan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+
+namespace pybuffer_container
+{
+    // A buffer held in memory by at least one outstanding export
+    struct pinned_storage
+    {
+        size_t m_id; // id of the storage whose export first pinned the buffer
+        size_t m_bytes; // allocated size of the buffer when first pinned
+        size_t m_exports; // outstanding exports
+        std::chrono::steady_clock::time_point m_since; // first export of the current pin
+    };
+
+
+    // Accounts for the memory kept alive by buffers exported to python. An export holds a reference to its
+    // wrapper and so to the whole storage, and a forgotten memoryview pins that storage indefinitely.
+    // Every export of a storage made by a tracked creator calls pin and every release calls unpin, so
+    // pinned_bytes is the memory python could release by dropping its views. Pins are keyed by the
+    // underlying buffer, not the storage: aliased copies share their source's whole buffer, so exports of
+    // several aliases count that buffer once, at its allocated size. pinned() lists the buffers with the
+    // storage id that first pinned each and their pin age, which identifies views that should have been
+    // dropped long ago.
+    class buffer_pin_tracker
+    {
+    public:
+        // Called with the pinned byte total and the limit when an export takes the total above the soft
+        // limit. It runs on the exporting thread, with the GIL held for python exports, after the tracker's
+        // lock is released. It fires once per crossing: the total must fall back to the limit to re-arm it.
+        typedef std::function<void(size_t pinned_bytes, size_t soft_limit)> limit_callback_t;
+
+        void pin(const void * buffer, size_t id, size_t bytes)
+        {
+            limit_callback_t callback;
+            size_t pinned_bytes = 0, soft_limit = 0;
+            {
+                std::lock_guard<std::mutex> guard(m_mutex);
+                auto& entry = m_pinned[buffer];
+                if (!entry.m_exports)
+                {
+                    entry = pinned_storage{id, bytes, 0, std::chrono::steady_clock::now()};
+                    m_pinned_bytes += bytes;
+                    m_high_water_bytes = std::max(m_high_water_bytes, m_pinned_bytes);
+                    if (m_soft_limit && m_pinned_bytes > m_soft_limit && !m_over_limit)
+                    {
+                        m_over_limit = true;
+                        callback = m_limit_callback;
+                        pinned_bytes = m_pinned_bytes;
+                        soft_limit = m_soft_limit;
+                    }
+                }
+                ++entry.m_exports;
+            }
+
+            if (callback)
+                callback(pinned_bytes, soft_limit);
+        }
+
+        void unpin(const void * buffer)
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            auto entry = m_pinned.find(buffer);
+            if (entry == m_pinned.end() || --entry->second.m_exports)
+                return;
+
+            m_pinned_bytes -= entry->second.m_bytes;
+            m_pinned.erase(entry);
+            if (m_pinned_bytes <= m_soft_limit)
+                m_over_limit = false;
+        }
+
+        // A soft_limit of 0 disables the callback
+        void set_soft_limit(size_t soft_limit, const limit_callback_t& callback)
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            m_soft_limit = soft_limit;
+            m_limit_callback = callback;
+            m_over_limit = soft_limit && m_pinned_bytes > soft_limit;
+        }
+
+        size_t pinned_bytes() const
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            return m_pinned_bytes;
+        }
+
+        size_t high_water_bytes() const
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            return m_high_water_bytes;
+        }
+
+        // Restarts the high water mark from the current total, e.g. at the start of a reporting interval
+        void reset_high_water()
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            m_high_water_bytes = m_pinned_bytes;
+        }
+
+        // Pinned storages, oldest pin first
+        std::vector<pinned_storage> pinned() const
+        {
+            std::vector<pinned_storage> result;
+            {
+                std::lock_guard<std::mutex> guard(m_mutex);
+                result.reserve(m_pinned.size());
+                for (auto& entry: m_pinned)
+                    result.push_back(entry.second);
+            }
+            std::sort(result.begin(), result.end(),
+                      [](const pinned_storage& lhs, const pinned_storage& rhs) {return lhs.m_since < rhs.m_since;});
+            return result;
+        }
+
+    private:
+        mutable std::mutex m_mutex;
+        std::unordered_map<const void*, pinned_storage> m_pinned; // by buffer
+        size_t m_pinned_bytes = 0;
+        size_t m_high_water_bytes = 0;
+        size_t m_soft_limit = 0;
+        bool m_over_limit = false;
+        limit_callback_t m_limit_callback;
+    };
+}
@@ -0,0 +1,374 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2020 Kuberan Naganathan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include "pybuffer_storage.h"
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <vector>
+
+
+namespace pybuffer_container
+{
+    struct segment_pool_stats
+    {
+        size_t hits; // allocations served from a thread cache or the shared pool
+        size_t misses; // allocations which had to go to operator new
+        size_t releases; // blocks returned to a thread cache or the shared pool
+        size_t overflows; // blocks freed back to operator delete because the caches were full or oversize
+
+        double hit_rate() const
+        {
+            return hits + misses ? static_cast<double>(hits) / (hits + misses) : 0.0;
+        }
+    };
+
+
+    // Size classed block pool used for both the shared_ptr control blocks and the element buffers of
+    // pooled vector_storage instances. Blocks are cached per thread so the common create/destroy cycle
+    // of snapshot storages does not touch the global allocator or any lock. Sizes are rounded up to the
+    // next power of two. Blocks larger than max_class_size bypass the pool.
+    //
+    // A thread cache holds at most max_cached_bytes_per_thread. Blocks that do not fit go to a shared pool,
+    // guarded by a mutex and capped at max_shared_cached_bytes, which also serves thread cache misses.
+    // Beyond that blocks go back to operator delete. trim() releases the cached memory of the calling
+    // thread and of the shared pool. A block freed during or after its thread's exit, e.g. by a storage
+    // outliving the thread, goes straight to the shared pool.
+    class segment_pool
+    {
+    public:
+        static const size_t min_class_shift = 6; // 64 bytes
+        static const size_t max_class_shift = 26; // 64 MB
+        static const size_t class_count = max_class_shift - min_class_shift + 1;
+        static const size_t max_class_size = size_t(1) << max_class_shift;
+        static const size_t max_cached_bytes_per_class = size_t(1) << 24; // in one thread cache
+        static const size_t max_cached_bytes_per_thread = size_t(1) << 25;
+        static const size_t max_shared_cached_bytes = size_t(1) << 28;
+
+        static void * allocate(size_t bytes)
+        {
+            if (bytes > max_class_size)
+            {
+                count_miss(thread_cache());
+                return ::operator new(bytes);
+            }
+
+            const size_t size_class = class_index(bytes);
+            auto cache = thread_cache();
+            if (cache && !cache->m_free[size_class].empty())
+            {
+                void * block = cache->m_free[size_class].back();
+                cache->m_free[size_class].pop_back();
+                cache->m_cached_bytes -= class_size(size_class);
+                cache->m_hits.fetch_add(1, std::memory_order_relaxed);
+                return block;
+            }
+
+            if (void * block = shared_pool().take(size_class))
+            {
+                if (cache)
+                    cache->m_hits.fetch_add(1, std::memory_order_relaxed);
+                else
+                    shared_pool().count(&segment_pool_stats::hits);
+                return block;
+            }
+
+            count_miss(cache);
+            return ::operator new(class_size(size_class));
+        }
+
+        static void deallocate(void * block, size_t bytes)
+        {
+            auto cache = thread_cache();
+            if (bytes > max_class_size)
+            {
+                if (cache)
+                    cache->m_overflows.fetch_add(1, std::memory_order_relaxed);
+                else
+                    shared_pool().count(&segment_pool_stats::overflows);
+                ::operator delete(block);
+                return;
+            }
+
+            const size_t size_class = class_index(bytes);
+            const size_t block_size = class_size(size_class);
+            if (cache && cache->m_free[size_class].size() * block_size + block_size <= max_cached_bytes_per_class &&
+                cache->m_cached_bytes + block_size <= max_cached_bytes_per_thread)
+            {
+                cache->m_free[size_class].push_back(block);
+                cache->m_cached_bytes += block_size;
+                cache->m_releases.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+
+            if (shared_pool().give(size_class, block))
+            {
+                if (cache)
+                    cache->m_releases.fetch_add(1, std::memory_order_relaxed);
+                else
+                    shared_pool().count(&segment_pool_stats::releases);
+                return;
+            }
+
+            if (cache)
+                cache->m_overflows.fetch_add(1, std::memory_order_relaxed);
+            else
+                shared_pool().count(&segment_pool_stats::overflows);
+            ::operator delete(block);
+        }
+
+        // Frees every block cached by the calling thread and by the shared pool. Returns the bytes freed.
+        // Other threads' caches are untouched since only their owners may access them.
+        static size_t trim()
+        {
+            size_t freed = 0;
+            if (auto cache = thread_cache())
+            {
+                freed += cache->m_cached_bytes;
+                cache->release_all();
+            }
+            return freed + shared_pool().release_all();
+        }
+
+        // Bytes currently held by the shared pool
+        static size_t shared_cached_bytes()
+        {
+            auto& pool = shared_pool();
+            std::lock_guard<std::mutex> guard(pool.m_mutex);
+            return pool.m_cached_bytes;
+        }
+
+        // Aggregated over all live threads plus every thread which has already exited
+        static segment_pool_stats stats()
+        {
+            auto& registry = shared_pool();
+            std::lock_guard<std::mutex> guard(registry.m_mutex);
+            segment_pool_stats result = registry.m_retired;
+            for (auto cache: registry.m_caches)
+                cache->add_to(result);
+            return result;
+        }
+
+    private:
+        struct _thread_cache;
+
+        // Live thread caches, counters of exited threads and the shared block pool
+        struct _shared_pool
+        {
+            std::mutex m_mutex;
+            std::vector<_thread_cache*> m_caches;
+            segment_pool_stats m_retired = {0, 0, 0, 0};
+            std::vector<void*> m_free[class_count];
+            size_t m_cached_bytes = 0;
+
+            void * take(size_t size_class)
+            {
+                std::lock_guard<std::mutex> guard(m_mutex);
+                auto& free_list = m_free[size_class];
+                if (free_list.empty())
+                    return nullptr;
+                void * block = free_list.back();
+                free_list.pop_back();
+                m_cached_bytes -= class_size(size_class);
+                return block;
+            }
+
+            bool give(size_t size_class, void * block)
+            {
+                std::lock_guard<std::mutex> guard(m_mutex);
+                if (m_cached_bytes + class_size(size_class) > max_shared_cached_bytes)
+                    return false;
+                m_free[size_class].push_back(block);
+                m_cached_bytes += class_size(size_class);
+                return true;
+            }
+
+            size_t release_all()
+            {
+                std::lock_guard<std::mutex> guard(m_mutex);
+                for (auto& free_list: m_free)
+                {
+                    for (auto block: free_list)
+                        ::operator delete(block);
+                    free_list.clear();
+                    free_list.shrink_to_fit();
+                }
+                const size_t freed = m_cached_bytes;
+                m_cached_bytes = 0;
+                return freed;
+            }
+
+            // For threads whose cache is gone
+            void count(size_t segment_pool_stats::* counter)
+            {
+                std::lock_guard<std::mutex> guard(m_mutex);
+                ++(m_retired.*counter);
+            }
+        };
+
+        struct _thread_cache
+        {
+            std::vector<void*> m_free[class_count];
+            size_t m_cached_bytes = 0;
+            // Only written by the owning thread. Atomic so stats() can read them from any thread.
+            std::atomic<size_t> m_hits{0};
+            std::atomic<size_t> m_misses{0};
+            std::atomic<size_t> m_releases{0};
+            std::atomic<size_t> m_overflows{0};
+
+            _thread_cache()
+            {
+                auto& registry = shared_pool();
+                std::lock_guard<std::mutex> guard(registry.m_mutex);
+                registry.m_caches.push_back(this);
+            }
+
+            ~_thread_cache()
+            {
+                // Blocks freed from here on, by this thread's remaining thread_local destructors, bypass the cache
+                cache_destroyed() = true;
+                release_all();
+
+                auto& registry = shared_pool();
+                std::lock_guard<std::mutex> guard(registry.m_mutex);
+                add_to(registry.m_retired);
+                for (auto pos = registry.m_caches.begin(); pos != registry.m_caches.end(); ++pos)
+                {
+                    if (*pos == this)
+                    {
+                        registry.m_caches.erase(pos);
+                        break;
+                    }
+                }
+            }
+
+            void release_all()
+            {
+                for (auto& free_list: m_free)
+                {
+                    for (auto block: free_list)
+                        ::operator delete(block);
+                    free_list.clear();
+                    free_list.shrink_to_fit();
+                }
+                m_cached_bytes = 0;
+            }
+
+            void add_to(segment_pool_stats& stats) const
+            {
+                stats.hits += m_hits.load(std::memory_order_relaxed);
+                stats.misses += m_misses.load(std::memory_order_relaxed);
+                stats.releases += m_releases.load(std::memory_order_relaxed);
+                stats.overflows += m_overflows.load(std::memory_order_relaxed);
+            }
+        };
+
+        // Never destroyed, so storages freed by static destructors after main still find it
+        static _shared_pool& shared_pool()
+        {
+            static _shared_pool * pool = new _shared_pool;
+            return *pool;
+        }
+
+        // Trivially destructible, so it stays readable while the thread's other thread_locals are destroyed
+        static bool& cache_destroyed()
+        {
+            thread_local bool destroyed = false;
+            return destroyed;
+        }
+
+        // nullptr once the calling thread's cache has been destroyed
+        static _thread_cache * thread_cache()
+        {
+            if (cache_destroyed())
+                return nullptr;
+            thread_local _thread_cache cache;
+            return &cache;
+        }
+
+        static void count_miss(_thread_cache * cache)
+        {
+            if (cache)
+                cache->m_misses.fetch_add(1, std::memory_order_relaxed);
+            else
+                shared_pool().count(&segment_pool_stats::misses);
+        }
+
+        static size_t class_index(size_t bytes)
+        {
+            size_t shift = min_class_shift;
+            while ((size_t(1) << shift) < bytes)
+                ++shift;
+            return shift - min_class_shift;
+        }
+
+        static size_t class_size(size_t size_class)
+        {
+            return size_t(1) << (size_class + min_class_shift);
+        }
+    };
+
+
+    // std compatible allocator drawing from segment_pool. Stateless so any instance can free memory
+    // allocated by any other.
+    template <typename T>
+    struct pool_allocator
+    {
+        typedef T value_type;
+        static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__, "pool_allocator does not support over-aligned types");
+
+        pool_allocator() = default;
+
+        template <typename U>
+        pool_allocator(const pool_allocator<U>&)
+        {}
+
+        T * allocate(size_t n)
+        {
+            return static_cast<T*>(segment_pool::allocate(n * sizeof(T)));
+        }
+
+        void deallocate(T * ptr, size_t n)
+        {
+            segment_pool::deallocate(ptr, n * sizeof(T));
+        }
+
+        template <typename U>
+        bool operator == (const pool_allocator<U>&) const
+        {return true;}
+
+        template <typename U>
+        bool operator != (const pool_allocator<U>&) const
+        {return false;}
+    };
+
+
+    // vector_storage whose control block and element buffer both come from segment_pool
+    template <typename T>
+    using pool_vector_storage = vector_storage<T, pool_allocator<T>>;
+
+    template <typename T>
+    using pool_storage_creator = pybuffer_storage_creator<T, pool_allocator<T>>;
+}
@@ -0,0 +1,394 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2020 Kuberan Naganathan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include "pybuffer_struct_code.h"
+#include "pybuffer_parallel.h"
+#include <cstddef>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+// Native reductions and filters over one member of every record in a set of storage segments. Segments are
+// scanned straight from their data() pointers, optionally in parallel on a work_stealing_pool, and the
+// partial results are combined, so a whole view is processed without calling back into python.
+
+
+namespace pybuffer_container
+{
+    enum class reduction_op
+    {
+        sum,
+        min,
+        max,
+        mean
+    };
+
+
+    enum class compare_op
+    {
+        lt,
+        le,
+        eq,
+        ne,
+        ge,
+        gt
+    };
+
+
+    // Result of a reduction, kept in the widest type of the member's kind so integer sums do not lose
+    // precision. kind is empty when min, max or mean are requested over no records, and overflow when an
+    // integer sum or mean needs more than 64 bits. Also used as the operand of a comparison filter.
+    struct reduction_value
+    {
+        enum kind_t
+        {
+            empty,
+            signed_integer,
+            unsigned_integer,
+            floating,
+            overflow
+        };
+
+        kind_t kind;
+        long long signed_value;
+        unsigned long long unsigned_value;
+        double floating_value;
+    };
+
+
+    namespace reduce_detail
+    {
+        template <typename FieldType>
+        using accumulator_t = std::conditional_t<std::is_floating_point<FieldType>::value, double,
+                              std::conditional_t<std::is_signed<FieldType>::value, long long, unsigned long long>>;
+
+
+        // Adds value to sum. Returns true if an integer sum overflowed, which for signed integers would
+        // otherwise be undefined behaviour. The check compiles to an add and a flag test.
+        template <typename Accumulator, typename Value>
+        bool add_checked(Accumulator& sum, Value value)
+        {
+            if constexpr (std::is_floating_point<Accumulator>::value)
+            {
+                sum += value;
+                return false;
+            }
+            else
+            {
+                return __builtin_add_overflow(sum, value, &sum);
+            }
+        }
+
+
+        template <typename FieldType>
+        struct partial
+        {
+            size_t count = 0;
+            accumulator_t<FieldType> sum = 0;
+            bool overflow = false; // sum is meaningless once set
+            FieldType min = std::numeric_limits<FieldType>::max();
+            FieldType max = std::numeric_limits<FieldType>::lowest();
+
+            void combine(const partial& other)
+            {
+                count += other.count;
+                overflow |= other.overflow | add_checked(sum, other.sum);
+                min = other.min < min ? other.min : min;
+                max = other.max > max ? other.max : max;
+            }
+        };
+
+
+        template <typename FieldType>
+        FieldType load(const char * pos)
+        {
+            // Members of packed or oddly aligned records are read without assuming alignment
+            FieldType value;
+            std::memcpy(&value, pos, sizeof(FieldType));
+            return value;
+        }
+
+
+        // Reduces count members spaced stride bytes apart. Four independent accumulator lanes break the
+        // dependency chain so the loop pipelines and, when stride == sizeof(FieldType) as for columnar
+        // storage, vectorizes.
+        template <typename FieldType>
+        partial<FieldType> reduce_strided(const char * base, size_t count, size_t stride)
+        {
+            typedef accumulator_t<FieldType> acc_t;
+            acc_t sum[4] = {0, 0, 0, 0};
+            bool overflow = false;
+            FieldType min[4], max[4];
+            for (size_t lane = 0; lane < 4; ++lane)
+            {
+                min[lane] = std::numeric_limits<FieldType>::max();
+                max[lane] = std::numeric_limits<FieldType>::lowest();
+            }
+
+            size_t index = 0;
+            for (; index + 4 <= count; index += 4)
+            {
+                for (size_t lane = 0; lane < 4; ++lane)
+                {
+                    FieldType value = load<FieldType>(base + (index + lane) * stride);
+                    overflow |= add_checked(sum[lane], value);
+                    min[lane] = value < min[lane] ? value : min[lane];
+                    max[lane] = value > max[lane] ? value : max[lane];
+                }
+            }
+
+            for (; index < count; ++index)
+            {
+                FieldType value = load<FieldType>(base + index * stride);
+                overflow |= add_checked(sum[0], value);
+                min[0] = value < min[0] ? value : min[0];
+                max[0] = value > max[0] ? value : max[0];
+            }
+
+            partial<FieldType> result;
+            result.count = count;
+            result.overflow = overflow;
+            for (size_t lane = 0; lane < 4; ++lane)
+            {
+                result.overflow |= add_checked(result.sum, sum[lane]);
+                result.min = min[lane] < result.min ? min[lane] : result.min;
+                result.max = max[lane] > result.max ? max[lane] : result.max;
+            }
+            return result;
+        }
+
+
+        template <typename Value>
+        reduction_value make_value(Value value)
+        {
+            reduction_value result = {reduction_value::empty, 0, 0, 0.0};
+            if constexpr (std::is_floating_point<Value>::value)
+            {
+                result.kind = reduction_value::floating;
+                result.floating_value = value;
+            }
+            else if constexpr (std::is_signed<Value>::value)
+            {
+                result.kind = reduction_value::signed_integer;
+                result.signed_value = value;
+            }
+            else
+            {
+                result.kind = reduction_value::unsigned_integer;
+                result.unsigned_value = value;
+            }
+            return result;
+        }
+
+
+        template <typename FieldType>
+        reduction_value finish(const partial<FieldType>& total, reduction_op op)
+        {
+            if (total.overflow && (op == reduction_op::sum || op == reduction_op::mean))
+                return reduction_value{reduction_value::overflow, 0, 0, 0.0};
+            if (op == reduction_op::sum)
+                return make_value(total.sum);
+
+            if (!total.count)
+                return reduction_value{reduction_value::empty, 0, 0, 0.0};
+
+            switch (op)
+            {
+                case reduction_op::min: return make_value(total.min);
+                case reduction_op::max: return make_value(total.max);
+                default: return make_value(static_cast<double>(total.sum) / total.count);
+            }
+        }
+
+
+        // bool and char members are exposed to python as booleans and bytes rather than numbers
+        template <typename FieldType>
+        constexpr bool is_reducible()
+        {
+            return std::is_arithmetic<FieldType>::value && !std::is_same<FieldType, bool>::value &&
+                   !std::is_same<FieldType, char>::value;
+        }
+
+
+        // Three way comparison of a member value against an operand of any kind without lossy conversions
+        // between signed and unsigned integers
+        template <typename FieldType>
+        int compare_value(FieldType value, const reduction_value& operand)
+        {
+            if (std::is_floating_point<FieldType>::value || operand.kind == reduction_value::floating)
+            {
+                const double lhs = static_cast<double>(value);
+                const double rhs = operand.kind == reduction_value::floating ? operand.floating_value :
+                                   operand.kind == reduction_value::signed_integer ?
+                                   static_cast<double>(operand.signed_value) :
+                                   static_cast<double>(operand.unsigned_value);
+                return (lhs > rhs) - (lhs < rhs);
+            }
+
+            if (operand.kind == reduction_value::signed_integer && operand.signed_value < 0)
+            {
+                if (!std::is_signed<FieldType>::value)
+                    return 1;
+                const long long lhs = static_cast<long long>(value);
+                return (lhs > operand.signed_value) - (lhs < operand.signed_value);
+            }
+
+            if (std::is_signed<FieldType>::value && value < static_cast<FieldType>(0))
+                return -1;
+            const unsigned long long lhs = static_cast<unsigned long long>(value);
+            const unsigned long long rhs = operand.kind == reduction_value::signed_integer ?
+                                           static_cast<unsigned long long>(operand.signed_value) :
+                                           operand.unsigned_value;
+            return (lhs > rhs) - (lhs < rhs);
+        }
+
+
+        inline bool compare_matches(int order, compare_op op)
+        {
+            switch (op)
+            {
+                case compare_op::lt: return order < 0;
+                case compare_op::le: return order <= 0;
+                case compare_op::eq: return order == 0;
+                case compare_op::ne: return order != 0;
+                case compare_op::ge: return order >= 0;
+                default: return order > 0;
+            }
+        }
+
+
+        template <typename T, typename SegmentRange, size_t I>
+        bool reduce_member(work_stealing_pool * pool, const SegmentRange& segments, reduction_op op,
+                           reduction_value& result)
+        {
+            typedef boost::pfr::tuple_element_t<I, T> field_type;
+            if constexpr (is_reducible<field_type>())
+            {
+                const size_t offset = pybuffer_container_detail::py_struct_fields<T>::value()[I].offset;
+                auto map = [offset](const T * rows, size_t count) {
+                    return reduce_strided<field_type>(reinterpret_cast<const char*>(rows) + offset, count, sizeof(T));
+                };
+                auto combine = [](partial<field_type>& total, const partial<field_type>& part) {
+                    total.combine(part);
+                };
+
+                partial<field_type> total;
+                if (pool)
+                {
+                    total = parallel_reduce<T>(*pool, segments, total, map, combine);
+                }
+                else
+                {
+                    for (auto& segment: segments)
+                        if (segment->size())
+                            total.combine(map(segment->data(), segment->size()));
+                }
+                result = finish(total, op);
+                return true;
+            }
+            else
+            {
+                return false;
+            }
+        }
+
+
+        template <typename T, typename SegmentRange, size_t I>
+        bool filter_member(work_stealing_pool& pool, const SegmentRange& segments, compare_op op,
+                           const reduction_value& operand, std::vector<T>& matches)
+        {
+            typedef boost::pfr::tuple_element_t<I, T> field_type;
+            if constexpr (is_reducible<field_type>())
+            {
+                const size_t offset = pybuffer_container_detail::py_struct_fields<T>::value()[I].offset;
+                matches = parallel_filter<T>(pool, segments, [&](const T& row) {
+                    field_type value = load<field_type>(reinterpret_cast<const char*>(&row) + offset);
+                    return compare_matches(compare_value(value, operand), op);
+                });
+                return true;
+            }
+            else
+            {
+                return false;
+            }
+        }
+
+
+        template <typename T, typename SegmentRange, size_t ...I>
+        bool dispatch(work_stealing_pool * pool, const SegmentRange& segments, size_t field, reduction_op op,
+                      reduction_value& result, std::index_sequence<I...>)
+        {
+            bool reduced = false;
+            ((field == I ? (reduced = reduce_member<T, SegmentRange, I>(pool, segments, op, result), 0) : 0), ...);
+            return reduced;
+        }
+
+
+        template <typename T, typename SegmentRange, size_t ...I>
+        bool dispatch_filter(work_stealing_pool& pool, const SegmentRange& segments, size_t field, compare_op op,
+                             const reduction_value& operand, std::vector<T>& matches, std::index_sequence<I...>)
+        {
+            bool filtered = false;
+            ((field == I ? (filtered = filter_member<T, SegmentRange, I>(pool, segments, op, operand, matches), 0)
+                         : 0), ...);
+            return filtered;
+        }
+    }
+
+
+    // Reduces the member at index field (see pybuffer_container_detail::py_struct_fields) across every
+    // segment. SegmentRange is any range of pointers to storages with data() and size(), for example the
+    // storage elements of a container_view. Returns false if the member is not a numeric scalar.
+    // Does not touch python so it may run with the GIL released.
+    template <typename T, typename SegmentRange>
+    bool reduce_field(const SegmentRange& segments, size_t field, reduction_op op, reduction_value& result)
+    {
+        return reduce_detail::dispatch<T>(nullptr, segments, field, op, result,
+                                          std::make_index_sequence<boost::pfr::tuple_size_v<T>>());
+    }
+
+
+    // As above but the segments are split into sub-ranges and reduced on pool
+    template <typename T, typename SegmentRange>
+    bool reduce_field(work_stealing_pool& pool, const SegmentRange& segments, size_t field, reduction_op op,
+                      reduction_value& result)
+    {
+        return reduce_detail::dispatch<T>(&pool, segments, field, op, result,
+                                          std::make_index_sequence<boost::pfr::tuple_size_v<T>>());
+    }
+
+
+    // Copies, in view order, every record whose member at index field compares to operand as op requests.
+    // Returns false if the member is not a numeric scalar. Does not touch python.
+    template <typename T, typename SegmentRange>
+    bool filter_field(work_stealing_pool& pool, const SegmentRange& segments, size_t field, compare_op op,
+                      const reduction_value& operand, std::vector<T>& matches)
+    {
+        return reduce_detail::dispatch_filter<T>(pool, segments, field, op, operand, matches,
+                                                 std::make_index_sequence<boost::pfr::tuple_size_v<T>>());
+    }
+}
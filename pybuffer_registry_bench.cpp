@@ -0,0 +1,135 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2020 Kuberan Naganathan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "pybuffer_storage.h"
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+
+// Compares the sharded storage registry used by pybuffer_storage_creator against the single mutex
+// registry it replaced. Each thread repeatedly creates a storage, locates it and a recently created
+// storage, and drops most of what it created so the registry sees a realistic mix of live and expired
+// entries.
+
+
+struct bench_record
+{
+    int i1;
+    double d1;
+};
+
+
+// The previous implementation: one mutex and one map which is never pruned
+template <typename T>
+struct locked_storage_creator
+{
+    typedef pybuffer_container::vector_storage<T> storage_t;
+    typedef typename storage_t::shared_base_t shared_base_t;
+    typedef typename storage_t::shared_t shared_t;
+
+    struct control_t
+    {
+        std::mutex m_mutex;
+        std::unordered_map<size_t, std::weak_ptr<storage_t>> m_map;
+    };
+
+    locked_storage_creator():
+    m_control(std::make_shared<control_t>())
+    {}
+
+    shared_base_t operator() ()
+    {
+        auto storage = storage_t::create();
+        std::lock_guard<std::mutex> guard(m_control->m_mutex);
+        m_control->m_map.insert(std::pair<size_t, std::weak_ptr<storage_t>>(storage->id(),
+                                std::weak_ptr<storage_t>(storage)));
+        return storage;
+    }
+
+    shared_t locate(size_t id)
+    {
+        std::lock_guard<std::mutex> guard(m_control->m_mutex);
+        auto result = m_control->m_map.find(id);
+        if (result == m_control->m_map.end())
+            return shared_t();
+        else
+            return result->second.lock();
+    }
+
+    std::shared_ptr<control_t> m_control;
+};
+
+
+template <typename Creator>
+double run_bench(size_t thread_count, size_t iterations)
+{
+    Creator creator;
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+
+    for (size_t thread_index = 0; thread_index < thread_count; ++thread_index)
+    {
+        threads.emplace_back([&creator, iterations]()
+        {
+            // Keep a small window of storages alive so locate sees both hits and expired entries
+            std::vector<typename Creator::shared_base_t> live(16);
+            size_t hits = 0;
+            for (size_t i = 0; i < iterations; ++i)
+            {
+                auto storage = creator();
+                auto& slot = live[i % live.size()];
+                size_t previous_id = slot ? slot->id() : storage->id();
+                slot = storage;
+                hits += creator.locate(storage->id()) ? 1 : 0;
+                hits += creator.locate(previous_id - 1) ? 1 : 0;
+            }
+            if (hits == 0)
+                std::cerr << "unexpected: no locate hits" << std::endl;
+        });
+    }
+
+    for (auto& thread: threads)
+        thread.join();
+
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double>(elapsed).count();
+}
+
+
+int main(int argc, char ** argv)
+{
+    const size_t iterations = argc > 1 ? std::stoul(argv[1]) : 200000;
+    std::cout << "threads,locked_ops_per_sec,sharded_ops_per_sec" << std::endl;
+
+    for (size_t thread_count: {1, 2, 4, 8, 16, 32})
+    {
+        // create + two locates per iteration
+        const double ops = 3.0 * iterations * thread_count;
+        double locked = run_bench<locked_storage_creator<bench_record>>(thread_count, iterations);
+        double sharded = run_bench<pybuffer_container::pybuffer_storage_creator<bench_record>>(thread_count, iterations);
+        std::cout << thread_count << "," << ops / locked << "," << ops / sharded << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,472 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2020 Kuberan Naganathan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include "pybuffer_mmap_storage.h"
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// Segments shared between processes. A publishing process makes its storages with shm_storage_creator, which
+// places each one in a file on the shared memory filesystem (an mmap_storage under /dev/shm), and publishes
+// sealed storages by id in a shm_registry mapped by every process. Other processes attach with
+// shm_storage_reader::locate(id), which maps the segment read only. The rows exist once per host however many
+// processes read them, and attaching costs an open and an mmap.
+//
+// Every publisher instance picks a random epoch, stored in its registry header and in the header of each
+// segment file it writes. A restarted publisher reuses segment file names, so readers only accept a segment
+// whose epoch matches the registry they looked it up in. Readers still attached to a replaced registry get
+// empty results until they call shm_storage_reader::reattach.
+
+
+namespace pybuffer_container
+{
+    // Open addressing hash table from storage id to segment file id held in a shared mapping. Written by one
+    // process, read lock free by any number. Each slot is a seqlock: the writer makes its sequence odd while it
+    // changes the slot, and readers retry if they saw an odd sequence or the sequence moved under them. Slots
+    // that have never been used (sequence 0) end a probe; withdrawn slots are reused. A slot left odd by a
+    // writer that died mid update makes find throw after a bounded number of retries instead of spinning.
+    class shm_registry
+    {
+    public:
+        static constexpr std::uint64_t magic_value = 0x3147525355425950ull; // "PYBUSRG1"
+        static constexpr size_t max_read_attempts = 1 << 16; // per slot, yielding between attempts
+
+        // Creates an empty registry at path, replacing any previous one. Processes attached to the old file
+        // keep seeing its stale contents until they attach again.
+        static std::unique_ptr<shm_registry> create(const std::string& path, size_t capacity)
+        {
+            ::unlink(path.c_str());
+            auto file = mapped_file::open(path, true, true);
+            file->resize(sizeof(_header) + capacity * sizeof(_slot));
+            auto header = static_cast<_header*>(file->data());
+            header->capacity = capacity;
+            header->epoch = _random_epoch();
+            header->magic = magic_value;
+            return std::unique_ptr<shm_registry>(new shm_registry(std::move(file)));
+        }
+
+        // Maps an existing registry read only. Returns an empty pointer if path is not a registry.
+        static std::unique_ptr<shm_registry> open(const std::string& path)
+        {
+            auto file = mapped_file::open(path, false, false);
+            if (file->size() < sizeof(_header))
+                return std::unique_ptr<shm_registry>();
+            auto header = static_cast<const _header*>(file->data());
+            if (header->magic != magic_value || header->capacity > (file->size() - sizeof(_header)) / sizeof(_slot))
+                return std::unique_ptr<shm_registry>();
+            return std::unique_ptr<shm_registry>(new shm_registry(std::move(file)));
+        }
+
+        // Returns false if the table is full. key must be non zero and not already present.
+        bool insert(std::uint64_t key, std::uint64_t value)
+        {
+            std::lock_guard<std::mutex> guard(m_write_mutex);
+            for (size_t probe = 0; probe < capacity(); ++probe)
+            {
+                _slot& slot = slot_for(key, probe);
+                if (slot.key.load(std::memory_order_relaxed) == 0)
+                {
+                    write(slot, key, value);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        bool erase(std::uint64_t key)
+        {
+            std::lock_guard<std::mutex> guard(m_write_mutex);
+            for (size_t probe = 0; probe < capacity(); ++probe)
+            {
+                _slot& slot = slot_for(key, probe);
+                if (slot.sequence.load(std::memory_order_relaxed) == 0)
+                    return false;
+                if (slot.key.load(std::memory_order_relaxed) == key)
+                {
+                    write(slot, 0, 0);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Throws std::runtime_error if a slot stays mid update for max_read_attempts reads, which means the
+        // writer died while changing it and the registry must be recreated.
+        bool find(std::uint64_t key, std::uint64_t& value) const
+        {
+            for (size_t probe = 0; probe < capacity(); ++probe)
+            {
+                const _slot& slot = slot_for(key, probe);
+                for (size_t attempt = 0;; ++attempt)
+                {
+                    if (attempt == max_read_attempts)
+                        throw std::runtime_error("shm_registry slot left mid update, the publisher probably died");
+                    if (attempt)
+                        std::this_thread::yield();
+
+                    const std::uint64_t before = slot.sequence.load(std::memory_order_acquire);
+                    if (before == 0)
+                        return false;
+                    if (before & 1)
+                        continue;
+
+                    const std::uint64_t slot_key = slot.key.load(std::memory_order_relaxed);
+                    const std::uint64_t slot_value = slot.value.load(std::memory_order_relaxed);
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    if (slot.sequence.load(std::memory_order_relaxed) != before)
+                        continue;
+
+                    if (slot_key == key)
+                    {
+                        value = slot_value;
+                        return true;
+                    }
+                    break;
+                }
+            }
+            return false;
+        }
+
+        size_t capacity() const
+        {
+            return static_cast<const _header*>(m_file->data())->capacity;
+        }
+
+        // Random, non zero, chosen when the registry was created
+        std::uint64_t epoch() const
+        {
+            return static_cast<const _header*>(m_file->data())->epoch;
+        }
+
+        // True if the file at path is no longer the one this registry mapped, e.g. a publisher restarted
+        bool replaced(const std::string& path) const
+        {
+            struct stat mapped_stat, path_stat;
+            if (::fstat(m_file->fd(), &mapped_stat) != 0 || ::stat(path.c_str(), &path_stat) != 0)
+                return true;
+            return mapped_stat.st_dev != path_stat.st_dev || mapped_stat.st_ino != path_stat.st_ino;
+        }
+
+    private:
+        struct _header
+        {
+            std::uint64_t magic;
+            std::uint64_t capacity;
+            std::uint64_t epoch;
+            std::uint64_t reserved[5];
+        };
+
+        static std::uint64_t _random_epoch()
+        {
+            std::random_device device;
+            std::uint64_t epoch = 0;
+            while (!epoch)
+                epoch = (std::uint64_t(device()) << 32) ^ device();
+            return epoch;
+        }
+
+        // Atomics in a mapping shared between processes must not depend on any process local state
+        struct _slot
+        {
+            std::atomic<std::uint64_t> sequence;
+            std::atomic<std::uint64_t> key;
+            std::atomic<std::uint64_t> value;
+            std::uint64_t reserved;
+        };
+
+        static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "shm_registry needs lock free 64 bit atomics");
+
+        explicit shm_registry(std::unique_ptr<mapped_file> file):
+        m_file(std::move(file))
+        {}
+
+        const _slot& slot_for(std::uint64_t key, size_t probe) const
+        {
+            // Fibonacci hashing spreads the sequential storage ids over the table
+            const size_t index = (key * 11400714819323198485ull + probe) % capacity();
+            auto slots = reinterpret_cast<const _slot*>(static_cast<const char*>(m_file->data()) + sizeof(_header));
+            return slots[index];
+        }
+
+        _slot& slot_for(std::uint64_t key, size_t probe)
+        {
+            return const_cast<_slot&>(static_cast<const shm_registry*>(this)->slot_for(key, probe));
+        }
+
+        static void write(_slot& slot, std::uint64_t key, std::uint64_t value)
+        {
+            const std::uint64_t sequence = slot.sequence.load(std::memory_order_relaxed);
+            slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            slot.key.store(key, std::memory_order_relaxed);
+            slot.value.store(value, std::memory_order_relaxed);
+            slot.sequence.store(sequence + 2, std::memory_order_release);
+        }
+
+        std::unique_ptr<mapped_file> m_file;
+        std::mutex m_write_mutex;
+    };
+
+
+    // A published segment mapped read only into an attaching process. The mapping stays valid after the
+    // publisher drops the storage and its file is removed.
+    template <typename T>
+    class shm_segment
+    {
+    public:
+        typedef T value_type;
+        typedef std::shared_ptr<const shm_segment<T>> shared_t;
+
+        // Returns an empty pointer if the file is gone, was not written for T or was written by a publisher
+        // instance other than the one with this epoch
+        static shared_t open(const std::string& path, size_t id, std::uint64_t epoch)
+        {
+            std::unique_ptr<mapped_file> file;
+            try
+            {
+                file = mapped_file::open(path, false, false);
+            }
+            catch (const std::system_error& error)
+            {
+                if (error.code().value() == ENOENT)
+                    return shared_t();
+                throw;
+            }
+
+            if (file->size() < _mmap_storage_header::size)
+                return shared_t();
+            auto header = static_cast<const _mmap_storage_header*>(file->data());
+            if (header->magic != _mmap_storage_header::magic_value || header->signature != layout_signature<T>() ||
+                header->element_size != sizeof(T) || header->epoch != epoch ||
+                header->element_count > (file->size() - _mmap_storage_header::size) / sizeof(T))
+                return shared_t();
+
+            return shared_t(new shm_segment<T>(std::move(file), header->element_count, id));
+        }
+
+        const T * data() const
+        {
+            return reinterpret_cast<const T*>(static_cast<const char*>(m_file->data()) + _mmap_storage_header::size);
+        }
+
+        size_t size() const
+        {
+            return m_size;
+        }
+
+        // Storage id in the publishing process
+        size_t id() const
+        {
+            return m_id;
+        }
+
+    private:
+        shm_segment(std::unique_ptr<mapped_file> file, size_t size, size_t id):
+        m_file(std::move(file)),
+        m_size(size),
+        m_id(id)
+        {}
+
+        std::unique_ptr<mapped_file> m_file;
+        size_t m_size; // element count when attached
+        size_t m_id;
+    };
+
+
+    inline std::string _shm_namespace_path(const std::string& base, const std::string& name)
+    {
+        return base + "/pybuffer." + name;
+    }
+
+
+    // Publishing side. Storages are ordinary mmap_storages in the namespace directory. A storage must not be
+    // modified once published, since attached processes map its file directly; publish sealed snapshot
+    // segments and make changes in new storages. One publisher per name.
+    template <typename T>
+    struct shm_storage_creator
+    {
+        typedef mmap_storage<T> storage_t;
+        typedef typename storage_t::shared_base_t shared_base_t;
+        typedef typename storage_t::shared_t shared_t;
+
+        // Files left in the namespace by a previous publisher are removed first
+        explicit shm_storage_creator(const std::string& name, size_t registry_capacity = size_t(1) << 16,
+                                     const std::string& base = "/dev/shm"):
+        m_path(_clear_namespace(_shm_namespace_path(base, name))),
+        m_segments(m_path),
+        m_registry(shm_registry::create(m_path + "/registry", registry_capacity)),
+        m_published(std::make_shared<_published_t>())
+        {
+            m_segments.set_epoch(m_registry->epoch());
+        }
+
+        shared_base_t operator() ()
+        {
+            return m_segments();
+        }
+
+        template <typename IterType>
+        shared_base_t operator() (IterType start_pos, IterType end_pos)
+        {
+            return m_segments(start_pos, end_pos);
+        }
+
+        shared_t locate(size_t id)
+        {
+            return m_segments.locate(id);
+        }
+
+        // Makes storage visible to shm_storage_reader::locate(storage->id()). Returns false if the registry
+        // is full.
+        bool publish(const shared_t& storage)
+        {
+            if (!m_registry->insert(storage->id(), storage->persistent_id()))
+                return false;
+            std::lock_guard<std::mutex> guard(m_published->m_mutex);
+            m_published->m_storages.emplace_back(storage->id(), storage);
+            return true;
+        }
+
+        bool withdraw(size_t id)
+        {
+            return m_registry->erase(id);
+        }
+
+        // Withdraws published storages that have been destroyed and reclaims local registry entries
+        void sweep()
+        {
+            {
+                std::lock_guard<std::mutex> guard(m_published->m_mutex);
+                auto& storages = m_published->m_storages;
+                for (auto pos = storages.begin(); pos != storages.end();)
+                {
+                    if (pos->second.expired())
+                    {
+                        m_registry->erase(pos->first);
+                        pos = storages.erase(pos);
+                    }
+                    else
+                    {
+                        ++pos;
+                    }
+                }
+            }
+            m_segments.sweep();
+        }
+
+        const std::string& path() const
+        {
+            return m_path;
+        }
+
+    private:
+        struct _published_t
+        {
+            std::mutex m_mutex;
+            std::vector<std::pair<size_t, std::weak_ptr<storage_t>>> m_storages;
+        };
+
+        static std::string _clear_namespace(const std::string& path)
+        {
+            if (DIR * directory = ::opendir(path.c_str()))
+            {
+                while (auto entry = ::readdir(directory))
+                {
+                    std::string name(entry->d_name);
+                    if (name != "." && name != "..")
+                        ::unlink((path + "/" + name).c_str());
+                }
+                ::closedir(directory);
+            }
+            return path;
+        }
+
+        std::string m_path;
+        mmap_storage_creator<T> m_segments;
+        std::shared_ptr<shm_registry> m_registry;
+        std::shared_ptr<_published_t> m_published;
+    };
+
+
+    // Attaching side, usable from any process on the host
+    template <typename T>
+    class shm_storage_reader
+    {
+    public:
+        typedef typename shm_segment<T>::shared_t shared_t;
+
+        explicit shm_storage_reader(const std::string& name, const std::string& base = "/dev/shm"):
+        m_path(_shm_namespace_path(base, name)),
+        m_registry(_open_registry(m_path + "/registry"))
+        {}
+
+        // Maps the segment the publisher published under id. Returns an empty pointer if no such segment is
+        // published, or if it was written by a publisher instance other than the one whose registry this
+        // reader is attached to. Export it with create_py_segment_region for zero copy access from python.
+        shared_t locate(size_t id) const
+        {
+            std::uint64_t persistent_id;
+            if (!m_registry->find(id, persistent_id))
+                return shared_t();
+            return shm_segment<T>::open(m_path + "/" + std::to_string(persistent_id) + ".pbseg", id,
+                                        m_registry->epoch());
+        }
+
+        // Attaches to the current registry if the publisher has restarted since this reader attached.
+        // Returns true if it did. Not safe to call concurrently with locate.
+        bool reattach()
+        {
+            if (!m_registry->replaced(m_path + "/registry"))
+                return false;
+            m_registry = _open_registry(m_path + "/registry");
+            return true;
+        }
+
+    private:
+        static std::unique_ptr<shm_registry> _open_registry(const std::string& path)
+        {
+            auto registry = shm_registry::open(path);
+            if (!registry)
+                throw std::system_error(EINVAL, std::generic_category(), "not a registry " + path);
+            return registry;
+        }
+
+        std::string m_path;
+        std::unique_ptr<shm_registry> m_registry;
+    };
+}
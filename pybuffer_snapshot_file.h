@@ -0,0 +1,561 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2020 Kuberan Naganathan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include "pybuffer_storage.h"
+#include "pybuffer_mmap_storage.h"
+#include "pybuffer_struct_code.h"
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// Snapshot files hold every segment of a view so it can be brought back without re-appending rows.
+//
+//     header (64 bytes) | segment table | struct code | padding | block | padding | block ...
+//
+// The segment table has one (offset, count, key, generation) entry per segment, in view order. key is the id()
+// of the storage the segment was written from and generation its generation() at the time, or unversioned for
+// storages that do not count their modifications. Each block holds count raw elements and starts on a block_alignment
+// boundary so it can be mapped directly. Files are written to a temporary name and renamed into place, so a
+// reader never sees a partial snapshot.
+//
+// Files form chains. Sequence 0 is a full snapshot holding a block for every segment. Each later file is a
+// delta, written by snapshot_chain_writer, that only holds blocks for segments written since the previous file.
+// Unchanged segments are referenced by key and generation (offset == referenced_block) and resolved against the
+// view restored from the previous file of the same chain.
+
+
+namespace pybuffer_container
+{
+    struct _snapshot_file_header
+    {
+        static constexpr std::uint64_t magic_value = 0x31504e5355425950ull; // "PYBUSNP1"
+        static constexpr std::uint32_t current_version = 3;
+        static constexpr size_t block_alignment = 4096;
+
+        std::uint64_t magic;
+        std::uint32_t version;
+        std::uint32_t format_size; // bytes of struct code following the segment table
+        std::uint64_t signature; // layout_signature<T>()
+        std::uint64_t element_size;
+        std::uint64_t segment_count;
+        std::uint64_t chain_id; // shared by a full snapshot and its deltas
+        std::uint64_t sequence; // 0 for the full snapshot, then one per delta
+        std::uint64_t reserved;
+    };
+
+    static_assert(sizeof(_snapshot_file_header) == 64, "snapshot header layout changed");
+
+
+    struct _snapshot_segment_entry
+    {
+        static constexpr std::uint64_t referenced_block = ~std::uint64_t(0);
+        static constexpr std::uint64_t unversioned = ~std::uint64_t(0);
+
+        std::uint64_t offset; // from the start of the file, or referenced_block
+        std::uint64_t count; // elements
+        std::uint64_t key; // storage id at write time
+        std::uint64_t generation; // storage generation at write time, or unversioned
+    };
+
+
+    namespace _snapshot_file_detail
+    {
+        inline void write_all(int fd, const void * data, size_t bytes, const std::string& path)
+        {
+            const char * pos = static_cast<const char*>(data);
+            while (bytes)
+            {
+                ssize_t written = ::write(fd, pos, bytes);
+                if (written < 0 && errno == EINTR)
+                    continue;
+                if (written < 0)
+                    throw std::system_error(errno, std::generic_category(), "write " + path);
+                pos += written;
+                bytes -= written;
+            }
+        }
+
+
+        // Returns false at end of file
+        inline bool read_all(int fd, void * data, size_t bytes, off_t offset, const std::string& path)
+        {
+            char * pos = static_cast<char*>(data);
+            while (bytes)
+            {
+                ssize_t count = ::pread(fd, pos, bytes, offset);
+                if (count < 0 && errno == EINTR)
+                    continue;
+                if (count < 0)
+                    throw std::system_error(errno, std::generic_category(), "pread " + path);
+                if (count == 0)
+                    return false;
+                pos += count;
+                offset += count;
+                bytes -= count;
+            }
+            return true;
+        }
+
+
+        inline size_t align_up(size_t offset)
+        {
+            const size_t alignment = _snapshot_file_header::block_alignment;
+            return (offset + alignment - 1) / alignment * alignment;
+        }
+
+
+        inline size_t table_bytes(const _snapshot_file_header& header)
+        {
+            return header.segment_count * sizeof(_snapshot_segment_entry) + header.format_size;
+        }
+
+
+        // The segment table and struct code lie within the file. Checked before table_bytes is trusted.
+        inline bool table_fits(const _snapshot_file_header& header, size_t file_size)
+        {
+            return header.magic == _snapshot_file_header::magic_value && file_size >= sizeof(header) &&
+                   header.segment_count <= file_size / sizeof(_snapshot_segment_entry) &&
+                   table_bytes(header) <= file_size - sizeof(header);
+        }
+
+
+        // Checks the header and table against T and the file size
+        template <typename T>
+        bool validate(const _snapshot_file_header& header, const _snapshot_segment_entry * table, const char * format,
+                      size_t file_size)
+        {
+            const char * expected_format = pybuffer_container_detail::get_py_struct_code<T>();
+            if (header.magic != _snapshot_file_header::magic_value ||
+                header.version != _snapshot_file_header::current_version ||
+                header.signature != layout_signature<T>() ||
+                header.element_size != sizeof(T) ||
+                header.format_size != std::strlen(expected_format) ||
+                std::memcmp(format, expected_format, header.format_size) != 0)
+                return false;
+
+            for (size_t segment = 0; segment < header.segment_count; ++segment)
+            {
+                const _snapshot_segment_entry& entry = table[segment];
+                if (entry.offset == _snapshot_segment_entry::referenced_block)
+                {
+                    // Only deltas refer back
+                    if (header.sequence == 0)
+                        return false;
+                    continue;
+                }
+                if (entry.offset % _snapshot_file_header::block_alignment != 0 || entry.offset > file_size ||
+                    entry.count > (file_size - entry.offset) / sizeof(T))
+                    return false;
+            }
+            return true;
+        }
+
+
+        // Reads and validates the header and segment table of an open snapshot file
+        template <typename T>
+        bool read_table(int fd, const std::string& path, _snapshot_file_header& header,
+                        std::vector<_snapshot_segment_entry>& table)
+        {
+            struct stat file_stat;
+            if (::fstat(fd, &file_stat) != 0)
+                throw std::system_error(errno, std::generic_category(), "fstat " + path);
+            const size_t file_size = file_stat.st_size;
+
+            if (!read_all(fd, &header, sizeof(header), 0, path) || !table_fits(header, file_size))
+                return false;
+
+            std::vector<char> table_data(table_bytes(header));
+            if (!read_all(fd, table_data.data(), table_data.size(), sizeof(header), path))
+                return false;
+
+            table.resize(header.segment_count);
+            std::memcpy(table.data(), table_data.data(), table.size() * sizeof(_snapshot_segment_entry));
+            const char * format = table_data.data() + table.size() * sizeof(_snapshot_segment_entry);
+            return validate<T>(header, table.data(), format, file_size);
+        }
+
+
+        template <typename Segment, typename = void>
+        struct _has_generation: std::false_type
+        {};
+
+        template <typename Segment>
+        struct _has_generation<Segment, std::void_t<decltype(std::declval<const Segment&>()->generation())>>:
+            std::true_type
+        {};
+
+
+        // Storages without a modification count are never referenced by later deltas
+        template <typename Segment>
+        std::uint64_t storage_generation(const Segment& segment)
+        {
+            if constexpr (_has_generation<Segment>::value)
+                return segment->generation();
+            else
+                return _snapshot_segment_entry::unversioned;
+        }
+
+
+        inline std::uint64_t new_chain_id()
+        {
+            std::random_device random;
+            const std::uint64_t entropy = (std::uint64_t(random()) << 32) ^ random();
+            return entropy ^ std::chrono::steady_clock::now().time_since_epoch().count();
+        }
+
+
+        // Writes segments to path. Segments for which is_referenced(segment) holds are recorded by key only.
+        template <typename T, typename SegmentRange, typename Referenced>
+        void write_file(const std::string& path, const SegmentRange& segments, std::uint64_t chain_id,
+                        std::uint64_t sequence, Referenced&& is_referenced)
+        {
+            static_assert(std::is_trivially_copyable<T>::value, "snapshot files require trivially copyable T");
+
+            const char * format = pybuffer_container_detail::get_py_struct_code<T>();
+            _snapshot_file_header header = {};
+            header.magic = _snapshot_file_header::magic_value;
+            header.version = _snapshot_file_header::current_version;
+            header.format_size = static_cast<std::uint32_t>(std::strlen(format));
+            header.signature = layout_signature<T>();
+            header.element_size = sizeof(T);
+            header.segment_count = std::distance(std::begin(segments), std::end(segments));
+            header.chain_id = chain_id;
+            header.sequence = sequence;
+
+            std::vector<_snapshot_segment_entry> table;
+            table.reserve(header.segment_count);
+            size_t offset = align_up(sizeof(header) + table_bytes(header));
+            for (auto& segment: segments)
+            {
+                if (is_referenced(segment))
+                {
+                    table.push_back(_snapshot_segment_entry{_snapshot_segment_entry::referenced_block, segment->size(),
+                                                            segment->id(), storage_generation(segment)});
+                    continue;
+                }
+                table.push_back(_snapshot_segment_entry{offset, segment->size(), segment->id(),
+                                                        storage_generation(segment)});
+                offset = align_up(offset + segment->size() * sizeof(T));
+            }
+
+            const std::string temporary = path + ".tmp";
+            int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd < 0)
+                throw std::system_error(errno, std::generic_category(), "open " + temporary);
+
+            try
+            {
+                write_all(fd, &header, sizeof(header), temporary);
+                write_all(fd, table.data(), table.size() * sizeof(_snapshot_segment_entry), temporary);
+                write_all(fd, format, header.format_size, temporary);
+
+                // Padding is written as zeros rather than seeked over so the file has no holes
+                static const char zeros[_snapshot_file_header::block_alignment] = {};
+                size_t position = sizeof(header) + table_bytes(header);
+                size_t index = 0;
+                for (auto& segment: segments)
+                {
+                    const _snapshot_segment_entry& entry = table[index++];
+                    if (entry.offset == _snapshot_segment_entry::referenced_block)
+                        continue;
+                    write_all(fd, zeros, entry.offset - position, temporary);
+                    const size_t bytes = segment->size() * sizeof(T);
+                    write_all(fd, segment->data(), bytes, temporary);
+                    position = entry.offset + bytes;
+                }
+
+                if (::fsync(fd) != 0)
+                    throw std::system_error(errno, std::generic_category(), "fsync " + temporary);
+            }
+            catch (...)
+            {
+                ::close(fd);
+                ::unlink(temporary.c_str());
+                throw;
+            }
+
+            ::close(fd);
+            if (::rename(temporary.c_str(), path.c_str()) != 0)
+            {
+                int error = errno;
+                ::unlink(temporary.c_str());
+                throw std::system_error(error, std::generic_category(), "rename " + path);
+            }
+        }
+    }
+
+
+    // Writes segments to path as a full snapshot starting a new chain. SegmentRange is any range of pointers
+    // to storages with data(), size() and id(), for example the storage elements of a container_view. Errors
+    // are reported with std::system_error.
+    template <typename T, typename SegmentRange>
+    void save_snapshot(const std::string& path, const SegmentRange& segments)
+    {
+        _snapshot_file_detail::write_file<T>(path, segments, _snapshot_file_detail::new_chain_id(), 0,
+                                             [](const auto&) {return false;});
+    }
+
+
+    // Writes a chain of snapshots of successive views: a full snapshot first, then deltas holding only the
+    // segments that were not in the previously written view with the same storage id and generation. A storage
+    // modified in place keeps its id but advances its generation, so it is written again. Storages without a
+    // generation() are written in full every time. The writer keeps the segments of the last written view
+    // referenced so their ids cannot be reused. Segment ranges must hold shared_ptrs. Ids are process local, so
+    // a chain is written by one process; after a restart call reset() or use a new writer to begin a new chain.
+    template <typename T>
+    class snapshot_chain_writer
+    {
+    public:
+        snapshot_chain_writer():
+        m_chain_id(_snapshot_file_detail::new_chain_id()),
+        m_next_sequence(0)
+        {}
+
+        // Returns the sequence number written, 0 for a full snapshot
+        template <typename SegmentRange>
+        std::uint64_t write(const std::string& path, const SegmentRange& segments)
+        {
+            const std::uint64_t sequence = m_next_sequence;
+            _snapshot_file_detail::write_file<T>(path, segments, m_chain_id, sequence, [&](const auto& segment) {
+                const std::uint64_t generation = _snapshot_file_detail::storage_generation(segment);
+                if (!sequence || generation == _snapshot_segment_entry::unversioned)
+                    return false;
+                auto found = m_written.find(segment->id());
+                return found != m_written.end() && found->second.first == generation;
+            });
+
+            std::unordered_map<size_t, std::pair<std::uint64_t, std::shared_ptr<const void>>> written;
+            for (auto& segment: segments)
+                written.emplace(segment->id(), std::make_pair(_snapshot_file_detail::storage_generation(segment),
+                                                              std::shared_ptr<const void>(segment)));
+            m_written.swap(written);
+            m_next_sequence = sequence + 1;
+            return sequence;
+        }
+
+        // The next write starts a new chain with a full snapshot
+        void reset()
+        {
+            m_chain_id = _snapshot_file_detail::new_chain_id();
+            m_next_sequence = 0;
+            m_written.clear();
+        }
+
+        std::uint64_t chain_id() const
+        {
+            return m_chain_id;
+        }
+
+    private:
+        std::uint64_t m_chain_id;
+        std::uint64_t m_next_sequence;
+        // (generation, storage) of the last written view, keyed by storage id
+        std::unordered_map<size_t, std::pair<std::uint64_t, std::shared_ptr<const void>>> m_written;
+    };
+
+
+    // Restores the view written last in a chain. paths holds the full snapshot followed by every delta after it,
+    // in order. Blocks are read with one pread per segment straight into new storages made by creator, and
+    // segments unchanged between files are shared rather than read again. Returns false, leaving segments empty,
+    // if a file is not a snapshot of T, is truncated, or does not follow the previous file in the same chain.
+    template <typename T, typename Allocator>
+    bool load_snapshot_chain(const std::vector<std::string>& paths, pybuffer_storage_creator<T, Allocator>& creator,
+                             std::vector<typename pybuffer_storage_creator<T, Allocator>::shared_t>& segments)
+    {
+        typedef typename pybuffer_storage_creator<T, Allocator>::storage_t storage_t;
+        typedef typename pybuffer_storage_creator<T, Allocator>::shared_t shared_t;
+        using namespace _snapshot_file_detail;
+        segments.clear();
+
+        // (generation, storage) of the previous file's segments by key
+        std::unordered_map<std::uint64_t, std::pair<std::uint64_t, shared_t>> previous;
+        std::uint64_t chain_id = 0;
+        for (size_t file_index = 0; file_index < paths.size(); ++file_index)
+        {
+            const std::string& path = paths[file_index];
+            int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                throw std::system_error(errno, std::generic_category(), "open " + path);
+
+            bool valid = true;
+            try
+            {
+                _snapshot_file_header header = {};
+                std::vector<_snapshot_segment_entry> table;
+                valid = read_table<T>(fd, path, header, table) && header.sequence == file_index &&
+                        (file_index == 0 || header.chain_id == chain_id);
+                if (valid)
+                    chain_id = header.chain_id;
+
+                ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+                std::vector<shared_t> current;
+                current.reserve(table.size());
+                for (size_t index = 0; valid && index < table.size(); ++index)
+                {
+                    const _snapshot_segment_entry& entry = table[index];
+                    if (entry.offset == _snapshot_segment_entry::referenced_block)
+                    {
+                        auto found = previous.find(entry.key);
+                        valid = found != previous.end() && found->second.first == entry.generation &&
+                                entry.generation != _snapshot_segment_entry::unversioned &&
+                                found->second.second->size() == entry.count;
+                        if (valid)
+                            current.push_back(found->second.second);
+                        continue;
+                    }
+
+                    auto storage = std::static_pointer_cast<storage_t>(creator());
+                    storage->resize(entry.count);
+                    valid = !entry.count || read_all(fd, storage->mutable_data(), entry.count * sizeof(T), entry.offset,
+                                                     path);
+                    current.push_back(storage);
+                }
+
+                if (valid)
+                {
+                    previous.clear();
+                    for (size_t index = 0; index < table.size(); ++index)
+                        previous.emplace(table[index].key, std::make_pair(table[index].generation, current[index]));
+                    segments.swap(current);
+                }
+            }
+            catch (...)
+            {
+                segments.clear();
+                ::close(fd);
+                throw;
+            }
+
+            ::close(fd);
+            if (!valid)
+            {
+                segments.clear();
+                return false;
+            }
+        }
+        return true;
+    }
+
+
+    // Reads a full snapshot into new storages made by creator, one pread per segment straight into the storage's
+    // buffer. Returns false, leaving segments empty, if the file is not a full snapshot of T or is truncated.
+    template <typename T, typename Allocator>
+    bool load_snapshot(const std::string& path, pybuffer_storage_creator<T, Allocator>& creator,
+                       std::vector<typename pybuffer_storage_creator<T, Allocator>::shared_t>& segments)
+    {
+        return load_snapshot_chain(std::vector<std::string>{path}, creator, segments);
+    }
+
+
+    // A snapshot file mapped read only. Segments are served straight from the page cache, so a load costs
+    // only the validation and pages are read on first access. Export a segment through
+    // PyBufferRegionWrapper with the mapping as owner, or materialize it into a mutable storage.
+    template <typename T>
+    class snapshot_mapping
+    {
+    public:
+        typedef std::shared_ptr<const snapshot_mapping<T>> shared_t;
+
+        // Returns an empty pointer if the file is not a snapshot of T, is truncated or refers back to an earlier
+        // file of its chain
+        static shared_t open(const std::string& path)
+        {
+            using namespace _snapshot_file_detail;
+            auto file = mapped_file::open(path, false, false);
+            const size_t file_size = file->size();
+            if (file_size < sizeof(_snapshot_file_header))
+                return shared_t();
+
+            auto base = static_cast<const char*>(file->data());
+            _snapshot_file_header header;
+            std::memcpy(&header, base, sizeof(header));
+            if (!table_fits(header, file_size))
+                return shared_t();
+
+            std::vector<_snapshot_segment_entry> table(header.segment_count);
+            std::memcpy(table.data(), base + sizeof(header), table.size() * sizeof(_snapshot_segment_entry));
+            const char * format = base + sizeof(header) + table.size() * sizeof(_snapshot_segment_entry);
+            if (!validate<T>(header, table.data(), format, file_size))
+                return shared_t();
+            for (auto& entry: table)
+                if (entry.offset == _snapshot_segment_entry::referenced_block)
+                    return shared_t();
+
+            return shared_t(new snapshot_mapping<T>(std::move(file), std::move(table)));
+        }
+
+        size_t segment_count() const
+        {
+            return m_table.size();
+        }
+
+        const T * segment_data(size_t segment) const
+        {
+            return reinterpret_cast<const T*>(static_cast<const char*>(m_file->data()) + m_table[segment].offset);
+        }
+
+        size_t segment_size(size_t segment) const
+        {
+            return m_table[segment].count;
+        }
+
+        // Copies a segment into a new storage made by creator
+        template <typename Creator>
+        typename Creator::shared_base_t materialize(size_t segment, Creator& creator) const
+        {
+            const T * data = segment_data(segment);
+            return creator(data, data + segment_size(segment));
+        }
+
+        // Hint that every segment will be read soon
+        void prefetch() const
+        {
+            m_file->advise(MADV_WILLNEED);
+        }
+
+    private:
+        snapshot_mapping(std::unique_ptr<mapped_file> file, std::vector<_snapshot_segment_entry> table):
+        m_file(std::move(file)),
+        m_table(std::move(table))
+        {}
+
+        std::unique_ptr<mapped_file> m_file;
+        std::vector<_snapshot_segment_entry> m_table;
+    };
+}
@@ -0,0 +1,248 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2020 Kuberan Naganathan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <typeinfo>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <cxxabi.h>
+
+
+// Per element type counters for the copy and export paths. Counting is compiled in only when the build
+// defines PYBUFFER_STATS (scons stats=1); otherwise PYBUFFER_STAT expands to nothing. Each thread adds to
+// its own block of counters with plain relaxed stores, so the hot path takes no lock and no atomic read
+// modify write. read_storage_stats sums the blocks of every thread when asked. Outstanding exports are also
+// kept per storage id, under a lock, since an export and its release may happen on different threads.
+
+
+namespace pybuffer_container
+{
+    enum storage_stat
+    {
+        stat_storage_created,
+        stat_storage_copies, // copy() calls, aliasing or not
+        stat_bytes_copied, // element bytes copied into new buffers by copy() and copy on write
+        stat_elements_shifted, // elements moved to open or close a gap by insert, remove and apply_batch
+        stat_locate_hits,
+        stat_locate_misses,
+        stat_buffer_exports,
+        stat_buffer_releases,
+        storage_stat_count
+    };
+
+
+    inline const char * storage_stat_name(storage_stat stat)
+    {
+        static const char * names[storage_stat_count] = {
+            "storage_created", "storage_copies", "bytes_copied", "elements_shifted",
+            "locate_hits", "locate_misses", "buffer_exports", "buffer_releases"
+        };
+        return names[stat];
+    }
+
+
+    struct storage_stats
+    {
+        std::string m_type; // demangled element type name
+        std::uint64_t m_counters[storage_stat_count];
+        std::vector<std::pair<size_t, std::uint64_t>> m_exports_by_storage; // storage id, outstanding exports
+
+        std::uint64_t outstanding_exports() const
+        {
+            return m_counters[stat_buffer_exports] - m_counters[stat_buffer_releases];
+        }
+    };
+}
+
+
+namespace pybuffer_container_detail
+{
+    // Written only by the thread that holds it. A thread's blocks go back to a free list when it exits
+    // and are handed to the next new thread with their counts intact, so totals never go backwards and
+    // the number of blocks is bounded by the peak thread count.
+    struct _stats_block
+    {
+        std::atomic<std::uint64_t> m_counters[pybuffer_container::storage_stat_count] = {};
+    };
+
+
+    struct _stats_type
+    {
+        std::string m_name;
+        std::vector<std::unique_ptr<_stats_block>> m_blocks;
+        std::vector<_stats_block*> m_free;
+        std::mutex m_exports_mutex;
+        std::unordered_map<size_t, std::uint64_t> m_exports; // by storage id, only storages with exports
+    };
+
+
+    // Blocks and types are never freed so a late counter update from a thread being torn down stays safe
+    struct _stats_registry
+    {
+        std::mutex m_mutex;
+        std::vector<std::unique_ptr<_stats_type>> m_types;
+
+        static _stats_registry& instance()
+        {
+            static _stats_registry * registry = new _stats_registry;
+            return *registry;
+        }
+
+        _stats_type * add_type(const char * mangled_name)
+        {
+            int status = 0;
+            char * demangled = abi::__cxa_demangle(mangled_name, nullptr, nullptr, &status);
+            std::unique_ptr<_stats_type> type(new _stats_type);
+            type->m_name = status == 0 ? demangled : mangled_name;
+            std::free(demangled);
+
+            std::lock_guard<std::mutex> guard(m_mutex);
+            m_types.push_back(std::move(type));
+            return m_types.back().get();
+        }
+
+        _stats_block * acquire(_stats_type * type)
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            if (!type->m_free.empty())
+            {
+                _stats_block * block = type->m_free.back();
+                type->m_free.pop_back();
+                return block;
+            }
+            type->m_blocks.emplace_back(new _stats_block);
+            return type->m_blocks.back().get();
+        }
+
+        void release(_stats_type * type, _stats_block * block)
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            type->m_free.push_back(block);
+        }
+    };
+
+
+    // Returns the calling thread's blocks to the registry on thread exit
+    struct _stats_thread
+    {
+        std::vector<std::pair<_stats_type*, _stats_block*>> m_blocks;
+
+        ~_stats_thread()
+        {
+            for (auto& held: m_blocks)
+                _stats_registry::instance().release(held.first, held.second);
+        }
+
+        static _stats_block * attach(_stats_type * type)
+        {
+            static thread_local _stats_thread thread;
+            _stats_block * block = _stats_registry::instance().acquire(type);
+            thread.m_blocks.emplace_back(type, block);
+            return block;
+        }
+    };
+
+
+    template <typename T>
+    _stats_type * _stats_type_for()
+    {
+        static _stats_type * type = _stats_registry::instance().add_type(typeid(T).name());
+        return type;
+    }
+
+
+    template <typename T>
+    inline void stats_add(pybuffer_container::storage_stat stat, std::uint64_t amount)
+    {
+        // Trivially initialized so access needs no guard
+        static thread_local _stats_block * block = nullptr;
+        if (!block)
+            block = _stats_thread::attach(_stats_type_for<T>());
+        auto& counter = block->m_counters[stat];
+        counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+
+    template <typename T>
+    inline void stats_export(size_t storage_id, bool exported)
+    {
+        _stats_type * type = _stats_type_for<T>();
+        std::lock_guard<std::mutex> guard(type->m_exports_mutex);
+        if (exported)
+        {
+            ++type->m_exports[storage_id];
+            return;
+        }
+        auto entry = type->m_exports.find(storage_id);
+        if (entry != type->m_exports.end() && --entry->second == 0)
+            type->m_exports.erase(entry);
+    }
+}
+
+
+#ifdef PYBUFFER_STATS
+#define PYBUFFER_STAT(T, stat, amount) \
+    pybuffer_container_detail::stats_add<T>(pybuffer_container::stat, static_cast<std::uint64_t>(amount))
+// Counts an export (exported true) or a release of the storage with storage_id
+#define PYBUFFER_STAT_EXPORT(T, storage_id, exported) \
+    pybuffer_container_detail::stats_export<T>(storage_id, exported)
+#else
+// sizeof keeps the arguments referenced without evaluating them
+#define PYBUFFER_STAT(T, stat, amount) do { (void)sizeof(amount); } while (false)
+#define PYBUFFER_STAT_EXPORT(T, storage_id, exported) do { (void)sizeof(storage_id); } while (false)
+#endif
+
+
+namespace pybuffer_container
+{
+    // Totals for every element type that has counted anything. Counts from other threads may lag by the
+    // updates they are making while this runs. Empty when built without PYBUFFER_STATS.
+    inline std::vector<storage_stats> read_storage_stats()
+    {
+        using namespace pybuffer_container_detail;
+        auto& registry = _stats_registry::instance();
+        std::lock_guard<std::mutex> guard(registry.m_mutex);
+
+        std::vector<storage_stats> result;
+        for (auto& type: registry.m_types)
+        {
+            storage_stats stats{type->m_name, {}, {}};
+            for (auto& block: type->m_blocks)
+                for (size_t stat = 0; stat < storage_stat_count; ++stat)
+                    stats.m_counters[stat] += block->m_counters[stat].load(std::memory_order_relaxed);
+            {
+                std::lock_guard<std::mutex> exports_guard(type->m_exports_mutex);
+                stats.m_exports_by_storage.assign(type->m_exports.begin(), type->m_exports.end());
+            }
+            result.push_back(std::move(stats));
+        }
+        return result;
+    }
+}
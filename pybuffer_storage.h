@@ -23,15 +23,41 @@
  */
 # pragma once
 #include <snapshot_container/snapshot_storage.h>
+#include "pybuffer_pin_tracker.h"
+#include "pybuffer_stats.h"
+#include <cstdint>
 #include <vector>
 #include <memory>
 #include <unordered_map>
 #include <mutex>
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
 
 
 namespace pybuffer_container
 {
+    // One edit of a batch applied with vector_storage::apply_batch. position is an index into the storage as it
+    // was before the batch. An insert places count elements read from values before the element at position,
+    // a remove drops the count elements starting at position.
     template <typename T>
+    struct storage_edit
+    {
+        enum op_t
+        {
+            insert,
+            remove
+        };
+
+        op_t op;
+        size_t position;
+        size_t count;
+        const T * values;
+    };
+
+
+    // Allocator is used for both the element buffer and, through create, the shared_ptr control block.
+    template <typename T, typename Allocator = std::allocator<T>>
     class vector_storage: public snapshot_container::storage_base<T, 48, virtual_iter::rand_iter<T, 48>>
     {
     public:
@@ -42,10 +68,13 @@ namespace pybuffer_container
             // TODO: Refactor out the commonality if possible.
 
         static const size_t npos = 0xFFFFFFFFFFFFFFFF;
+        static const size_t share_fraction = 4;
         typedef typename snapshot_container::storage_base<T, 48, virtual_iter::rand_iter<T,48>> storage_base_t;
         using storage_base_t::iter_mem_size;
         typedef T value_type;
-        typedef std::shared_ptr<vector_storage<T>> shared_t;
+        typedef Allocator allocator_type;
+        typedef std::vector<T, Allocator> data_type;
+        typedef std::shared_ptr<vector_storage<T, Allocator>> shared_t;
         typedef std::shared_ptr<storage_base_t> shared_base_t;
         using fwd_iter_type = typename storage_base_t::fwd_iter_type;
         using rand_iter_type = typename storage_base_t::rand_iter_type;
@@ -53,97 +82,134 @@ namespace pybuffer_container
 
         void append(const T& value) override
         {
-            m_data.push_back (value);
+            exclusive_data().push_back(value);
         }
 
         void append(const fwd_iter_type& start_pos, const fwd_iter_type& end_pos) override
         {
-            fwd_iter_type start_pos_copy(start_pos);
-
-            std::function<bool(const value_type& v)> f =
-                    [this](const value_type& v)
-                    {
-                        m_data.push_back (v);
-                        return true;
-                    };
-
-            start_pos_copy.visit (end_pos, f);
+            // The same range insert as the fwd_iter insert below rather than a std::function call per element
+            data_type& data = exclusive_data();
+            data.insert(data.end(), start_pos, end_pos);
         }
 
         void append(const rand_iter_type& start_pos, const rand_iter_type& end_pos) override
         {
-            for (auto current_pos = start_pos; current_pos != end_pos; ++current_pos)
-                m_data.push_back(*current_pos);
+            // Virtual iterators do not expose whether the source is contiguous so elements are still
+            // read one at a time, but the span size is known up front and the buffer grows only once.
+            data_type& data = exclusive_data();
+            data.insert(data.end(), start_pos, end_pos);
+        }
+
+        // Bulk append from a contiguous source, for callers holding raw records. snapshot_container only
+        // reaches the virtual overloads above. For trivially copyable T this is one reserve and one memmove.
+        void append(const T * start_pos, const T * end_pos)
+        {
+            insert(size(), start_pos, end_pos);
         }
 
+        // Ranges covering at least 1 / share_fraction of the source buffer alias it instead of copying.
+        // Smaller ranges are copied so a short lived slice does not pin a large buffer.
         shared_base_t copy(size_t start_index = 0, size_t end_index = npos) const override;
 
         void insert(size_t index, const T& value) override
         {
-            m_data.insert (m_data.begin () + index, value);
+            data_type& data = exclusive_data();
+            PYBUFFER_STAT(T, stat_elements_shifted, data.size() - index);
+            data.insert (data.begin () + index, value);
         }
 
         void insert(size_t index, const fwd_iter_type& start_pos, const fwd_iter_type& end_pos) override
         {
-            m_data.insert(m_data.begin() + index, start_pos, end_pos);
+            data_type& data = exclusive_data();
+            PYBUFFER_STAT(T, stat_elements_shifted, data.size() - index);
+            data.insert(data.begin() + index, start_pos, end_pos);
         }
 
         void insert(size_t index, const rand_iter_type& start_pos, const rand_iter_type& end_pos) override
         {
-            m_data.insert(m_data.begin() + index, start_pos, end_pos);
+            data_type& data = exclusive_data();
+            PYBUFFER_STAT(T, stat_elements_shifted, data.size() - index);
+            data.insert(data.begin() + index, start_pos, end_pos);
+        }
+
+        // Bulk insert from a contiguous source. The tail is shifted once and the span copied as raw memory.
+        void insert(size_t index, const T * start_pos, const T * end_pos)
+        {
+            if (start_pos == end_pos)
+                return;
+            data_type& data = exclusive_data();
+            PYBUFFER_STAT(T, stat_elements_shifted, data.size() - index);
+            data.insert(data.begin() + index, start_pos, end_pos);
         }
 
+        // Applies a batch of inserts and removes in one pass over the elements, so the cost is O(size + edits)
+        // rather than one tail shift per edit. Edits are ordered by position and each must start at or after
+        // the end of the previous remove. Inserts at the same position land in batch order, and an insert
+        // followed by a remove at the same position replaces elements. values must not point into this storage.
+        // A batch of only empty edits, or no edits, leaves the storage untouched and its buffer shared.
+        // Throws std::invalid_argument, leaving the storage untouched, if an edit is out of order, overlaps a
+        // previous remove, is out of range, has an unknown op or inserts count > 0 elements from null values.
+        void apply_batch(const std::vector<storage_edit<T>>& edits);
+
         void remove(size_t index) override
         {
-            m_data.erase(m_data.begin() + index);
+            data_type& data = exclusive_data();
+            PYBUFFER_STAT(T, stat_elements_shifted, data.size() - index - 1);
+            data.erase(data.begin() + index);
         }
 
         void remove(size_t start_index, size_t end_index) override
         {
-            m_data.erase(m_data.begin() + start_index, m_data.begin() + end_index);
+            data_type& data = exclusive_data();
+            PYBUFFER_STAT(T, stat_elements_shifted, data.size() - end_index);
+            data.erase(data.begin() + start_index, data.begin() + end_index);
+        }
+
+        // Grows or shrinks to count elements. New elements are value initialized, e.g. for filling through
+        // mutable_data() from a file.
+        void resize(size_t count)
+        {
+            exclusive_data().resize(count);
         }
 
         size_t size() const override
-        {return m_data.size ();}
+        {return (m_end == npos ? m_buffer->size() : m_end) - m_offset;}
 
         const T& operator[](size_t index) const override
-        {return m_data[index];}
+        {return (*m_buffer)[m_offset + index];}
 
+        // Counts as a mutation, so it detaches from a shared buffer. Read through a const reference instead.
         T& operator[](size_t index) override
-        {return m_data[index];}
+        {return exclusive_data()[index];}
 
         const storage_iter_type begin() const override
         {
-            return storage_iter_type(_iter_impl, m_data.begin());
+            return storage_iter_type(_iter_impl, view_begin());
         }
 
         const storage_iter_type end() const override
         {
-            return storage_iter_type(_iter_impl, m_data.end());
+            return storage_iter_type(_iter_impl, view_begin() + size());
         }
 
         const storage_iter_type iterator(size_t offset) const override
         {
-            if (offset > m_data.size())
-                offset = m_data.size();
-            return storage_iter_type(_iter_impl, m_data.begin() + offset);
+            return storage_iter_type(_iter_impl, view_begin() + std::min(offset, size()));
         }
 
         storage_iter_type begin() override
         {
-            return storage_iter_type(_iter_impl, m_data.begin());
+            return storage_iter_type(_iter_impl, view_begin());
         }
 
         storage_iter_type end() override
         {
-            return storage_iter_type(_iter_impl, m_data.end());
+            return storage_iter_type(_iter_impl, view_begin() + size());
         }
 
         storage_iter_type iterator(size_t offset) override
         {
-            if (offset > m_data.size())
-                offset = m_data.size();
-            return storage_iter_type(_iter_impl, m_data.begin() + offset);
+            return storage_iter_type(_iter_impl, view_begin() + std::min(offset, size()));
         }
 
         size_t id() const override
@@ -151,110 +217,460 @@ namespace pybuffer_container
             return m_storage_id;
         }
 
-        static shared_t create();
+        static shared_t create(const Allocator& allocator = Allocator());
 
         template <typename InputIter>
-        static shared_t create(InputIter start_pos, InputIter end_pos);
+        static shared_t create(InputIter start_pos, InputIter end_pos, const Allocator& allocator = Allocator());
 
         // The copy constructors should never be called. All construction is through the storage creator mechanism
-        vector_storage(const vector_storage<T>& rhs) = delete;
-        vector_storage(vector_storage<T>&& rhs) = delete;
+        vector_storage(const vector_storage<T, Allocator>& rhs) = delete;
+        vector_storage(vector_storage<T, Allocator>&& rhs) = delete;
 
         // access to underlying buffer. Should only be accessed from a snapshot and will only be valid
         // while the provider snapshot is live.
         const T* data() const
         {
-            return m_data.data();
+            return m_buffer->data() + m_offset;
+        }
+
+        // Mutable access for writable buffer exports. Takes a private copy first if the buffer is shared with
+        // another storage. Callers must hold the only reference to this storage since snapshots sharing it
+        // would otherwise observe the writes.
+        T* mutable_data()
+        {
+            return exclusive_data().data();
+        }
+
+        // Advances with every mutation and with the release of every writable buffer export. Storages keep
+        // their id when modified in place, so id() and generation() together identify the contents, which
+        // is what snapshot_chain_writer compares before referencing an earlier copy of a segment.
+        std::uint64_t generation() const
+        {
+            return m_generation;
+        }
+
+        // For writes through a pointer obtained from mutable_data() after the fact
+        void mark_modified()
+        {
+            ++m_generation;
+        }
+
+        // Accounting for buffer exports of this storage. Set by pybuffer_storage_creator and inherited by
+        // copies. Empty for storages made directly with create.
+        const std::shared_ptr<buffer_pin_tracker>& pin_tracker() const
+        {
+            return m_pin_tracker;
+        }
+
+        void set_pin_tracker(const std::shared_ptr<buffer_pin_tracker>& tracker)
+        {
+            m_pin_tracker = tracker;
         }
 
-        vector_storage():
+        // The buffer an export of this storage keeps alive, shared by every storage aliasing it, and its
+        // allocated size. Exports are pinned under these so the tracker counts what is really held.
+        const void * pin_key() const
+        {
+            return m_buffer.get();
+        }
+
+        size_t pin_bytes() const
+        {
+            return m_buffer->capacity() * sizeof(T);
+        }
+
+        // True when this storage is the only user of its whole buffer, so mutations happen in place. Otherwise
+        // the first mutation copies the visible range into a buffer of its own.
+        bool is_exclusive() const
+        {
+            return m_offset == 0 && m_end == npos && m_buffer.use_count() == 1;
+        }
+
+        explicit vector_storage(const Allocator& allocator = Allocator()):
+        m_buffer(std::allocate_shared<data_type>(allocator, allocator)),
+        m_offset(0),
+        m_end(npos),
         m_storage_id(storage_base_t::generate_storage_id())
-        {}
+        {
+            PYBUFFER_STAT(T, stat_storage_created, 1);
+        }
 
         template <typename InputIter>
-        vector_storage(InputIter start_pos, InputIter end_pos);
+        vector_storage(InputIter start_pos, InputIter end_pos, const Allocator& allocator = Allocator());
+
+        // Aliases elements [start_index, end_index) of buffer
+        vector_storage(const std::shared_ptr<data_type>& buffer, size_t start_index, size_t end_index):
+        m_buffer(buffer),
+        m_offset(start_index),
+        m_end(end_index),
+        m_storage_id(storage_base_t::generate_storage_id())
+        {
+            PYBUFFER_STAT(T, stat_storage_created, 1);
+        }
 
     private:
-        static virtual_iter::std_rand_iter_impl<typename std::vector<value_type>::const_iterator, iter_mem_size> _iter_impl;
-        std::vector<T> m_data;
+        // A run of the final layout: count elements at target come from values or, when values is null,
+        // from the surviving elements at source
+        struct _batch_piece
+        {
+            const T * values;
+            size_t source;
+            size_t count;
+            size_t target;
+        };
+
+        typename data_type::const_iterator view_begin() const
+        {
+            return m_buffer->cbegin() + m_offset;
+        }
+
+        // The buffer to mutate. A shared buffer is copied first; a buffer this storage holds alone but only
+        // partly covers is trimmed in place. m_end is npos only when m_offset is 0.
+        // Every mutation goes through here except apply_batch, which advances m_generation itself
+        data_type& exclusive_data()
+        {
+            ++m_generation;
+            if (m_end != npos || m_buffer.use_count() != 1)
+                take_buffer();
+            return *m_buffer;
+        }
+
+        void take_buffer();
+
+        static virtual_iter::std_rand_iter_impl<typename data_type::const_iterator, iter_mem_size> _iter_impl;
+        std::shared_ptr<data_type> m_buffer;
+        size_t m_offset;
+        size_t m_end; // npos while the storage covers its buffer up to the end
         size_t m_storage_id;
+        std::uint64_t m_generation = 0;
+        std::shared_ptr<buffer_pin_tracker> m_pin_tracker;
     };
 
 
-    template <typename T>
+    template <typename T, typename Allocator>
     template <typename InputIter>
-    vector_storage<T>::vector_storage(InputIter start_pos, InputIter end_pos):
-        m_data (start_pos, end_pos),
+    vector_storage<T, Allocator>::vector_storage(InputIter start_pos, InputIter end_pos, const Allocator& allocator):
+        m_buffer(std::allocate_shared<data_type>(allocator, start_pos, end_pos, allocator)),
+        m_offset(0),
+        m_end(npos),
         m_storage_id(storage_base_t::generate_storage_id())
-    {}
+    {
+        PYBUFFER_STAT(T, stat_storage_created, 1);
+    }
 
 
-    template <typename T>
-    typename vector_storage<T>::shared_base_t vector_storage<T>::copy(size_t start_index, size_t end_index) const
+    template <typename T, typename Allocator>
+    void vector_storage<T, Allocator>::take_buffer()
+    {
+        if (m_buffer.use_count() != 1)
+        {
+            PYBUFFER_STAT(T, stat_bytes_copied, size() * sizeof(T));
+            auto first = view_begin();
+            m_buffer = std::allocate_shared<data_type>(m_buffer->get_allocator(), first, first + size(),
+                                                       m_buffer->get_allocator());
+        }
+        else
+        {
+            if (m_offset)
+                PYBUFFER_STAT(T, stat_elements_shifted, size());
+            m_buffer->erase(m_buffer->begin() + m_end, m_buffer->end());
+            m_buffer->erase(m_buffer->begin(), m_buffer->begin() + m_offset);
+        }
+        m_offset = 0;
+        m_end = npos;
+    }
+
+
+    template <typename T, typename Allocator>
+    void vector_storage<T, Allocator>::apply_batch(const std::vector<storage_edit<T>>& edits)
+    {
+        const size_t old_size = size();
+        std::vector<_batch_piece> pieces;
+        pieces.reserve(edits.size() * 2 + 1);
+
+        size_t source = 0, target = 0;
+        bool changes = false;
+        for (auto& edit: edits)
+        {
+            if (edit.op != storage_edit<T>::insert && edit.op != storage_edit<T>::remove)
+                throw std::invalid_argument("vector_storage::apply_batch: unknown edit operation");
+            if (edit.op == storage_edit<T>::insert && edit.count && !edit.values)
+                throw std::invalid_argument("vector_storage::apply_batch: insert without values");
+            if (edit.position < source)
+                throw std::invalid_argument("vector_storage::apply_batch: edits out of order or overlapping");
+            if (edit.position > old_size ||
+                (edit.op == storage_edit<T>::remove && edit.count > old_size - edit.position))
+                throw std::invalid_argument("vector_storage::apply_batch: edit out of range");
+            changes = changes || edit.count;
+
+            if (edit.position > source)
+            {
+                pieces.push_back(_batch_piece{nullptr, source, edit.position - source, target});
+                target += edit.position - source;
+                source = edit.position;
+            }
+
+            if (edit.op == storage_edit<T>::insert)
+            {
+                if (edit.count)
+                    pieces.push_back(_batch_piece{edit.values, 0, edit.count, target});
+                target += edit.count;
+            }
+            else
+            {
+                source += edit.count;
+            }
+        }
+        // Nothing to do, and a shared buffer must not be copied for it
+        if (!changes)
+            return;
+        // Both paths below edit m_buffer directly rather than through exclusive_data
+        ++m_generation;
+        if (source < old_size)
+            pieces.push_back(_batch_piece{nullptr, source, old_size - source, target});
+        const size_t new_size = target + old_size - source;
+
+        if (!is_exclusive() || new_size > m_buffer->capacity())
+        {
+            // A shared buffer is left alone and a full one has to reallocate anyway, so merge into a new
+            // buffer. Survivors are moved out of a buffer this storage owns and copied out of a shared one.
+            const bool owned = is_exclusive();
+            auto first = m_buffer->begin() + m_offset;
+            data_type merged(m_buffer->get_allocator());
+            merged.reserve(new_size);
+            size_t kept = 0;
+            for (auto& piece: pieces)
+            {
+                kept += piece.values ? 0 : piece.count;
+                if (piece.values)
+                    merged.insert(merged.end(), piece.values, piece.values + piece.count);
+                else if (owned)
+                    merged.insert(merged.end(), std::make_move_iterator(first + piece.source),
+                                  std::make_move_iterator(first + piece.source + piece.count));
+                else
+                    merged.insert(merged.end(), first + piece.source, first + piece.source + piece.count);
+            }
+            if (owned)
+                PYBUFFER_STAT(T, stat_elements_shifted, kept);
+            else
+                PYBUFFER_STAT(T, stat_bytes_copied, kept * sizeof(T));
+
+            if (owned)
+                m_buffer->swap(merged);
+            else
+                m_buffer = std::allocate_shared<data_type>(merged.get_allocator(), std::move(merged));
+            m_offset = 0;
+            m_end = npos;
+            return;
+        }
+
+        // In place. The final layout keeps survivors in order, so runs moving left can go front to back and
+        // runs moving right back to front without either overwriting a run that has not moved yet. The
+        // inserted values then fill the gaps.
+        data_type& data = *m_buffer;
+        if (new_size > old_size)
+            data.resize(new_size);
+        auto base = data.begin();
+        size_t shifted = 0;
+        for (auto& piece: pieces)
+            if (!piece.values && piece.target < piece.source)
+            {
+                std::move(base + piece.source, base + piece.source + piece.count, base + piece.target);
+                shifted += piece.count;
+            }
+        for (auto piece = pieces.rbegin(); piece != pieces.rend(); ++piece)
+            if (!piece->values && piece->target > piece->source)
+            {
+                std::move_backward(base + piece->source, base + piece->source + piece->count,
+                                   base + piece->target + piece->count);
+                shifted += piece->count;
+            }
+        PYBUFFER_STAT(T, stat_elements_shifted, shifted);
+        for (auto& piece: pieces)
+            if (piece.values)
+                std::copy(piece.values, piece.values + piece.count, base + piece.target);
+        if (new_size < old_size)
+            data.erase(data.begin() + new_size, data.end());
+    }
+
+
+    template <typename T, typename Allocator>
+    typename vector_storage<T, Allocator>::shared_base_t vector_storage<T, Allocator>::copy(size_t start_index, size_t end_index) const
     {
         if (end_index == npos)
-            end_index = m_data.size();
+            end_index = size();
+        PYBUFFER_STAT(T, stat_storage_copies, 1);
 
-        auto new_storage = new vector_storage<T> (m_data.begin () + start_index, m_data.begin () + end_index);
-        return vector_storage<T>::shared_base_t (new_storage);
+        // The alias is read only until its first mutation, which copies the range out (see exclusive_data)
+        shared_t result;
+        if ((end_index - start_index) * share_fraction >= m_buffer->size() && end_index > start_index)
+        {
+            result = std::allocate_shared<vector_storage<T, Allocator>>(m_buffer->get_allocator(), m_buffer,
+                                                                        m_offset + start_index, m_offset + end_index);
+        }
+        else
+        {
+            PYBUFFER_STAT(T, stat_bytes_copied, (end_index - start_index) * sizeof(T));
+            result = create(view_begin() + start_index, view_begin() + end_index, m_buffer->get_allocator());
+        }
+        result->m_pin_tracker = m_pin_tracker;
+        return result;
     }
 
 
-    template <typename T>
-    typename vector_storage<T>::shared_t vector_storage<T>::create()
+    template <typename T, typename Allocator>
+    typename vector_storage<T, Allocator>::shared_t vector_storage<T, Allocator>::create(const Allocator& allocator)
     {
-        return std::make_shared<vector_storage<T>>();
+        return std::allocate_shared<vector_storage<T, Allocator>>(allocator, allocator);
     }
 
 
-    template <typename T>
+    template <typename T, typename Allocator>
     template <typename InputItr>
-    typename vector_storage<T>::shared_t vector_storage<T>::create(InputItr start_pos, InputItr end_pos)
+    typename vector_storage<T, Allocator>::shared_t vector_storage<T, Allocator>::create(InputItr start_pos, InputItr end_pos,
+                                                                                         const Allocator& allocator)
     {
-        return std::make_shared<vector_storage<T>>(start_pos, end_pos);
+        return std::allocate_shared<vector_storage<T, Allocator>>(allocator, start_pos, end_pos, allocator);
     }
 
 
-    template <typename T>
-    virtual_iter::std_rand_iter_impl<typename std::vector<T>::const_iterator, vector_storage<T>::iter_mem_size> vector_storage<T>::_iter_impl;
+    template <typename T, typename Allocator>
+    virtual_iter::std_rand_iter_impl<typename std::vector<T, Allocator>::const_iterator, vector_storage<T, Allocator>::iter_mem_size>
+    vector_storage<T, Allocator>::_iter_impl;
 
 
-    template <typename T>
+    template <typename T, typename Allocator = std::allocator<T>>
     struct vector_storage_creator
     {
-        typedef typename vector_storage<T>::shared_base_t shared_base_t;
+        typedef typename vector_storage<T, Allocator>::shared_base_t shared_base_t;
         shared_base_t operator() ()
         {
-            return shared_base_t(vector_storage<T>::create());
+            return shared_base_t(vector_storage<T, Allocator>::create());
         }
 
         template <typename IterType>
         shared_base_t operator() (IterType start_pos, IterType end_pos)
         {
-            return shared_base_t(vector_storage<T>::create(start_pos, end_pos));
+            return shared_base_t(vector_storage<T, Allocator>::create(start_pos, end_pos));
         }
     };
 
 
-    template <typename T>
-    struct _pybuffer_storage_control_block
+    // Registry of weak references to every storage made by a storage creator. The map is split into
+    // independently locked shards keyed by storage id so concurrent creators and locate calls rarely
+    // contend. Expired entries are erased by locate and by a sweep of a shard which runs once the number
+    // of inserts since its last sweep reaches half the shard's entry count, or min_sweep_interval for a
+    // small shard. The sweep is O(entries), so the cost stays amortized O(1) per insert.
+    template <typename StorageType>
+    struct _storage_registry
     {
-        std::mutex m_mutex;
-        std::unordered_map<size_t, std::weak_ptr<vector_storage<T>>> m_map;
+        typedef StorageType storage_t;
+        typedef std::shared_ptr<storage_t> shared_t;
+        static constexpr size_t shard_count = 64;
+        static constexpr size_t min_sweep_interval = 64;
+
+        struct alignas(64) shard
+        {
+            std::mutex m_mutex;
+            std::unordered_map<size_t, std::weak_ptr<storage_t>> m_map;
+            size_t m_inserts_since_sweep = 0;
+
+            // Caller must hold m_mutex
+            void sweep()
+            {
+                for (auto pos = m_map.begin(); pos != m_map.end();)
+                {
+                    if (pos->second.expired())
+                        pos = m_map.erase(pos);
+                    else
+                        ++pos;
+                }
+                m_inserts_since_sweep = 0;
+            }
+        };
+
+        void insert(const shared_t& storage)
+        {
+            auto& target = shard_for(storage->id());
+            std::lock_guard<std::mutex> guard(target.m_mutex);
+            target.m_map.emplace(storage->id(), std::weak_ptr<storage_t>(storage));
+            if (++target.m_inserts_since_sweep >= std::max(min_sweep_interval, target.m_map.size() / 2))
+                target.sweep();
+        }
+
+        shared_t locate(size_t id)
+        {
+            auto& target = shard_for(id);
+            std::lock_guard<std::mutex> guard(target.m_mutex);
+            auto result = target.m_map.find(id);
+            if (result == target.m_map.end())
+                return shared_t();
+
+            auto storage = result->second.lock();
+            if (!storage)
+                target.m_map.erase(result);
+            return storage;
+        }
+
+        // Erase every expired entry in all shards
+        void sweep()
+        {
+            for (auto& target: m_shards)
+            {
+                std::lock_guard<std::mutex> guard(target.m_mutex);
+                target.sweep();
+            }
+        }
+
+        // Number of registered entries including any expired ones not yet swept
+        size_t size()
+        {
+            size_t result = 0;
+            for (auto& target: m_shards)
+            {
+                std::lock_guard<std::mutex> guard(target.m_mutex);
+                result += target.m_map.size();
+            }
+            return result;
+        }
+
+    private:
+        shard& shard_for(size_t id)
+        {
+            // Storage ids are sequential so the low bits spread consecutive creations across shards
+            return m_shards[id % shard_count];
+        }
+
+        shard m_shards[shard_count];
     };
 
 
+    template <typename T, typename Allocator = std::allocator<T>>
+    using _pybuffer_storage_control_block = _storage_registry<vector_storage<T, Allocator>>;
+
+
     // Stateful storage creator with locate capability. Ideally this would be implemented with
     // a control block pointed at by std::atomic<std::shared_ptr>. This will need to wait for c++20
-    template <typename T>
+    template <typename T, typename Allocator = std::allocator<T>>
     struct pybuffer_storage_creator
     {
-        typedef typename vector_storage<T>::shared_base_t shared_base_t;
-        typedef typename vector_storage<T>::shared_t shared_t;
-        typedef _pybuffer_storage_control_block<T> control_t;
+        typedef vector_storage<T, Allocator> storage_t;
+        typedef typename storage_t::shared_base_t shared_base_t;
+        typedef typename storage_t::shared_t shared_t;
+        typedef _pybuffer_storage_control_block<T, Allocator> control_t;
 
         pybuffer_storage_creator():
-        m_control(std::make_shared<control_t>())
+        m_control(std::make_shared<control_t>()),
+        m_pin_tracker(std::make_shared<buffer_pin_tracker>())
+        {
+        }
+
+        // Every storage made by this creator allocates through a copy of allocator, e.g. a page_allocator
+        // carrying the creator's hugepage and NUMA policy
+        explicit pybuffer_storage_creator(const Allocator& allocator):
+        m_control(std::make_shared<control_t>()),
+        m_pin_tracker(std::make_shared<buffer_pin_tracker>()),
+        m_allocator(allocator)
         {
         }
 
@@ -264,39 +680,49 @@ namespace pybuffer_container
 
         shared_base_t operator() ()
         {
-            auto storage = vector_storage<T>::create();
-            auto shared_t_storage = std::static_pointer_cast<vector_storage<T>>(storage);
-            std::lock_guard<std::mutex> guard(m_control->m_mutex);
-            m_control->m_map.insert(std::pair<size_t, std::weak_ptr<vector_storage<T>>>(storage->id(),
-                                    std::weak_ptr<vector_storage<T>>(shared_t_storage)));
-
+            auto storage = storage_t::create(m_allocator);
+            storage->set_pin_tracker(m_pin_tracker);
+            m_control->insert(storage);
             return storage;
         }
 
         template <typename IterType>
         shared_base_t operator() (IterType start_pos, IterType end_pos)
         {
-            auto storage = vector_storage<T>::create(start_pos, end_pos);
-            auto shared_t_storage = std::static_pointer_cast<vector_storage<T>>(storage);
-            std::lock_guard<std::mutex> guard(m_control->m_mutex);
-            m_control->m_map.insert(std::pair<size_t, std::weak_ptr<vector_storage<T>>>(storage->id(),
-                                    std::weak_ptr<vector_storage<T>>(shared_t_storage)));
+            auto storage = storage_t::create(start_pos, end_pos, m_allocator);
+            storage->set_pin_tracker(m_pin_tracker);
+            m_control->insert(storage);
             return storage;
         }
 
         // Obtain a shared ptr to the storage identified by id. Returns an empty shared_ptr if not found
-        // or if the ptr has expired. Note the returned type is shared_t (std::shared_ptr<vector_storage<T>>)
+        // or if the ptr has expired. Note the returned type is shared_t (std::shared_ptr<storage_t>)
         shared_t locate(size_t id)
         {
-            std::lock_guard<std::mutex> guard(m_control->m_mutex);
-            auto result = m_control->m_map.find(id);
-            if (result == m_control->m_map.end())
-                return shared_t();
+            auto storage = m_control->locate(id);
+            if (storage)
+                PYBUFFER_STAT(T, stat_locate_hits, 1);
             else
-                return result->second.lock();
+                PYBUFFER_STAT(T, stat_locate_misses, 1);
+            return storage;
+        }
+
+        // Reclaim registry entries for storages which have been destroyed
+        void sweep()
+        {
+            m_control->sweep();
+        }
+
+        // Bytes pinned by python buffer exports of this creator's storages and their copies. Shared by
+        // copies of the creator.
+        const std::shared_ptr<buffer_pin_tracker>& pin_tracker() const
+        {
+            return m_pin_tracker;
         }
 
         private:
             std::shared_ptr<control_t> m_control;
+            std::shared_ptr<buffer_pin_tracker> m_pin_tracker;
+            Allocator m_allocator;
     };
 }
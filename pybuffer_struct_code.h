@@ -0,0 +1,724 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2020 Kuberan Naganathan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include <boost/pfr.hpp> // https://github.com/apolukhin/magic_get
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+// Generation of PEP 3118 / python struct format strings for pod struct types.
+// https://docs.python.org/3.8/library/struct.html
+// https://www.python.org/dev/peps/pep-3118/
+//
+// The format is derived from the layout of the struct: pfr reflection supplies the member types, member
+// offsets are measured on an instance (see struct_member_offsets) and every padding byte is emitted
+// explicitly as 'x'. Consecutive members with the same code are collapsed into a repeat count, arrays of
+// scalars become repeat counts and nested structs become T{...}, with arrays of nested structs written as
+// (N)T{...}. Codes are built once per type on first use and parsed back to check they describe exactly
+// sizeof(T) bytes with the measured offsets (see _layout_checked_code).
+
+
+namespace pybuffer_container_detail
+{
+    // Native struct code for a scalar type or 0 if T is not a scalar the struct module can describe
+    template <typename T>
+    constexpr char scalar_struct_code()
+    {
+        using U = std::remove_cv_t<T>;
+        if constexpr (std::is_enum<U>::value)
+            return scalar_struct_code<std::underlying_type_t<U>>();
+        else if constexpr (std::is_pointer<U>::value)
+            return 'P';
+        else if constexpr (std::is_same<U, bool>::value)
+            return '?';
+        else if constexpr (std::is_same<U, char>::value)
+            return 'c';
+        else if constexpr (std::is_same<U, signed char>::value) // std::int8_t
+            return 'b';
+        else if constexpr (std::is_same<U, unsigned char>::value) // std::uint8_t
+            return 'B';
+        else if constexpr (std::is_same<U, short>::value)
+            return 'h';
+        else if constexpr (std::is_same<U, unsigned short>::value)
+            return 'H';
+        else if constexpr (std::is_same<U, int>::value)
+            return 'i';
+        else if constexpr (std::is_same<U, unsigned int>::value)
+            return 'I';
+        else if constexpr (std::is_same<U, long>::value)
+            return 'l';
+        else if constexpr (std::is_same<U, unsigned long>::value)
+            return 'L';
+        else if constexpr (std::is_same<U, long long>::value)
+            return 'q';
+        else if constexpr (std::is_same<U, unsigned long long>::value)
+            return 'Q';
+        else if constexpr (std::is_same<U, float>::value)
+            return 'f';
+        else if constexpr (std::is_same<U, double>::value)
+            return 'd';
+        else // includes long double, whose 'g' code numpy understands but the struct module does not
+            return 0;
+    }
+
+
+    // Size in bytes of a native struct code
+    constexpr size_t struct_code_size(char code)
+    {
+        switch (code)
+        {
+            case 'x': case 'c': case 'b': case 'B': case '?': return 1;
+            case 'h': case 'H': return sizeof(short);
+            case 'i': case 'I': return sizeof(int);
+            case 'l': case 'L': return sizeof(long);
+            case 'q': case 'Q': return sizeof(long long);
+            case 'f': return sizeof(float);
+            case 'd': return sizeof(double);
+            case 'g': return sizeof(long double);
+            case 'P': return sizeof(void*);
+            default: return 0;
+        }
+    }
+
+
+    // Element type and total element count of C arrays and std::array, including multi dimensional ones
+    template <typename T>
+    struct _array_info
+    {
+        static constexpr bool is_array = false;
+        using element_type = T;
+        static constexpr size_t count = 1;
+    };
+
+    template <typename T, size_t N>
+    struct _array_info<T[N]>
+    {
+        static constexpr bool is_array = true;
+        using element_type = typename _array_info<T>::element_type;
+        static constexpr size_t count = N * _array_info<T>::count;
+    };
+
+    template <typename T, size_t N>
+    struct _array_info<std::array<T, N>>
+    {
+        static constexpr bool is_array = true;
+        using element_type = typename _array_info<T>::element_type;
+        static constexpr size_t count = N * _array_info<T>::count;
+    };
+
+
+    // Fixed size output sink usable at compile time, for generated member names
+    template <size_t N>
+    struct _char_array_sink
+    {
+        char m_data[N + 1] = {}; // null terminated
+        size_t m_size = 0;
+
+        constexpr void put(char c)
+        {
+            m_data[m_size++] = c;
+        }
+    };
+
+
+    template <typename Sink>
+    constexpr void _put_number(Sink& sink, size_t n)
+    {
+        char digits[20] = {};
+        size_t count = 0;
+        do
+        {
+            digits[count++] = static_cast<char>('0' + n % 10);
+            n /= 10;
+        } while (n);
+
+        while (count)
+            sink.put(digits[--count]);
+    }
+
+
+    // Collapses runs of the same scalar code into a single repeat counted code
+    template <typename Sink>
+    struct _struct_code_writer
+    {
+        Sink& m_sink;
+        char m_pending = 0;
+        size_t m_pending_count = 0;
+
+        constexpr void scalar(char code, size_t count)
+        {
+            if (code != m_pending)
+            {
+                flush();
+                m_pending = code;
+            }
+            m_pending_count += count;
+        }
+
+        constexpr void pad(size_t bytes)
+        {
+            if (bytes)
+                scalar('x', bytes);
+        }
+
+        constexpr void raw(char c)
+        {
+            flush();
+            m_sink.put(c);
+        }
+
+        constexpr void number(size_t n)
+        {
+            flush();
+            _put_number(m_sink, n);
+        }
+
+        constexpr void flush()
+        {
+            if (m_pending_count)
+            {
+                if (m_pending_count != 1)
+                    _put_number(m_sink, m_pending_count);
+                m_sink.put(m_pending);
+            }
+            m_pending = 0;
+            m_pending_count = 0;
+        }
+    };
+
+
+    // Byte offset of every top level member of StructType, measured through pfr on a value initialized
+    // instance. Offsets are never derived from alignof arithmetic since alignas on a member, e.g.
+    // struct {char a; alignas(4) char b; short c;}, moves it without changing its type.
+    template <typename StructType>
+    struct struct_member_offsets
+    {
+        static constexpr size_t count = boost::pfr::tuple_size_v<StructType>;
+
+        static const std::array<size_t, count>& value()
+        {
+            static const std::array<size_t, count> offsets = []()
+            {
+                // Heap allocated so large records do not land on the stack
+                std::unique_ptr<StructType> instance(new StructType{});
+                return measure(*instance, std::make_index_sequence<count>());
+            }();
+            return offsets;
+        }
+
+    private:
+        template <size_t ...I>
+        static std::array<size_t, count> measure(const StructType& instance, std::index_sequence<I...>)
+        {
+            const char * base = reinterpret_cast<const char*>(&instance);
+            return std::array<size_t, count>{{static_cast<size_t>(
+                reinterpret_cast<const char*>(&boost::pfr::get<I>(instance)) - base)...}};
+        }
+    };
+
+
+    template <typename StructType, typename Writer>
+    void _write_struct_body(Writer& writer);
+
+
+    template <typename StructType, typename Writer>
+    void _write_nested_struct(Writer& writer)
+    {
+        writer.raw('T');
+        writer.raw('{');
+        _write_struct_body<StructType>(writer);
+        writer.raw('}');
+    }
+
+
+    template <typename FieldType, typename Writer>
+    void _write_member(Writer& writer)
+    {
+        using info = _array_info<FieldType>;
+        using element_type = typename info::element_type;
+        if constexpr (scalar_struct_code<element_type>() != 0)
+        {
+            writer.scalar(scalar_struct_code<element_type>(), info::count);
+        }
+        else
+        {
+            static_assert(std::is_class<element_type>::value, "No python struct code for member type");
+            if constexpr (info::is_array)
+            {
+                writer.raw('(');
+                writer.number(info::count);
+                writer.raw(')');
+            }
+            _write_nested_struct<element_type>(writer);
+        }
+    }
+
+
+    // Codes are built inside function local static initializers reached from python callbacks, where an
+    // exception would cross the C API. A layout the code cannot describe is a build problem, so stop.
+    [[noreturn]] inline void _struct_code_fatal(const char * message, const std::string& code)
+    {
+        std::fprintf(stderr, "pybuffer_struct_code: %s: \"%s\"\n", message, code.c_str());
+        std::abort();
+    }
+
+
+    // Writes the member found at field_offset, preceded by padding from offset. Returns the offset just
+    // past the member.
+    template <typename FieldType, typename Writer>
+    size_t _write_field(Writer& writer, size_t offset, size_t field_offset)
+    {
+        if (field_offset < offset)
+            _struct_code_fatal("struct member offsets reported by pfr overlap", std::string());
+        writer.pad(field_offset - offset);
+        _write_member<FieldType>(writer);
+        return field_offset + sizeof(FieldType);
+    }
+
+
+    template <typename StructType, typename Writer, size_t ...I>
+    void _write_struct_fields(Writer& writer, std::index_sequence<I...>)
+    {
+        const auto& field_offsets = struct_member_offsets<StructType>::value();
+        size_t offset = 0;
+        ((offset = _write_field<boost::pfr::tuple_element_t<I, StructType>>(writer, offset, field_offsets[I])), ...);
+        writer.pad(sizeof(StructType) - offset);
+    }
+
+
+    template <typename StructType, typename Writer>
+    void _write_struct_body(Writer& writer)
+    {
+        static_assert(std::is_trivially_copyable<StructType>::value, "StructType must be trivially copyable");
+        _write_struct_fields<StructType>(writer, std::make_index_sequence<boost::pfr::tuple_size_v<StructType>>());
+    }
+
+
+    template <typename StructType, typename Sink>
+    void write_pystruct_code(Sink& sink)
+    {
+        _struct_code_writer<Sink> writer{sink};
+        _write_struct_body<StructType>(writer);
+        writer.flush();
+    }
+
+
+    struct _string_sink
+    {
+        std::string m_data;
+
+        void put(char c)
+        {
+            m_data.push_back(c);
+        }
+    };
+
+
+    inline std::string _layout_checked_code(const std::string& code, size_t expected_size);
+
+
+    // The python struct code for StructType as a null terminated string with static storage duration, so
+    // exporters can point Py_buffer::format straight at it. Built once, on first use, rather than as a
+    // constexpr array: the padding comes from measured member offsets, which C++17 cannot take at compile
+    // time, and a code computed from assumed natural alignment was wrong for alignas members.
+    template <typename StructType>
+    const char * get_py_struct_code()
+    {
+        static const std::string code = []()
+        {
+            _string_sink sink;
+            write_pystruct_code<StructType>(sink);
+            return _layout_checked_code(sink.m_data, sizeof(StructType));
+        }();
+        return code.c_str();
+    }
+
+
+    // Struct code for a single member type on its own, e.g. "d", "64L" or "T{c7xd}"
+    template <typename FieldType>
+    struct py_member_code
+    {
+        static const char * value()
+        {
+            static const std::string code = []()
+            {
+                _string_sink sink;
+                _struct_code_writer<_string_sink> writer{sink};
+                _write_member<FieldType>(writer);
+                writer.flush();
+                return _layout_checked_code(sink.m_data, sizeof(FieldType));
+            }();
+            return code.c_str();
+        }
+    };
+
+
+    // pfr reflection does not provide member names. Specialize this to give the members of StructType
+    // python visible names, e.g.
+    //     template <> struct py_struct_field_names<quote> { static constexpr const char * value[] = {"bid", "ask"}; };
+    // Without a specialization members are named f0, f1, ... following numpy.
+    template <typename StructType>
+    struct py_struct_field_names
+    {};
+
+
+    template <typename StructType, typename = void>
+    struct _has_field_names: std::false_type
+    {};
+
+    template <typename StructType>
+    struct _has_field_names<StructType, std::void_t<decltype(py_struct_field_names<StructType>::value)>>: std::true_type
+    {};
+
+
+    template <size_t I>
+    struct _default_field_name
+    {
+        static constexpr _char_array_sink<21> buffer = []()
+        {
+            _char_array_sink<21> sink;
+            sink.put('f');
+            _put_number(sink, I);
+            return sink;
+        }();
+
+        static constexpr const char * value = buffer.m_data;
+    };
+
+    struct py_struct_field
+    {
+        const char * name;
+        size_t offset; // byte offset of the member within the struct
+        size_t size; // sizeof the member
+        const char * format; // struct code of the member with static storage duration
+    };
+
+
+    // Name, offset, size and format of every top level member of StructType. Offsets are the measured
+    // struct_member_offsets also used to generate the struct code, so the two always agree.
+    template <typename StructType>
+    struct py_struct_fields
+    {
+        static constexpr size_t count = boost::pfr::tuple_size_v<StructType>;
+
+        template <size_t I>
+        using field_type = boost::pfr::tuple_element_t<I, StructType>;
+
+        template <size_t ...I>
+        static std::array<py_struct_field, count> make(std::index_sequence<I...>)
+        {
+            const auto& offsets = struct_member_offsets<StructType>::value();
+            return std::array<py_struct_field, count>{{
+                py_struct_field{name<I>(), offsets[I], sizeof(field_type<I>), py_member_code<field_type<I>>::value()}...}};
+        }
+
+        template <size_t I>
+        static constexpr const char * name()
+        {
+            if constexpr (_has_field_names<StructType>::value)
+                return py_struct_field_names<StructType>::value[I];
+            else
+                return _default_field_name<I>::value;
+        }
+
+        static const std::array<py_struct_field, count>& value()
+        {
+            static const std::array<py_struct_field, count> fields = make(std::make_index_sequence<count>());
+            return fields;
+        }
+
+        // Returns nullptr if StructType has no member with the given name
+        static const py_struct_field * find(const char * name)
+        {
+            for (auto& field: value())
+                if (std::strcmp(field.name, name) == 0)
+                    return &field;
+            return nullptr;
+        }
+    };
+
+
+    // One scalar of a buffer format flattened to byte offsets. kind is 'i' signed integer, 'u' unsigned
+    // integer, 'f' floating point, '?' bool, 's' a byte of a char or string and 'P' a pointer.
+    struct py_format_item
+    {
+        size_t offset;
+        char kind;
+        size_t size;
+
+        bool operator == (const py_format_item& rhs) const
+        {
+            return offset == rhs.offset && kind == rhs.kind && size == rhs.size;
+        }
+    };
+
+
+    // Runtime parser for PEP 3118 formats as exported by numpy and memoryview, e.g. "T{i:a:xxxxd:b:}" or
+    // "T{i:a:=d:b:}". Member names are skipped, repeat counts and (n,m) shapes are expanded, and the
+    // byte order character is sticky as in numpy: '@' uses native sizes and alignment, '^' native sizes
+    // without alignment and '=', '<', '>' and '!' standard sizes without alignment. Formats in a foreign
+    // byte order are rejected.
+    class _py_format_parser
+    {
+    public:
+        explicit _py_format_parser(const char * format):
+        m_pos(format),
+        m_mode('@')
+        {}
+
+        // Returns false if the format is malformed or has no native layout
+        bool parse(std::vector<py_format_item>& items, size_t& size)
+        {
+            size_t alignment;
+            return parse_struct(items, size, alignment) && !*m_pos;
+        }
+
+    private:
+        static bool little_endian()
+        {
+            const unsigned short probe = 1;
+            return *reinterpret_cast<const unsigned char*>(&probe) == 1;
+        }
+
+        bool native_sizes() const
+        {
+            return m_mode == '@' || m_mode == '^';
+        }
+
+        // Size of a scalar code in the current mode, 0 if it has none
+        size_t scalar_size(char code) const
+        {
+            if (native_sizes())
+            {
+                switch (code)
+                {
+                    case 'n': case 'N': return sizeof(size_t);
+                    case 'e': return 2;
+                    default: return struct_code_size(code);
+                }
+            }
+
+            switch (code)
+            {
+                case 'c': case 'b': case 'B': case '?': return 1;
+                case 'h': case 'H': case 'e': return 2;
+                case 'i': case 'I': case 'l': case 'L': case 'f': return 4;
+                case 'q': case 'Q': case 'd': return 8;
+                default: return 0;
+            }
+        }
+
+        static char scalar_kind(char code)
+        {
+            switch (code)
+            {
+                case 'b': case 'h': case 'i': case 'l': case 'q': case 'n': return 'i';
+                case 'B': case 'H': case 'I': case 'L': case 'Q': case 'N': return 'u';
+                case 'e': case 'f': case 'd': case 'g': return 'f';
+                case 'c': return 's';
+                default: return code; // '?' and 'P'
+            }
+        }
+
+        size_t parse_number()
+        {
+            size_t n = 0;
+            while (*m_pos >= '0' && *m_pos <= '9')
+                n = n * 10 + (*m_pos++ - '0');
+            return n;
+        }
+
+        static size_t align_up(size_t offset, size_t alignment)
+        {
+            return (offset + alignment - 1) / alignment * alignment;
+        }
+
+        void add(std::vector<py_format_item>& items, size_t offset, char kind, size_t size)
+        {
+            items.push_back(py_format_item{offset, kind, size});
+        }
+
+        // Parses members up to a closing '}' or the end of the format
+        bool parse_struct(std::vector<py_format_item>& items, size_t& size, size_t& alignment)
+        {
+            size_t offset = 0;
+            alignment = 1;
+            while (*m_pos && *m_pos != '}')
+            {
+                const char c = *m_pos;
+                if (c == ' ' || c == '\n' || c == '\t')
+                {
+                    ++m_pos;
+                    continue;
+                }
+
+                if (c == '@' || c == '=' || c == '<' || c == '>' || c == '!' || c == '^')
+                {
+                    const bool big = c == '>' || c == '!';
+                    if ((c == '<' && !little_endian()) || (big && little_endian()))
+                        return false;
+                    m_mode = c;
+                    ++m_pos;
+                    continue;
+                }
+
+                size_t count = 1;
+                if (c == '(')
+                {
+                    ++m_pos;
+                    for (;;)
+                    {
+                        if (*m_pos < '0' || *m_pos > '9')
+                            return false;
+                        count *= parse_number();
+                        if (*m_pos == ')')
+                            break;
+                        if (*m_pos++ != ',')
+                            return false;
+                    }
+                    ++m_pos;
+                }
+                else if (c >= '0' && c <= '9')
+                {
+                    count = parse_number();
+                }
+
+                const char code = *m_pos++;
+                if (code == 'T')
+                {
+                    if (*m_pos++ != '{')
+                        return false;
+                    std::vector<py_format_item> members;
+                    size_t member_size, member_alignment;
+                    if (!parse_struct(members, member_size, member_alignment) || *m_pos++ != '}')
+                        return false;
+
+                    if (m_mode == '@')
+                    {
+                        member_size = align_up(member_size, member_alignment);
+                        offset = align_up(offset, member_alignment);
+                        alignment = std::max(alignment, member_alignment);
+                    }
+                    for (size_t index = 0; index < count; ++index, offset += member_size)
+                        for (auto& member: members)
+                            add(items, offset + member.offset, member.kind, member.size);
+                }
+                else if (code == 'x')
+                {
+                    offset += count;
+                }
+                else if (code == 's' || code == 'p')
+                {
+                    // One string member of count bytes, compared byte by byte with char arrays
+                    for (size_t index = 0; index < count; ++index)
+                        add(items, offset++, 's', 1);
+                }
+                else
+                {
+                    const size_t item_size = scalar_size(code);
+                    if (!item_size)
+                        return false;
+                    if (m_mode == '@')
+                    {
+                        const size_t item_alignment = code == 'g' ? alignof(long double) : item_size;
+                        offset = align_up(offset, item_alignment);
+                        alignment = std::max(alignment, item_alignment);
+                    }
+                    for (size_t index = 0; index < count; ++index, offset += item_size)
+                        add(items, offset, scalar_kind(code), item_size);
+                }
+
+                // Optional member name, ":name:"
+                if (*m_pos == ':')
+                {
+                    const char * end = std::strchr(m_pos + 1, ':');
+                    if (!end)
+                        return false;
+                    m_pos = end + 1;
+                }
+            }
+            size = offset;
+            return true;
+        }
+
+        const char * m_pos;
+        char m_mode;
+    };
+
+
+    // Flattens a PEP 3118 format into its scalars. Returns false if the format cannot be parsed or is in
+    // a foreign byte order.
+    inline bool flatten_py_format(const char * format, std::vector<py_format_item>& items, size_t& size)
+    {
+        items.clear();
+        return _py_format_parser(format).parse(items, size);
+    }
+
+
+    // Readers parse a code without a byte order prefix in native '@' mode and add their own alignment
+    // padding. That agrees with the measured layout for ordinary records, whose padding the writer has
+    // already made explicit. A packed or under aligned record would decode to other offsets, so its code
+    // gets a '^' prefix, native sizes without alignment, which makes the explicit padding authoritative.
+    inline std::string _layout_checked_code(const std::string& code, size_t expected_size)
+    {
+        std::vector<py_format_item> exact, native;
+        size_t exact_size = 0, native_size = 0;
+        const std::string unaligned = "^" + code;
+        if (!flatten_py_format(unaligned.c_str(), exact, exact_size) || exact_size != expected_size)
+            _struct_code_fatal("struct code does not describe sizeof the type", code);
+        if (flatten_py_format(code.c_str(), native, native_size) && native_size == expected_size && native == exact)
+            return code;
+        return unaligned;
+    }
+
+
+    // True when a buffer with this format and itemsize holds StructType records: every scalar has the
+    // same offset, kind and size. Names, padding notation and byte order spelling may differ, so numpy
+    // structured arrays with or without align=True match when their fields line up with StructType.
+    template <typename StructType>
+    bool py_format_matches(const char * format, size_t itemsize)
+    {
+        static const std::vector<py_format_item> expected = []() {
+            std::vector<py_format_item> items;
+            size_t size;
+            flatten_py_format(get_py_struct_code<StructType>(), items, size);
+            return items;
+        }();
+
+        if (itemsize != sizeof(StructType))
+            return false;
+        std::vector<py_format_item> items;
+        size_t size;
+        return flatten_py_format(format, items, size) && size <= itemsize && items == expected;
+    }
+}